@@ -0,0 +1,558 @@
+/*
+  tiffbench - decode a corpus of TIFF files and report throughput
+
+  Usage: tiffbench [-r repeats] [-t threads[,threads...]] [-s scale] [-v] file-or-directory ...
+
+  Directories are searched for .tif and .tiff files. Each file is read
+  into memory and decoded once to warm up, then repeats times with the
+  clock running, for each thread count. Every run is made in a child
+  process, so the peak resident set size reported is that of one file
+  at one thread count.
+
+  For each file and thread count we print MB/s (of the file as stored)
+  and megapixels a second, and then the megapixels a second for all
+  the files together, broken down by compression, photometric type,
+  strip or tile layout, planar configuration and bit depth.
+
+  With -v, and the loader built with LOADTIFF_STATS, each row is 
+  followed by where the time went in one decode, in milliseconds 
+  summed over the threads, and the reads and allocations it made.
+
+  This needs a POSIX system (fork, pipes and getrusage).
+*/
+/* clock_gettime() and CLOCK_MONOTONIC under -std=c99 */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "loadtiff.h"
+
+#define MAXTHREADS 16
+#define MAXGROUPS 32
+
+/* what a child process sends back */
+typedef struct
+{
+	int ok;
+	int width;
+	int height;
+	double seconds;        /* for all the repeats */
+	long peakkb;           /* peak resident set size */
+	TIFFSTATS stats;       /* for all the repeats */
+} RUNRESULT;
+
+/* a class of files, for the summary tables */
+typedef struct
+{
+	char name[32];
+	int Nfiles;
+	double pixels[MAXTHREADS];
+	double seconds[MAXTHREADS];
+} GROUP;
+
+typedef struct
+{
+	const char *title;
+	GROUP groups[MAXGROUPS];
+	int Ngroups;
+} BREAKDOWN;
+
+#define BY_COMPRESSION 0
+#define BY_PHOTOMETRIC 1
+#define BY_LAYOUT 2
+#define BY_PLANAR 3
+#define BY_DEPTH 4
+#define NBREAKDOWNS 5
+
+static int repeats = 5;
+static int threads[MAXTHREADS] = {1};
+static int Nthreads = 1;
+static int scale = 1;
+static int verbose = 0;
+static BREAKDOWN breakdowns[NBREAKDOWNS];
+static const char *breakdowntitles[NBREAKDOWNS] =
+{
+	"compression", "photometric", "layout", "planar config", "bit depth"
+};
+
+static void benchpath(const char *path);
+static void benchfile(const char *fname);
+static int runchild(const char *fname, int nthreads, RUNRESULT *result);
+static void decoderuns(const char *fname, int nthreads, RUNRESULT *result);
+static unsigned char *slurp(const char *fname, size_t *len);
+static void describe(const TIFFINFO *info, const char *names[NBREAKDOWNS], char depth[32]);
+static const char *compressionname(int compression);
+static const char *photometricname(int photometric);
+static void printstats(const TIFFSTATS *stats);
+static void addtogroup(BREAKDOWN *bd, const char *name, int t, double pixels, double seconds, int first);
+static void printbreakdown(const BREAKDOWN *bd);
+static int istiffname(const char *fname);
+static int parsethreads(const char *str);
+static double now(void);
+static void usage(void);
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	for (i = 0; i < NBREAKDOWNS; i++)
+		breakdowns[i].title = breakdowntitles[i];
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-r") && i + 1 < argc)
+			repeats = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+		{
+			if (parsethreads(argv[++i]))
+				usage();
+		}
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			scale = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-v"))
+			verbose = 1;
+		else if (argv[i][0] == '-')
+			usage();
+		else
+			break;
+	}
+	if (i == argc || repeats < 1 || scale < 1)
+		usage();
+#ifndef LOADTIFF_STATS
+	if (verbose)
+		fprintf(stderr, "tiffbench: built without LOADTIFF_STATS, -v shows nothing\n");
+#endif
+
+	printf("%-28s %-10s %-11s %-6s %-7s %-5s %7s %9s %9s %9s\n",
+		"file", "compress", "photometric", "layout", "planar", "bits", "threads", "MB/s", "MP/s", "peak MB");
+	for (; i < argc; i++)
+		benchpath(argv[i]);
+
+	for (i = 0; i < NBREAKDOWNS; i++)
+		printbreakdown(&breakdowns[i]);
+
+	return 0;
+}
+
+/*
+  benchmark a file, or all the TIFFs under a directory
+*/
+static void benchpath(const char *path)
+{
+	struct stat st;
+	DIR *dir;
+	struct dirent *de;
+	char *child;
+
+	if (stat(path, &st))
+	{
+		fprintf(stderr, "can't open %s\n", path);
+		return;
+	}
+	if (!S_ISDIR(st.st_mode))
+	{
+		benchfile(path);
+		return;
+	}
+	dir = opendir(path);
+	if (!dir)
+		return;
+	while ((de = readdir(dir)) != 0)
+	{
+		if (de->d_name[0] == '.')
+			continue;
+		child = malloc(strlen(path) + strlen(de->d_name) + 2);
+		if (!child)
+			break;
+		sprintf(child, "%s/%s", path, de->d_name);
+		if (stat(child, &st) == 0 && (S_ISDIR(st.st_mode) || istiffname(child)))
+			benchpath(child);
+		free(child);
+	}
+	closedir(dir);
+}
+
+/*
+  benchmark one file at each thread count, print a row for each and
+  add it to the summaries
+*/
+static void benchfile(const char *fname)
+{
+	unsigned char *data;
+	size_t len;
+	TIFFIO io;
+	TIFFINFO info;
+	RUNRESULT result;
+	const char *names[NBREAKDOWNS];
+	char depth[32];
+	const char *base;
+	double pixels;
+	int i, t;
+
+	data = slurp(fname, &len);
+	if (!data)
+	{
+		fprintf(stderr, "can't read %s\n", fname);
+		return;
+	}
+	io.ptr = 0;
+	io.read = 0;
+	io.data = data;
+	io.len = len;
+	if (loadtiff_probe(&io, &info))
+	{
+		fprintf(stderr, "%s: can't decode\n", fname);
+		free(data);
+		return;
+	}
+	free(data);
+	describe(&info, names, depth);
+	base = strrchr(fname, '/') ? strrchr(fname, '/') + 1 : fname;
+
+	for (t = 0; t < Nthreads; t++)
+	{
+		if (runchild(fname, threads[t], &result) || !result.ok)
+		{
+			fprintf(stderr, "%s: decode failed\n", fname);
+			return;
+		}
+		pixels = (double) info.width * info.height * repeats;
+		printf("%-28.28s %-10s %-11s %-6s %-7s %-5s %7d %9.1f %9.1f %9.1f\n",
+			base, names[BY_COMPRESSION], names[BY_PHOTOMETRIC], names[BY_LAYOUT], names[BY_PLANAR], depth,
+			threads[t], (double) len * repeats / result.seconds / 1e6,
+			pixels / result.seconds / 1e6, result.peakkb / 1024.0);
+		if (verbose)
+			printstats(&result.stats);
+		fflush(stdout);
+		for (i = 0; i < NBREAKDOWNS; i++)
+			addtogroup(&breakdowns[i], i == BY_DEPTH ? depth : names[i], t, pixels, result.seconds, t == 0);
+	}
+}
+
+/*
+  decode a file in a child process, so its memory use is its own
+    Params: fname - the file
+            nthreads - threads to decode on
+            result - return for the timings
+    Returns: 0 on success, -1 if the child couldn't be run
+*/
+static int runchild(const char *fname, int nthreads, RUNRESULT *result)
+{
+	int fd[2];
+	pid_t pid;
+	int status;
+	ssize_t got;
+
+	if (pipe(fd))
+		return -1;
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+	{
+		close(fd[0]);
+		close(fd[1]);
+		return -1;
+	}
+	if (pid == 0)
+	{
+		close(fd[0]);
+		decoderuns(fname, nthreads, result);
+		if (write(fd[1], result, sizeof(RUNRESULT)) != sizeof(RUNRESULT))
+			_exit(1);
+		_exit(0);
+	}
+	close(fd[1]);
+	got = read(fd[0], result, sizeof(RUNRESULT));
+	close(fd[0]);
+	waitpid(pid, &status, 0);
+
+	return got == sizeof(RUNRESULT) ? 0 : -1;
+}
+
+/*
+  the child's work, decode the file repeats times and time it
+*/
+static void decoderuns(const char *fname, int nthreads, RUNRESULT *result)
+{
+	unsigned char *data;
+	size_t len;
+	TIFFIO io;
+	TIFFOPTIONS opt;
+	struct rusage usage;
+	unsigned char *raster;
+	int width, height, format;
+	double start;
+	int i;
+
+	result->ok = 0;
+	result->seconds = 0;
+	result->peakkb = 0;
+	memset(&result->stats, 0, sizeof(TIFFSTATS));
+	data = slurp(fname, &len);
+	if (!data)
+		return;
+	io.ptr = 0;
+	io.read = 0;
+	io.data = data;
+	io.len = len;
+	loadtiff_defaultoptions(&opt);
+	opt.nthreads = nthreads;
+	opt.scale = scale;
+
+	raster = loadtiff_ex(&io, &opt, &width, &height, &format);
+	if (!raster)
+		goto done;
+	free(raster);
+	opt.stats = &result->stats;
+	start = now();
+	for (i = 0; i < repeats; i++)
+	{
+		raster = loadtiff_ex(&io, &opt, &width, &height, &format);
+		if (!raster)
+			goto done;
+		free(raster);
+	}
+	result->seconds = now() - start;
+	result->width = width;
+	result->height = height;
+	result->ok = 1;
+
+done:
+	free(data);
+	getrusage(RUSAGE_SELF, &usage);
+	result->peakkb = usage.ru_maxrss;
+}
+
+/*
+  print where the time went in one decode
+*/
+static void printstats(const TIFFSTATS *stats)
+{
+	static const char *codecs[TIFFSTATS_CODECS] =
+	{
+		"none", "CCITT RLE", "Group 3", "Group 4", "LZW", "deflate", "PackBits", "other"
+	};
+	double ms = 1e6 * repeats;
+	int i;
+
+	printf("    parse %.3f io %.3f", stats->parse_ns / ms, stats->io_ns / ms);
+	for (i = 0; i < TIFFSTATS_CODECS; i++)
+		if (stats->decompress_ns[i])
+			printf(" %s %.3f", codecs[i], stats->decompress_ns[i] / ms);
+	printf(" unpack %.3f palette %.3f YCbCr %.3f deep %.3f predictor %.3f paste %.3f ms\n",
+		stats->unpack_ns / ms, stats->palette_ns / ms, stats->ycbcr_ns / ms, stats->deep_ns / ms,
+		stats->predictor_ns / ms, stats->paste_ns / ms);
+	printf("    %llu strips/tiles, %llu reads of %llu bytes, %llu allocations, %llu -> %llu bytes decompressed\n",
+		stats->units / repeats, stats->reads / repeats, stats->bytesread / repeats,
+		stats->allocations / repeats, stats->compressedbytes / repeats, stats->decompressedbytes / repeats);
+}
+
+/*
+  read a whole file into memory
+*/
+static unsigned char *slurp(const char *fname, size_t *len)
+{
+	FILE *fp;
+	unsigned char *answer = 0;
+	long size;
+
+	fp = fopen(fname, "rb");
+	if (!fp)
+		return 0;
+	if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0)
+	{
+		answer = malloc(size ? size : 1);
+		if (answer && fread(answer, 1, size, fp) != (size_t) size)
+		{
+			free(answer);
+			answer = 0;
+		}
+		*len = size;
+	}
+	fclose(fp);
+
+	return answer;
+}
+
+/*
+  name the classes a file falls into
+    Params: info - what the file holds
+            names - return for the class names
+            depth - return for the bit depth, "8", "16", "32f" etc
+*/
+static void describe(const TIFFINFO *info, const char *names[NBREAKDOWNS], char depth[32])
+{
+	names[BY_COMPRESSION] = compressionname(info->compression);
+	names[BY_PHOTOMETRIC] = photometricname(info->photometric);
+	names[BY_LAYOUT] = info->tiled ? "tile" : "strip";
+	names[BY_PLANAR] = info->planarconfig == 2 ? "planar" : "chunky";
+	names[BY_DEPTH] = depth;
+	sprintf(depth, "%d%s", info->bitspersample[0], info->sampleformat[0] == 3 ? "f" : "");
+}
+
+static const char *compressionname(int compression)
+{
+	switch (compression)
+	{
+	case 1:
+		return "none";
+	case 2:
+		return "CCITT RLE";
+	case 3:
+		return "Group 3";
+	case 4:
+		return "Group 4";
+	case 5:
+		return "LZW";
+	case 8:
+	case 32946:
+		return "Deflate";
+	case 32773:
+		return "PackBits";
+	}
+	return "other";
+}
+
+static const char *photometricname(int photometric)
+{
+	switch (photometric)
+	{
+	case 0:
+	case 1:
+		return "grey";
+	case 2:
+		return "RGB";
+	case 3:
+		return "palette";
+	case 5:
+		return "CMYK";
+	case 6:
+		return "YCbCr";
+	}
+	return "other";
+}
+
+/*
+  add a run to the group it belongs to
+    Params: bd - the breakdown
+            name - the group
+            t - index of the thread count
+            pixels - pixels decoded
+            seconds - time taken
+            first - set for the first thread count, to count the file
+*/
+static void addtogroup(BREAKDOWN *bd, const char *name, int t, double pixels, double seconds, int first)
+{
+	int i;
+
+	for (i = 0; i < bd->Ngroups; i++)
+		if (!strcmp(bd->groups[i].name, name))
+			break;
+	if (i == bd->Ngroups)
+	{
+		if (bd->Ngroups == MAXGROUPS)
+			return;
+		memset(&bd->groups[i], 0, sizeof(GROUP));
+		sprintf(bd->groups[i].name, "%.31s", name);
+		bd->Ngroups++;
+	}
+	if (first)
+		bd->groups[i].Nfiles++;
+	bd->groups[i].pixels[t] += pixels;
+	bd->groups[i].seconds[t] += seconds;
+}
+
+/*
+  print megapixels a second for each group of a breakdown, a column
+  for each thread count
+*/
+static void printbreakdown(const BREAKDOWN *bd)
+{
+	const GROUP *g;
+	char heading[32];
+	int i, t;
+
+	printf("\nby %s\n", bd->title);
+	printf("%-14s %5s", "", "files");
+	for (t = 0; t < Nthreads; t++)
+	{
+		sprintf(heading, "MP/s %dT", threads[t]);
+		printf(" %10s", heading);
+	}
+	printf("\n");
+	for (i = 0; i < bd->Ngroups; i++)
+	{
+		g = &bd->groups[i];
+		printf("%-14s %5d", g->name, g->Nfiles);
+		for (t = 0; t < Nthreads; t++)
+			printf(" %10.1f", g->seconds[t] > 0 ? g->pixels[t] / g->seconds[t] / 1e6 : 0.0);
+		printf("\n");
+	}
+}
+
+static int istiffname(const char *fname)
+{
+	const char *ext = strrchr(fname, '.');
+
+	if (!ext)
+		return 0;
+	return !strcmp(ext, ".tif") || !strcmp(ext, ".tiff") || !strcmp(ext, ".TIF") || !strcmp(ext, ".TIFF");
+}
+
+/*
+  parse a comma separated list of thread counts
+    Returns: 0 on success, -1 if it isn't valid
+*/
+static int parsethreads(const char *str)
+{
+	char *end;
+	long n;
+
+	Nthreads = 0;
+	while (*str)
+	{
+		n = strtol(str, &end, 10);
+		if (end == str || n < 1 || n > 1024 || Nthreads == MAXTHREADS)
+			return -1;
+		threads[Nthreads++] = (int) n;
+		str = end;
+		if (*str == ',')
+			str++;
+		else if (*str)
+			return -1;
+	}
+
+	return Nthreads ? 0 : -1;
+}
+
+/*
+  wall clock time in seconds
+*/
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "tiffbench: decode TIFF files and report throughput\n");
+	fprintf(stderr, "Usage: tiffbench [-r repeats] [-t threads[,threads...]] [-s scale] [-v] file-or-directory ...\n");
+	fprintf(stderr, "  -r  timed decodes of each file (default 5)\n");
+	fprintf(stderr, "  -t  thread counts to try, e.g. 1,2,4,8 (default 1)\n");
+	fprintf(stderr, "  -s  decode shrunk by 2, 4 or 8 (default 1)\n");
+	fprintf(stderr, "  -v  show where the time went (needs LOADTIFF_STATS)\n");
+	exit(EXIT_FAILURE);
+}
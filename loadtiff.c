@@ -11,12 +11,50 @@
   Free for public use
   Acknowlegements, Lode Vandevenne for the Zlib decompressor
 */
+/* 
+  fseeko() and a 64 bit off_t, so BigTIFFs read through a FILE * work
+  on 32 bit hosts, and clock_gettime() for the stats timer
+*/
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
 #include <math.h>
 
+#if !defined(LOADTIFF_NO_MMAP) && (defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__)))
+#define LOADTIFF_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef LOADTIFF_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+#ifdef LOADTIFF_STATS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#endif
+
 #include "loadtiff.h"
 
 #define TAG_BYTE 1
@@ -24,6 +62,8 @@
 #define TAG_SHORT 3
 #define TAG_LONG 4
 #define TAG_RATIONAL 5
+#define TAG_LONG8 16
+#define TAG_IFD8 18
 
 /* data types
 1 BYTE 8 - bit unsigned integer 
@@ -313,6 +353,23 @@ ExtraSamples 338 SHORT
 */
 
 
+/* unpacks a row of samples, picked per image by chooseunpacker() */
+struct basic_header;
+typedef struct unpacker UNPACKER;
+typedef void (*UNPACKFUNC)(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up);
+
+struct unpacker
+{
+	UNPACKFUNC fn;
+	int Nin;             /* samples per pixel in the data */
+	int Nout;            /* samples per pixel wanted */
+	int step;            /* samples from one output pixel to the next */
+	int bits;            /* bits in the first sample */
+	int rowbits;         /* bits per pixel in the data */
+	int sample_index;    /* first sample, or the plane */
+	const struct basic_header *header;  /* the image, for tables and odd layouts */
+};
+
 typedef struct basic_header
 {
 	unsigned long newsubfiletype;
@@ -322,11 +379,11 @@ typedef struct basic_header
 	int compression;
 	int fillorder;
 	int photometricinterpretation;
-	unsigned long *stripoffsets;
+	TIFFOFFSET *stripoffsets;
 	int Nstripoffsets;
 	int samplesperpixel;
 	int rowsperstrip;
-	unsigned long *stripbytecounts;
+	TIFFOFFSET *stripbytecounts;
 	int Nstripbytecounts;
 	double xresolution;
 	double yresolution;
@@ -334,6 +391,8 @@ typedef struct basic_header
 /*  Palette files */
 	unsigned char *colormap;
 	int Ncolormap;
+	unsigned char *palette;    /* colormap as RGBA, indexed directly */
+	int Npalette;
 	/* RGB */
 	int planarconfiguration;
 	int predictor;
@@ -359,9 +418,9 @@ typedef struct basic_header
 	/* tiling */
 	int tilewidth;
 	int tileheight;
-	unsigned long *tileoffsets;
+	TIFFOFFSET *tileoffsets;
 	int Ntileoffsets;
-	unsigned long *tilebytecounts;
+	TIFFOFFSET *tilebytecounts;
 	int Ntilebytecounts;
 	/* Malcolm easier to support this now*/
 	int sampleformat[16];
@@ -371,6 +430,14 @@ typedef struct basic_header
 	int Nsminsamplevalue;
         int extrasamples;
 	int endianness;
+	int samplebytes;     /* bytes in an output sample, 1, 2 or 4 (float) */
+	UNPACKER unpacker[16];  /* one per plane for separate planes */
+	unsigned char packedlut[256][8];  /* a byte of 1, 2 or 4 bit samples */
+	int packedlutbits;   /* bits the table is for, or 0 */
+	int page;            /* the page, for the cache */
+#ifdef LOADTIFF_STATS
+	TIFFSTATS *stats;    /* set on the copy a decode works from */
+#endif
 } BASICHEADER;
 
 struct tifftag
@@ -394,13 +461,194 @@ typedef struct
 
 typedef struct
 {
-	unsigned char *data;
+	const unsigned char *data;
 	int N;
 	int pos;
 	int bit;
 	int endianness;
 } BSTREAM;
 
+/*
+  where the file bytes come from. Either the caller's read callback, or
+  a block of memory (a caller's buffer or a mapped file), which we can
+  read in place
+*/
+typedef struct
+{
+	TIFFIO io;
+	const unsigned char *data;
+	TIFFOFFSET N;
+	int bigtiff;    /* 8 byte offsets and 20 byte IFD entries */
+	struct tiffcache *cache;  /* decoded strips and tiles, or 0 */
+	unsigned long fileid;     /* the file in the cache */
+#ifdef LOADTIFF_STATS
+	TIFFSTATS *stats;         /* reads are counted here, if set */
+#endif
+} TIFFSOURCE;
+
+#ifdef LOADTIFF_THREADS
+#ifdef _WIN32
+typedef CRITICAL_SECTION LOCK;
+typedef HANDLE THREAD;
+#else
+typedef pthread_mutex_t LOCK;
+typedef pthread_t THREAD;
+#endif
+#endif
+
+/*
+  decoded strips and tiles, kept by a cache shared between open files.
+  Entries are spread over shards by their key, each shard with its own
+  lock, hash table, least recently used list and share of the budget.
+*/
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 1024
+
+typedef struct
+{
+	unsigned long fileid;    /* given to the file by the cache */
+	int page;
+	int index;               /* the strip or tile */
+	int samplebytes;         /* depth it was decoded to */
+} CACHEKEY;
+
+typedef struct cacheentry
+{
+	CACHEKEY key;
+	unsigned char *pixels;   /* the whole strip or tile, in the output format */
+	size_t Nbytes;
+	struct cacheentry *prev; /* least recently used list, newest first */
+	struct cacheentry *next;
+	struct cacheentry *chain;  /* next in the hash bucket */
+} CACHEENTRY;
+
+typedef struct
+{
+	CACHEENTRY *buckets[CACHE_BUCKETS];
+	CACHEENTRY *newest;
+	CACHEENTRY *oldest;
+	size_t bytes;
+	size_t maxbytes;
+	unsigned long entries;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+#ifdef LOADTIFF_THREADS
+	LOCK lock;
+#endif
+} CACHESHARD;
+
+struct tiffcache
+{
+	CACHESHARD *shards;
+	int Nshards;
+	unsigned long nextid;
+#ifdef LOADTIFF_THREADS
+	LOCK lock;               /* guards nextid */
+#endif
+};
+
+/*
+  multi-page file. The IFD offsets are found by following the chain 
+  of next IFD pointers, as far as we have needed to go so far. Pages 
+  are parsed the first time they are used and the headers kept, and 
+  nothing about a decode is stored here, so with the lock any number
+  of threads can decode from it at once.
+*/
+struct tifffile
+{
+	TIFFSOURCE src;
+	int type;
+	TIFFOFFSET *ifds;
+	BASICHEADER **headers;   /* parsed pages, 0 until first used */
+	int *ifdhash;            /* page + 1 for each IFD offset, or 0 */
+	int Nifdhash;            /* slots in ifdhash, a power of 2 */
+	int Nifds;
+	int capacity;
+	int complete;
+#ifdef LOADTIFF_THREADS
+	LOCK lock;               /* guards the page list and headers */
+#endif
+};
+
+/*
+  the strips, tiles or planes of an image, handed out to decoders
+*/
+#define UNIT_STRIP 1
+#define UNIT_TILE 2
+#define UNIT_PLANE 3
+#define UNIT_TILEPLANE 4
+
+/*
+  where a strip, tile or plane goes in the raster, clipped to it
+*/
+typedef struct
+{
+	unsigned char *pixels;   /* raster pixel for row top, column left */
+	size_t stride;           /* bytes from one raster row to the next */
+	int depth;               /* bytes per raster pixel */
+	int left, right;         /* columns of the unit inside the raster */
+	int top, bottom;         /* rows of the unit inside the raster */
+	unsigned char *scratch;  /* a whole row of the unit, if it is clipped */
+#ifdef LOADTIFF_STATS
+	TIFFSTATS *stats;        /* time spent pasting goes here */
+#endif
+} RASTERDEST;
+
+/*
+  a caller's raster, for rows converted to another format
+*/
+typedef struct
+{
+	unsigned char *buff;
+	size_t stride;
+	int format;
+} RASTERINTO;
+
+/*
+  box filters rows down by a whole factor as they are decoded
+*/
+typedef struct
+{
+	int scale;               /* the factor, 2 to shrink to half size */
+	int width, height;       /* the rectangle decoded */
+	int rwidth;              /* the rows passed on, width / scale rounded up */
+	int Nsamples;            /* samples per pixel */
+	int samplebytes;         /* 1, 2 or 4 (float) */
+	unsigned long *sums;     /* a reduced row being added up, integer samples */
+	double *fsums;           /* the same for floats */
+	unsigned char *row;      /* the averaged row */
+	TIFFROWFUNC fn;          /* called with each reduced row */
+	void *ptr;
+} REDUCER;
+
+typedef struct
+{
+	BASICHEADER *header;
+	TIFFSOURCE *src;
+	unsigned char *answer;
+	size_t stride;
+	int outsamples;
+	int tilesacross;
+	int x;
+	int y;
+	int width;
+	int height;
+	int unit;
+	int firstrow;
+	int Nrows;
+	int firstcol;
+	int Ncols;
+	int Nunits;
+	int err;
+#ifdef LOADTIFF_THREADS
+	LOCK lock;
+	int Nworkers;
+	int *next;
+	int *end;
+#endif
+} RASTERJOBS;
+
 #ifndef BIG_ENDIAN
 #define BIG_ENDIAN 1
 #endif
@@ -408,46 +656,124 @@ typedef struct
 #define LITTLE_ENDIAN 2
 #endif
 
+/*
+  timing and counting, for opt->stats. Without LOADTIFF_STATS these 
+  are all nothing.
+*/
+#ifdef LOADTIFF_STATS
+#define STATS_TIMER(t) unsigned long long t = 0
+#define STATS_START(t) ((t) = statsclock())
+#define STATS_STOP(stats, field, t) do { if (stats) (stats)->field += statsclock() - (t); } while (0)
+#define STATS_ADD(stats, field, n) do { if (stats) (stats)->field += (n); } while (0)
+#define STATS_INNER(stats, inner) ((inner) = (stats) ? (stats)->predictor_ns + (stats)->paste_ns : 0)
+#define STATS_CONVERT(stats, field, t, inner) statsconvert(stats, &(stats)->field, t, inner)
+static unsigned long long statsclock(void);
+static void statsconvert(TIFFSTATS *stats, unsigned long long *field, unsigned long long start, unsigned long long inner);
+static void statsadd(TIFFSTATS *stats, const TIFFSTATS *add);
+static int statscodec(int compression);
+#else
+#define STATS_TIMER(t)
+#define STATS_START(t)
+#define STATS_STOP(stats, field, t)
+#define STATS_ADD(stats, field, n)
+#define STATS_INNER(stats, inner)
+#define STATS_CONVERT(stats, field, t, inner)
+#endif
+
 static void header_defaults(BASICHEADER *header);
 static void freeheader(BASICHEADER *header);
 static int header_fixupsections(BASICHEADER *header);
 static int header_not_ok(BASICHEADER *header);
+static unsigned long header_unitbytes(BASICHEADER *header, int width, int height, int sample_index);
+static void header_getinfo(BASICHEADER *header, TIFFINFO *info);
+static int header_samplebytes(BASICHEADER *header, int highdepth);
+static int header_unpackers(BASICHEADER *header);
 static int fillheader(BASICHEADER *header, TAG *tags, int Ntags);
 
-static unsigned char *decompress(FILE *fp, unsigned long count, int compression, unsigned long *Nret, int width, int height, unsigned long T4options );
-static void header_defaults(BASICHEADER *header);
-static TAG *floadheader(int type, FILE *fp, int *Ntags);
+static unsigned char *loadtiffsource(TIFFSOURCE *src, const TIFFOPTIONS *opt, int *width, int *height, int *format);
+static int initsource(TIFFSOURCE *src, const TIFFIO *io);
+static int readfilehead(TIFFSOURCE *src, int *type, TIFFOFFSET *offset);
+static long readifdcount(TIFFSOURCE *src, int type, TIFFOFFSET offset);
+static TIFFOFFSET nextifd(TIFFSOURCE *src, int type, TIFFOFFSET offset);
+static int findpage(TIFFFILE *tf, int page);
+static int ifdslot(const TIFFFILE *tf, TIFFOFFSET offset);
+static int rehashifds(TIFFFILE *tf, int Nslots);
+#ifdef LOADTIFF_THREADS
+static void lockinit(LOCK *lock);
+static void lockkill(LOCK *lock);
+static void lockacquire(LOCK *lock);
+static void lockrelease(LOCK *lock);
+#endif
+static BASICHEADER *pageheader(TIFFFILE *tf, int page, TIFFSTATS *stats);
+static void lockfile(TIFFFILE *tf);
+static void unlockfile(TIFFFILE *tf);
+static int readifd(TIFFSOURCE *src, int type, TIFFOFFSET offset, BASICHEADER *header);
+static unsigned char *loadifd(TIFFSOURCE *src, int type, TIFFOFFSET offset, const TIFFOPTIONS *opt, int *width, int *height, int *format);
+static unsigned char *decodepage(const BASICHEADER *parsed, TIFFSOURCE *src, const TIFFOPTIONS *opt, int *width, int *height, int *format);
+static int streampage(const BASICHEADER *parsed, TIFFSOURCE *src, const TIFFOPTIONS *opt, TIFFROWFUNC fn, void *ptr, int *width, int *height, int *format);
+static int intopage(const BASICHEADER *parsed, TIFFSOURCE *src, const TIFFOPTIONS *opt, unsigned char *buff, size_t stride, int format);
+static int header_getwindow(BASICHEADER *header, const TIFFOPTIONS *opt, int *x, int *y, int *width, int *height);
+static const unsigned char *fetchbytes(TIFFSOURCE *src, TIFFOFFSET offset, unsigned long *N);
+static void releasebytes(TIFFSOURCE *src, const unsigned char *bytes);
+static size_t stdioread(void *ptr, TIFFOFFSET offset, size_t N, unsigned char *dest);
+
+static unsigned char *decompress(TIFFSOURCE *src, TIFFOFFSET offset, TIFFOFFSET count, int compression, unsigned long *Nret, int width, int height, unsigned long T4options, int fillorder, unsigned long Nexpected);
+static void releasedecompressed(TIFFSOURCE *src, int compression, unsigned char *data);
+static TAG *loadheader(int type, TIFFSOURCE *src, TIFFOFFSET offset, int *Ntags);
 static void killtags(TAG *tags, int N);
-static int floadtag(TAG *tag, int type, FILE *fp);
+static int loadtag(TAG *tag, int type, TIFFSOURCE *src, const unsigned char *entry);
 static double tag_getentry(TAG *tag, int index);
-
-static unsigned char *loadraster(BASICHEADER *header, FILE *fp, int *format);
-static unsigned char *readstrip(BASICHEADER *header, int index, int *strip_width, int *strip_height, FILE *fp, int *insamples);
-static unsigned char *readtile(BASICHEADER *header, int index, int *tile_width, int *tile_height, FILE *fp, int *insamples);
-static unsigned char *readchannel(BASICHEADER *header, int index, int *channel_width, int *channel_height, FILE *fp);
-
-static BSTREAM *bstream(unsigned char *data, int N, int endinaness);
+static TIFFOFFSET tag_getoffset(TAG *tag, int index);
+
+static unsigned char *loadraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, int scale, int *format);
+static int streamraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, TIFFROWFUNC fn, void *ptr, int *format);
+static int fillraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, unsigned char *buff, size_t stride);
+static int rasterinto(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, int scale, unsigned char *buff, size_t stride, int format);
+static int intorows(void *ptr, const unsigned char *rows, int y, int Nrows, int width, int format);
+static int reduceraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, int scale, TIFFROWFUNC fn, void *ptr, int *format);
+static int reducerows(void *ptr, const unsigned char *rows, int y, int Nrows, int width, int format);
+static void reduceaverage(REDUCER *red, int Nrows);
+static void convertpixels(unsigned char *out, int outformat, const unsigned char *in, int informat, int N);
+static int formatbytes(int format);
+static int setupjobs(RASTERJOBS *jobs, BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height);
+static int unitindex(RASTERJOBS *jobs, int k);
+static int decodeunit(RASTERJOBS *jobs, int index);
+static int cachedunit(RASTERJOBS *jobs, BASICHEADER *header, TIFFSOURCE *src, int index, RASTERDEST *dest, int uwidth, int uheight);
+#ifdef LOADTIFF_STATS
+static void unitstats(RASTERJOBS *jobs, const TIFFSTATS *stats);
+#endif
+static CACHESHARD *cache_shard(struct tiffcache *cache, const CACHEKEY *key, int *bucket);
+static int cache_samekey(const CACHEKEY *a, const CACHEKEY *b);
+static int cache_paste(struct tiffcache *cache, const CACHEKEY *key, RASTERDEST *dest, int width);
+static void cache_insert(struct tiffcache *cache, const CACHEKEY *key, unsigned char *pixels, size_t Nbytes);
+static void cache_unlink(CACHESHARD *shard, CACHEENTRY *entry, int bucket);
+static void cache_purge(struct tiffcache *cache, unsigned long fileid);
+static int rundecodejobs(RASTERJOBS *jobs, int nthreads);
+static void setopaque(unsigned char *buff, unsigned long Npixels, int outsamples, int samplebytes);
+static int readstrip(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest);
+static int readtile(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest);
+static int readchannel(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest);
+static int readtilechannel(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest);
+static int convertunit(BASICHEADER *header, unsigned char *data, unsigned long N, int width, int height, int sample_index, RASTERDEST *dest);
+static void pastedest(RASTERDEST *dest, const unsigned char *buff, int width, int depth);
+static unsigned char *destrow(RASTERDEST *dest, int width, int iy);
+static void copyrow(RASTERDEST *dest, const unsigned char *row, int iy, int Nbytes);
+static void zerorows(RASTERDEST *dest, int top, int Nbytes);
+
+static BSTREAM *bstream(const unsigned char *data, int N, int endinaness);
 static void killbstream(BSTREAM *bs);
 static int getbit(BSTREAM *bs);
 static int getbits(BSTREAM *bs, int nbits);
-static int synchtobyte(BSTREAM *bs);
-static int writebit(BSTREAM *bs, int bit);
 
-static void pasteflexible(unsigned char *buff, int width, int height, int depth, unsigned char *tile, int twidth, int theight, int tdepth, int x, int y);
 
 
-static long fget32(int type, FILE *fp);
-static int fget16(int type, FILE *fp);
-static long fget32be(FILE *fp);
-static int fget16be(FILE *fp);
-static long fget32le(FILE *fp);
-static int fget16le(FILE *fp);
-static unsigned long fget32u(int type, FILE *fp);
-static unsigned int fget16u(int type, FILE *fp);
-static char *freadasciiz(FILE *fp);
+static unsigned long memread32(int type, const unsigned char *bytes);
+static TIFFOFFSET memread64(int type, const unsigned char *bytes);
+static unsigned int memread16(int type, const unsigned char *bytes);
+static char *copyasciiz(const unsigned char *bytes, unsigned long N);
 
-static double memreadieee754(unsigned char *buff, int bigendian);
-static float memreadieee754f(unsigned char*buff, int bigendian);
+static double memreadieee754(const unsigned char *buff, int bigendian);
+static float memreadieee754f(const unsigned char*buff, int bigendian);
 static int YcbcrToRGB(int Y, int cb, int cr, unsigned char *red, unsigned char *green, unsigned char *blue);
 
 /*
@@ -528,282 +854,1357 @@ unsigned char *floadtiffwhite(FILE *fp, int *width, int *height, int *format)
 
 
 }
+/*
+   load a tiff
+    Params: fp - pointer to a TIFF file open for reading
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+ */
 unsigned char *floadtiff(FILE *fp, int *width, int *height, int *format)
 {
-	int enda, endb;
-	int type;
-	int magic;
-	unsigned long offset;
-	TAG *tags = 0;
-	int Ntags = 0;
-	int err;
-	BASICHEADER header = {0};
-	unsigned char *answer;
+	TIFFIO io;
+
+	io.ptr = fp;
+	io.read = stdioread;
+	io.data = 0;
+	io.len = 0;
+
+	return loadtiff_io(&io, width, height, format);
+}
+
+/*
+   load a tiff through a caller-supplied reader
+    Params: io - the reader
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+ */
+unsigned char *loadtiff_io(const TIFFIO *io, int *width, int *height, int *format)
+{
+	return loadtiff_ex(io, 0, width, height, format);
+}
+
+/*
+   load a tiff held in memory
+    Params: buf - the TIFF file bytes
+            len - number of bytes in buf
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+   Strips and tiles are decoded straight out of buf, which must stay
+   valid for the duration of the call.
+ */
+unsigned char *loadtiff_mem(const unsigned char *buf, size_t len, int *width, int *height, int *format)
+{
+	TIFFIO io;
+
+	io.ptr = 0;
+	io.read = 0;
+	io.data = buf;
+	io.len = len;
+
+	return loadtiff_io(&io, width, height, format);
+}
+
+/*
+   set options to the defaults, which is what loadtiff_io() uses
+    Params: opt - the options to set
+ */
+void loadtiff_defaultoptions(TIFFOPTIONS *opt)
+{
+	opt->nthreads = 1;
+	opt->x = 0;
+	opt->y = 0;
+	opt->width = 0;
+	opt->height = 0;
+	opt->highdepth = 0;
+	opt->scale = 1;
+	opt->stats = 0;
+}
+
+/*
+   load a rectangle out of a tiff. Only strips and tiles which 
+   intersect it are decoded.
+    Params: io - the reader
+            x, y - top left of rectangle in the image
+            width, height - rectangle size, which is the raster size
+            format - return for image format
+    Returns: the raster data, 0 on error or if the rectangle isn't 
+      entirely inside the image
+ */
+unsigned char *loadtiff_region(const TIFFIO *io, int x, int y, int width, int height, int *format)
+{
+	TIFFOPTIONS opt;
+	int rwidth, rheight;
+
+	if (width <= 0 || height <= 0)
+	{
+		*format = FMT_ERROR;
+		return 0;
+	}
+	loadtiff_defaultoptions(&opt);
+	opt.x = x;
+	opt.y = y;
+	opt.width = width;
+	opt.height = height;
+
+	return loadtiff_ex(io, &opt, &rwidth, &rheight, format);
+}
+
+/*
+   load a tiff, with options
+    Params: io - the reader
+            opt - the options (0 for defaults)
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+ */
+unsigned char *loadtiff_ex(const TIFFIO *io, const TIFFOPTIONS *opt, int *width, int *height, int *format)
+{
+	TIFFSOURCE src;
+	TIFFOPTIONS defaults;
 
-        *format = FMT_ERROR;
-	enda = fgetc(fp);
-	endb = fgetc(fp);
-	if (enda == 'I' && endb == 'I')
+	if (!opt)
 	{
-		type = LITTLE_ENDIAN;
+		loadtiff_defaultoptions(&defaults);
+		opt = &defaults;
 	}
-	else if (endb == 'M' && endb == 'M')
+	if (initsource(&src, io))
 	{
-		type = BIG_ENDIAN;
+		*format = FMT_ERROR;
+		return 0;
 	}
-	else
-		goto parse_error;
-	magic = fget16(type, fp);
-	if (magic != 42)
-		goto parse_error;
-	offset = fget32(type, fp);
-	fseek(fp, offset, SEEK_SET);
 
-	//printf("%c%c %d %ld\n", enda, endb, magic, offset);
+	return loadtiffsource(&src, opt, width, height, format);
+}
 
-	tags = floadheader(type, fp, &Ntags);
-	if (!tags)
-		goto out_of_memory;
-	//getchar();
-	header_defaults(&header);
-	header.endianness = type;
-	fillheader(&header, tags, Ntags);
-	err = header_fixupsections(&header);
-	if (err)
-		goto parse_error;
-	//printf("here %d %d\n", header.imagewidth, header.imageheight);
-	//printf("Bitspersample%d %d %d\n", header.bitspersample[0], header.bitspersample[1], header.bitspersample[2]);
-	err = header_not_ok(&header);
+/*
+   decode a tiff a band of rows at a time, without holding the whole
+   image in memory
+    Params: io - the reader
+            opt - the options (0 for defaults)
+            fn - function called with each band of rows, top to bottom
+            ptr - passed to fn
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: 0 on success, -1 on error, or -2 if fn returned non-zero
+   The band passed to fn is only valid for the call. A band is a strip, 
+   or a row of tiles, and the same buffer is reused for each one. If
+   opt->scale shrinks the image, fn gets one shrunk row at a time.
+ */
+int loadtiff_stream(const TIFFIO *io, const TIFFOPTIONS *opt, TIFFROWFUNC fn, void *ptr, int *width, int *height, int *format)
+{
+	TIFFSOURCE src;
+	TIFFOPTIONS defaults;
+	BASICHEADER header = {0};
+	int type;
+	TIFFOFFSET offset;
+	int err;
+	STATS_TIMER(t0);
+
+	*format = FMT_ERROR;
+	if (!opt)
+	{
+		loadtiff_defaultoptions(&defaults);
+		opt = &defaults;
+	}
+	if (initsource(&src, io))
+		return -1;
+#ifdef LOADTIFF_STATS
+	src.stats = opt->stats;
+#endif
+	STATS_START(t0);
+	if (readfilehead(&src, &type, &offset))
+		return -1;
+	err = readifd(&src, type, offset, &header);
+	STATS_STOP(opt->stats, parse_ns, t0);
 	if (err)
 		goto parse_error;
-	answer = loadraster(&header, fp, format);
-	//getchar();
-	*width = header.imagewidth;
-	*height = header.imageheight;
+	err = streampage(&header, &src, opt, fn, ptr, width, height, format);
 	freeheader(&header);
-	killtags(tags, Ntags);
-	return answer;
+
+	return err;
 
 parse_error:
 	freeheader(&header);
-	killtags(tags, Ntags);
-	return 0;
-out_of_memory:
-	freeheader(&header);
-	killtags(tags, Ntags);
-	return 0;
+	return -1;
 }
 
-
-static void header_defaults(BASICHEADER *header)
+/*
+   decode a tiff into a raster the caller supplies
+    Params: io - the reader
+            opt - the options (0 for defaults)
+            buff - the raster, big enough for the image (or the 
+              rectangle in opt) in the format
+            stride - bytes from the start of one row of buff to the next
+            format - the format wanted
+    Returns: 0 on success, -1 on error
+   Call loadtiff_probe() first to find the size, and divide by 
+   opt->scale, rounding up, if shrinking. Any 8 bit image can be
+   had as FMT_RGBA, FMT_RGB, FMT_GREYALPHA or FMT_GREY, and any image in
+   the format loadtiff_ex() would give. Other conversions fail. Padding 
+   at the end of each row is left alone.
+ */
+int loadtiff_into(const TIFFIO *io, const TIFFOPTIONS *opt, unsigned char *buff, size_t stride, int format)
 {
-	int i;
-	header->newsubfiletype = 0;
-	header->imagewidth = -1;
-	header->imageheight = -1;
-	header->bitspersample[0] = -1;
-	header->compression = 1;
-	header->fillorder = 1;
-	header->photometricinterpretation =-1;
-	header->stripoffsets = 0;;
-	header->Nstripoffsets = 0;
-	header->samplesperpixel = 0;
-	header->rowsperstrip = 0;
-	header->stripbytecounts = 0;
-	header->Nstripbytecounts = 0;
-	header->xresolution = 1.0;
-	header->yresolution = 1.0;
-	header->resolutionunit = 0;
-	/*  Palette files */
-	header->colormap = 0;
-	header->Ncolormap = 0;
-	/* RGB */
-	header->planarconfiguration =1;
-	header->predictor = 1;
-	/* YCbCr*/
-
-	header->LumaRed = 0.299;
-	header->LumaGreen = 0.587;
-	header->LumaBlue = 0.114;
-	//header->YCbCrCoefficients = 0;
-	header->YCbCrSubSampling_h = 2;
-	header->YCbCrSubSampling_v = 2;
-	header->YCbCrPositioning = 1;
-	header->ReferenceBlackWhite = 0;
-
-	/* Class F */
-
-	//int BadFaxLines;
-	//int CleanFaxData;
-	//int ConsecutiveBadFaxLines;
-	header->T4options = 0;
-
-	header->tilewidth = 0;
-	header->tileheight = 0;
-	header->tileoffsets = 0;
-	header->Ntileoffsets = 0;
-	header->tilebytecounts = 0;
-	header->Ntilebytecounts = 0;
+	TIFFSOURCE src;
+	TIFFOPTIONS defaults;
+	BASICHEADER header = {0};
+	int type;
+	TIFFOFFSET offset;
+	int err;
+	STATS_TIMER(t0);
 
-	for (i = 0; i < 16;i++)
-		header->sampleformat[i] = 1;
-	header->smaxsamplevalue = 0;
-	header->Nsmaxsamplevalue = 0;
-	header->sminsamplevalue = 0;
-	header->Nsminsamplevalue = 0;
-        header->extrasamples = 0;
-	header->endianness = -1;
+	if (!opt)
+	{
+		loadtiff_defaultoptions(&defaults);
+		opt = &defaults;
+	}
+	if (initsource(&src, io))
+		return -1;
+#ifdef LOADTIFF_STATS
+	src.stats = opt->stats;
+#endif
+	STATS_START(t0);
+	if (readfilehead(&src, &type, &offset))
+		return -1;
+	err = readifd(&src, type, offset, &header);
+	STATS_STOP(opt->stats, parse_ns, t0);
+	if (err)
+		goto parse_error;
+	err = intopage(&header, &src, opt, buff, stride, format);
+	freeheader(&header);
 
+	return err;
 
+parse_error:
+	freeheader(&header);
+	return -1;
 }
 
-static void freeheader(BASICHEADER *header)
-{
-	free(header->stripbytecounts);
-	free(header->stripoffsets);
-	free(header->tilebytecounts);
-	free(header->tileoffsets);
-	free(header->colormap);
-	free(header->smaxsamplevalue);
-	free(header->sminsamplevalue);
-}
 /*
-  Some TIFF files have tiles in the strip byte counts and so on
-  fixc this up
-*/
-static int header_fixupsections(BASICHEADER *header)
+   load a tiff by memory-mapping the file
+    Params: fname - path of the TIFF file
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+   On systems without mmap() we fall back to reading through stdio.
+ */
+unsigned char *loadtiff_mmap(const char *fname, int *width, int *height, int *format)
 {
-	if (header->tilewidth == 0 && header->tileheight == 0)
+	unsigned char *answer = 0;
+#ifdef LOADTIFF_MMAP
+	int fd;
+	struct stat st;
+	void *map;
+	size_t len;
+
+	*format = FMT_ERROR;
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0)
 	{
-		if (header->Nstripbytecounts > 0 &&
-			header->Nstripoffsets > 0 &&
-			header->Nstripbytecounts == header->Nstripoffsets
-			&& header->Nstripbytecounts < INT_MAX
-			&& header->Ntileoffsets == 0 &&
-			header->Ntilebytecounts == 0)
+		close(fd);
+		return 0;
+	}
+	len = (size_t)st.st_size;
+	if ((off_t)len != st.st_size)
+		goto use_stdio;
+	map = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto use_stdio;
+	close(fd);
+	answer = loadtiff_mem((const unsigned char *)map, len, width, height, format);
+	munmap(map, len);
+	return answer;
+use_stdio:
+	close(fd);
+#endif
+	{
+		FILE *fp = fopen(fname, "rb");
+
+		*format = FMT_ERROR;
+		if (!fp)
 			return 0;
-		else
-			return -1;
+		answer = floadtiff(fp, width, height, format);
+		fclose(fp);
 	}
-	else if (header->tilewidth > 0 && header->tileheight > 0)
+	return answer;
+}
+
+/*
+   open a tiff for reading page by page
+    Params: io - the reader, which must stay valid until the file is closed
+    Returns: the file, 0 on error or if it isn't a TIFF
+ */
+TIFFFILE *loadtiff_open(const TIFFIO *io)
+{
+	TIFFFILE *tf;
+	TIFFOFFSET offset;
+
+	tf = malloc(sizeof(TIFFFILE));
+	if (!tf)
+		return 0;
+	tf->ifds = 0;
+	tf->headers = 0;
+	tf->ifdhash = 0;
+	tf->Nifdhash = 0;
+	tf->capacity = 0;
+#ifdef LOADTIFF_THREADS
+	lockinit(&tf->lock);
+#endif
+	if (initsource(&tf->src, io))
+		goto parse_error;
+	if (readfilehead(&tf->src, &tf->type, &offset))
+		goto parse_error;
+	tf->ifds = malloc(8 * sizeof(TIFFOFFSET));
+	tf->headers = calloc(8, sizeof(BASICHEADER *));
+	if (!tf->ifds || !tf->headers)
+		goto out_of_memory;
+	tf->capacity = 8;
+	tf->ifds[0] = offset;
+	tf->Nifds = offset ? 1 : 0;
+	tf->complete = offset ? 0 : 1;
+	if (rehashifds(tf, 16))
+		goto out_of_memory;
+	return tf;
+
+parse_error:
+out_of_memory:
+	loadtiff_close(tf);
+	return 0;
+}
+
+/*
+   close a tiff opened with loadtiff_open()
+ */
+void loadtiff_close(TIFFFILE *tf)
+{
+	int i;
+
+	if (tf)
 	{
-		if (header->Ntilebytecounts == 0)
-		{
-			header->Ntilebytecounts = header->Nstripbytecounts;
-			header->Nstripbytecounts = 0;
-			header->tilebytecounts = header->stripbytecounts;
-			header->stripbytecounts = 0;
-		}
-		if (header->Ntileoffsets == 0)
+		if (tf->src.cache)
+			cache_purge(tf->src.cache, tf->src.fileid);
+		for (i = 0; i < tf->capacity; i++)
 		{
-			header->Ntileoffsets = header->Nstripoffsets;
-			header->Nstripoffsets = 0;
-			header->tileoffsets = header->stripoffsets;
-			header->stripoffsets = 0;
+			if (tf->headers[i])
+			{
+				freeheader(tf->headers[i]);
+				free(tf->headers[i]);
+			}
 		}
-		if (header->Ntilebytecounts > 0 &&
-			header->Ntileoffsets > 0 &&
-			header->Ntilebytecounts == header->Ntileoffsets
-			&& header->Ntilebytecounts < INT_MAX
-			&& header->Nstripoffsets == 0 &&
-			header->Nstripbytecounts == 0)
-			return 0;
-		else
-			return -1;
+#ifdef LOADTIFF_THREADS
+		lockkill(&tf->lock);
+#endif
+		free(tf->headers);
+		free(tf->ifds);
+		free(tf->ifdhash);
+		free(tf);
 	}
-	else
+}
+
+/*
+   get the number of pages in a tiff. This walks the IFD chain without
+   reading any tags.
+    Params: tf - the file
+    Returns: number of pages
+ */
+int loadtiff_npages(TIFFFILE *tf)
+{
+	int answer;
+
+	lockfile(tf);
+	findpage(tf, INT_MAX);
+	answer = tf->Nifds;
+	unlockfile(tf);
+
+	return answer;
+}
+
+/*
+   seek to a page, walking the IFD chain only as far as needed. Pages
+   already seen are found immediately.
+    Params: tf - the file
+            page - the page number, 0 based
+    Returns: 0 if the page exists, else -1
+ */
+int loadtiff_seekpage(TIFFFILE *tf, int page)
+{
+	int answer;
+
+	lockfile(tf);
+	answer = findpage(tf, page);
+	unlockfile(tf);
+
+	return answer;
+}
+
+/*
+   load a page of a tiff
+    Params: tf - the file
+            page - the page number, 0 based
+            opt - the options (0 for defaults)
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error or if there is no such page
+   The page's tags are read the first time it is used, and kept for 
+   later calls.
+ */
+unsigned char *loadtiff_page(TIFFFILE *tf, int page, const TIFFOPTIONS *opt, int *width, int *height, int *format)
+{
+	TIFFOPTIONS defaults;
+	BASICHEADER *header;
+
+	*format = FMT_ERROR;
+	if (!opt)
+	{
+		loadtiff_defaultoptions(&defaults);
+		opt = &defaults;
+	}
+	header = pageheader(tf, page, opt->stats);
+	if (!header)
+		return 0;
+
+	return decodepage(header, &tf->src, opt, width, height, format);
+}
+
+/*
+   decode a page of a tiff a band of rows at a time, as 
+   loadtiff_stream()
+    Params: tf - the file
+            page - the page number, 0 based
+            opt - the options (0 for defaults)
+            fn - function called with each band of rows, top to bottom
+            ptr - passed to fn
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: 0 on success, -1 on error or if there is no such page, 
+      or -2 if fn returned non-zero
+ */
+int loadtiff_pagestream(TIFFFILE *tf, int page, const TIFFOPTIONS *opt, TIFFROWFUNC fn, void *ptr, int *width, int *height, int *format)
+{
+	TIFFOPTIONS defaults;
+	BASICHEADER *header;
+
+	*format = FMT_ERROR;
+	if (!opt)
 	{
+		loadtiff_defaultoptions(&defaults);
+		opt = &defaults;
+	}
+	header = pageheader(tf, page, opt->stats);
+	if (!header)
 		return -1;
+
+	return streampage(header, &tf->src, opt, fn, ptr, width, height, format);
+}
+
+/*
+   decode a page of a tiff into a raster the caller supplies, as 
+   loadtiff_into()
+    Params: tf - the file
+            page - the page number, 0 based
+            opt - the options (0 for defaults)
+            buff - the raster
+            stride - bytes from the start of one row of buff to the next
+            format - the format wanted
+    Returns: 0 on success, -1 on error or if there is no such page
+ */
+int loadtiff_pageinto(TIFFFILE *tf, int page, const TIFFOPTIONS *opt, unsigned char *buff, size_t stride, int format)
+{
+	TIFFOPTIONS defaults;
+	BASICHEADER *header;
+
+	if (!opt)
+	{
+		loadtiff_defaultoptions(&defaults);
+		opt = &defaults;
 	}
-	return -1;
+	header = pageheader(tf, page, opt->stats);
+	if (!header)
+		return -1;
+
+	return intopage(header, &tf->src, opt, buff, stride, format);
 }
 
-static int header_not_ok(BASICHEADER *header)
+/*
+   get information about a page of a tiff, without decoding it
+    Params: tf - the file
+            page - the page number, 0 based
+            info - return for the information
+    Returns: 0 on success, -1 if there is no such page or we can't 
+      decode it
+ */
+int loadtiff_pageinfo(TIFFFILE *tf, int page, TIFFINFO *info)
 {
-	int i;
-	//header->newsubfiletype = 0;
-	//header->imagewidth = -1;
-	//header->imageheight = -1;
-	if (header->imagewidth <= 0 || header->imageheight <= 0
-		|| (double)header->imagewidth * (double)header->imageheight > LONG_MAX / 4)
-		goto parse_error;
-	
-	//header->bitspersample[0] = -1;
-	if (header->samplesperpixel < 1 || header->samplesperpixel > 16)
-		goto parse_error;
-	for (i = 0; i < header->samplesperpixel; i++)
-		if (header->bitspersample[i] < 1 || (header->bitspersample[i] > 32 && header->bitspersample[i] % 8))
-			goto parse_error;
-	//header->compression = 1;
-	//header->fillorder = 1;
-	//header->photometricinterpretation = -1;
-	//header->stripoffsets = 0;;
-	//header->Nstripoffsets = 0;
-	//header->samplesperpixel = 0;
-	//header->rowsperstrip;
-	//header->stripbytecounts;
-	//header->Nstripbytecounts;
-	//header->xresolution = 1.0;
-	//header->yresolution = 1.0;
-	//header->resolutionunit = 0;
-	/*  Palette files */
-	//header->colormap = 0;
-	//header->Ncolormap = 0;
-	if (header->Ncolormap < 0 || header->Ncolormap > INT_MAX / 4)
-		goto parse_error;
-	/* RGB */
-	//header->planarconfiguration = 1;
-	if (header->planarconfiguration != 1 && header->planarconfiguration != 2)
-		goto parse_error;
-	/* YCbCr*/
+	BASICHEADER *header;
 
-	//header->LumaRed = 0.299;
-	//header->LumaGreen = 0.587;
-	//header->LumaBlue = 0.114;
-	if (header->LumaRed <= 0 || header->LumaGreen <= 0 || header->LumaBlue <= 0)
-		goto parse_error;
-	//header->YCbCrCoefficients = 0;
-	//header->YCbCrSubSampling_h = 2;
-	//header->YCbCrSubSampling_v = 2;
-	//header->YCbCrPositioning = 1;
-	//header->ReferenceBlackWhite = 0;
+	header = pageheader(tf, page, 0);
+	if (!header)
+		return -1;
+	header_getinfo(header, info);
+	info->npages = loadtiff_npages(tf);
+	info->bigtiff = tf->src.bigtiff;
 
-	/* Class F */
+	return 0;
+}
 
-	//int BadFaxLines;
-	//int CleanFaxData;
-	//int ConsecutiveBadFaxLines;
+/*
+   get information about a tiff without decoding it. This reads the
+   file header, the first IFD and its tag data, and the IFD chain to 
+   count the pages.
+    Params: io - the reader
+            info - return for the information
+    Returns: 0 on success, -1 if we can't decode the file
+ */
+int loadtiff_probe(const TIFFIO *io, TIFFINFO *info)
+{
+	TIFFFILE *tf;
+	int answer;
 
-	//header->tilewidth = 0;
-	//header->tileheight = 0;
-	if (header->tilewidth < 0 || header->tileheight < 0)
+	tf = loadtiff_open(io);
+	if (!tf)
+		return -1;
+	answer = loadtiff_pageinfo(tf, 0, info);
+	loadtiff_close(tf);
+
+	return answer;
+}
+
+static unsigned char *loadtiffsource(TIFFSOURCE *src, const TIFFOPTIONS *opt, int *width, int *height, int *format)
+{
+	int type;
+	TIFFOFFSET offset;
+	STATS_TIMER(t0);
+
+	*format = FMT_ERROR;
+#ifdef LOADTIFF_STATS
+	src->stats = opt->stats;
+#endif
+	STATS_START(t0);
+	if (readfilehead(src, &type, &offset))
+		return 0;
+	STATS_STOP(opt->stats, parse_ns, t0);
+
+	return loadifd(src, type, offset, opt, width, height, format);
+}
+
+/*
+  set up a source from a TIFFIO
+  Returns: 0 on success, -1 if the length is too big for us
+*/
+static int initsource(TIFFSOURCE *src, const TIFFIO *io)
+{
+	src->io = *io;
+	src->data = io->data;
+	src->N = (TIFFOFFSET) io->len;
+	src->bigtiff = 0;
+	src->cache = 0;
+	src->fileid = 0;
+#ifdef LOADTIFF_STATS
+	src->stats = 0;
+#endif
+	if ((size_t)src->N != io->len)
+		return -1;
+	return 0;
+}
+
+/*
+  read the TIFF file header, 8 bytes, or 16 for BigTIFF
+    Params: src - the source, which is marked if it is BigTIFF
+	        type - return for endianness
+			offset - return for position of the first IFD
+  Returns: 0 on success, -1 if not a TIFF file
+*/
+static int readfilehead(TIFFSOURCE *src, int *type, TIFFOFFSET *offset)
+{
+	const unsigned char *filehead = 0;
+	unsigned long N = 16;
+	int magic;
+
+	filehead = fetchbytes(src, 0, &N);
+	if (!filehead || N < 8)
 		goto parse_error;
-	if ((double)header->tilewidth * (double)header->tileheight > LONG_MAX / 4)
+	if (filehead[0] == 'I' && filehead[1] == 'I')
+	{
+		*type = LITTLE_ENDIAN;
+	}
+	else if (filehead[0] == 'M' && filehead[1] == 'M')
+	{
+		*type = BIG_ENDIAN;
+	}
+	else
 		goto parse_error;
-	//header->tileoffsets = 0;
-	//header->Ntileoffsets = 0;
-	//header->tilebytecounts = 0;
-	//header->Ntilebytecounts = 0;
-
-	//header->sampleformat = 1;
-	//header->smaxsamplevalue = 0;
-	//header->Nsmaxsamplevalue = 0;
-	//header->sminsamplevalue = 0;
-	//header->Nsminsamplevalue = 0;
-	//header->endianness = -1;
+	magic = memread16(*type, filehead + 2);
+	if (magic == 42)
+	{
+		src->bigtiff = 0;
+		*offset = memread32(*type, filehead + 4);
+	}
+	else if (magic == 43)
+	{
+		/* BigTIFF, the offset size must be 8 */
+		if (N < 16 || memread16(*type, filehead + 4) != 8 || memread16(*type, filehead + 6) != 0)
+			goto parse_error;
+		src->bigtiff = 1;
+		*offset = memread64(*type, filehead + 8);
+	}
+	else
+		goto parse_error;
+	releasebytes(src, filehead);
 	return 0;
+
 parse_error:
+	releasebytes(src, filehead);
 	return -1;
-
 }
 
-static int fillheader(BASICHEADER *header, TAG *tags, int Ntags)
+/*
+  read the number of entries in an IFD
+    Params: src - the source
+	        type - endianness
+			offset - position of the IFD
+  Returns: the count, -1 if it can't be read or is too big
+*/
+static long readifdcount(TIFFSOURCE *src, int type, TIFFOFFSET offset)
 {
-	int i;
-	unsigned long ii;
-	int jj;
+	const unsigned char *bytes;
+	unsigned long need = src->bigtiff ? 8 : 2;
+	unsigned long len = need;
+	TIFFOFFSET answer;
 
-	for (i = 0; i < Ntags; i++)
+	bytes = fetchbytes(src, offset, &len);
+	if (!bytes)
+		return -1;
+	if (len < need)
+	{
+		releasebytes(src, bytes);
+		return -1;
+	}
+	answer = src->bigtiff ? memread64(type, bytes) : memread16(type, bytes);
+	releasebytes(src, bytes);
+	/* classic TIFF can't have more than 65535, so hold BigTIFF to that */
+	if (answer > 65535)
+		return -1;
+
+	return (long) answer;
+}
+
+/*
+  get the position of the IFD after this one
+    Params: src - the source
+	        type - endianness
+			offset - position of the IFD
+  Returns: position of the next IFD, 0 if this is the last, or on error,
+    or if the next IFD is past the end of the file
+*/
+static TIFFOFFSET nextifd(TIFFSOURCE *src, int type, TIFFOFFSET offset)
+{
+	const unsigned char *bytes;
+	unsigned long len;
+	TIFFOFFSET answer = 0;
+	long N;
+
+	N = readifdcount(src, type, offset);
+	if (N < 0)
+		return 0;
+	if (src->bigtiff)
+	{
+		len = 8;
+		bytes = fetchbytes(src, offset + 8 + N * 20, &len);
+		if (!bytes)
+			return 0;
+		if (len == 8)
+			answer = memread64(type, bytes);
+	}
+	else
+	{
+		len = 4;
+		bytes = fetchbytes(src, offset + 2 + N * 12, &len);
+		if (!bytes)
+			return 0;
+		if (len == 4)
+			answer = memread32(type, bytes);
+	}
+	releasebytes(src, bytes);
+	/* make sure there is an IFD there */
+	if (answer && readifdcount(src, type, answer) < 0)
+		answer = 0;
+
+	return answer;
+}
+
+/*
+  find a page, walking the IFD chain as far as we need to
+    Params: tf - the file
+	        page - the page number, 0 based
+  Returns: 0 if the page exists, else -1
+  A chain which loops back on itself ends at the repeated IFD, found
+  through tf->ifdhash so a long chain isn't quadratic. Call with the
+  file locked.
+*/
+static int findpage(TIFFFILE *tf, int page)
+{
+	TIFFOFFSET next;
+	TIFFOFFSET *temp;
+	BASICHEADER **headers;
+	int slot;
+	int i;
+
+	while (page >= tf->Nifds && !tf->complete)
+	{
+		next = nextifd(&tf->src, tf->type, tf->ifds[tf->Nifds - 1]);
+		slot = ifdslot(tf, next);
+		if (next == 0 || tf->ifdhash[slot] || tf->Nifds >= INT_MAX / 4)
+		{
+			tf->complete = 1;
+			break;
+		}
+		if (tf->Nifds == tf->capacity)
+		{
+			if (rehashifds(tf, tf->capacity * 4))
+				return -1;
+			slot = ifdslot(tf, next);
+			temp = realloc(tf->ifds, tf->capacity * 2 * sizeof(TIFFOFFSET));
+			if (!temp)
+				return -1;
+			tf->ifds = temp;
+			headers = realloc(tf->headers, tf->capacity * 2 * sizeof(BASICHEADER *));
+			if (!headers)
+				return -1;
+			tf->headers = headers;
+			for (i = tf->capacity; i < tf->capacity * 2; i++)
+				tf->headers[i] = 0;
+			tf->capacity *= 2;
+		}
+		tf->ifdhash[slot] = tf->Nifds + 1;
+		tf->ifds[tf->Nifds++] = next;
+	}
+
+	return page >= 0 && page < tf->Nifds ? 0 : -1;
+}
+
+/*
+  find an IFD offset in tf->ifdhash
+    Returns: the slot holding it, or the empty slot where it would go
+*/
+static int ifdslot(const TIFFFILE *tf, TIFFOFFSET offset)
+{
+	unsigned int mask = (unsigned int) tf->Nifdhash - 1;
+	unsigned int slot = (unsigned int) ((offset * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+
+	while (tf->ifdhash[slot] && tf->ifds[tf->ifdhash[slot] - 1] != offset)
+		slot = (slot + 1) & mask;
+
+	return (int) slot;
+}
+
+/*
+  rebuild tf->ifdhash with more slots. Kept at twice the capacity of
+  tf->ifds, so it is never more than half full.
+    Params: tf - the file
+            Nslots - the new number of slots, a power of 2
+    Returns: 0 on success, -1 on out of memory (the old table is kept)
+*/
+static int rehashifds(TIFFFILE *tf, int Nslots)
+{
+	int *hash;
+	int i;
+
+	hash = calloc((size_t) Nslots, sizeof(int));
+	if (!hash)
+		return -1;
+	free(tf->ifdhash);
+	tf->ifdhash = hash;
+	tf->Nifdhash = Nslots;
+	for (i = 0; i < tf->Nifds; i++)
+		tf->ifdhash[ifdslot(tf, tf->ifds[i])] = i + 1;
+
+	return 0;
+}
+
+/*
+  get the parsed header of a page, reading the IFD the first time
+    Params: tf - the file
+            page - the page number, 0 based
+            stats - where to count the time reading it takes, or 0
+    Returns: the header, which belongs to the file and is never 
+      changed, 0 if there is no such page or we can't decode it
+*/
+static BASICHEADER *pageheader(TIFFFILE *tf, int page, TIFFSTATS *stats)
+{
+	BASICHEADER *header = 0;
+	TIFFSOURCE src;
+	STATS_TIMER(t0);
+
+#ifndef LOADTIFF_STATS
+	(void) stats;
+#endif
+	STATS_START(t0);
+	lockfile(tf);
+	if (findpage(tf, page))
+		goto done;
+	header = tf->headers[page];
+	if (header)
+		goto done;
+	header = malloc(sizeof(BASICHEADER));
+	if (!header)
+		goto done;
+	src = tf->src;
+#ifdef LOADTIFF_STATS
+	src.stats = stats;
+#endif
+	if (readifd(&src, tf->type, tf->ifds[page], header))
+	{
+		freeheader(header);
+		free(header);
+		header = 0;
+		goto done;
+	}
+	header->page = page;
+	tf->headers[page] = header;
+
+done:
+	unlockfile(tf);
+	STATS_STOP(stats, parse_ns, t0);
+	return header;
+}
+
+/*
+  take and give back the lock on an open file. Without thread support
+  there is nothing to do.
+*/
+static void lockfile(TIFFFILE *tf)
+{
+#ifdef LOADTIFF_THREADS
+	lockacquire(&tf->lock);
+#else
+	(void) tf;
+#endif
+}
+
+static void unlockfile(TIFFFILE *tf)
+{
+#ifdef LOADTIFF_THREADS
+	lockrelease(&tf->lock);
+#else
+	(void) tf;
+#endif
+}
+
+/*
+  read an IFD and check we can decode the image it describes
+    Params: src - the source
+	        type - endianness
+			offset - position of the IFD
+			header - return for the image header (free with freeheader()
+			  whatever the result)
+    Returns: 0 on success, -1 on out of memory, -2 on parse error
+*/
+static int readifd(TIFFSOURCE *src, int type, TIFFOFFSET offset, BASICHEADER *header)
+{
+	TAG *tags = 0;
+	int Ntags = 0;
+	int err;
+
+	header_defaults(header);
+	header->endianness = type;
+	tags = loadheader(type, src, offset, &Ntags);
+	if (!tags)
+		goto out_of_memory;
+	err = fillheader(header, tags, Ntags);
+	if (err == -1)
+		goto out_of_memory;
+	err = header_fixupsections(header);
+	if (err)
+		goto parse_error;
+	err = header_not_ok(header);
+	if (err)
+		goto parse_error;
+	if (header_unpackers(header))
+		goto out_of_memory;
+	killtags(tags, Ntags);
+	return 0;
+
+out_of_memory:
+	killtags(tags, Ntags);
+	return -1;
+parse_error:
+	killtags(tags, Ntags);
+	return -2;
+}
+
+/*
+  load an image from its IFD
+    Params: src - the source
+	        type - endianness
+			offset - position of the IFD
+			opt - the options
+			width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+*/
+static unsigned char *loadifd(TIFFSOURCE *src, int type, TIFFOFFSET offset, const TIFFOPTIONS *opt, int *width, int *height, int *format)
+{
+	int err;
+	BASICHEADER header = {0};
+	unsigned char *answer;
+	STATS_TIMER(t0);
+
+	*format = FMT_ERROR;
+	STATS_START(t0);
+	err = readifd(src, type, offset, &header);
+	STATS_STOP(opt->stats, parse_ns, t0);
+	if (err)
+		goto parse_error;
+	answer = decodepage(&header, src, opt, width, height, format);
+	freeheader(&header);
+	return answer;
+
+parse_error:
+	freeheader(&header);
+	return 0;
+}
+
+/*
+  decode an image from its parsed header, as the options ask. The
+  header isn't changed, so one header can be decoded from by several 
+  threads.
+    Params: parsed - the image header
+            src - the source
+            opt - the options
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: the raster data, 0 on error
+*/
+static unsigned char *decodepage(const BASICHEADER *parsed, TIFFSOURCE *src, const TIFFOPTIONS *opt, int *width, int *height, int *format)
+{
+	BASICHEADER header = *parsed;
+	unsigned char *answer;
+	int x, y, rwidth, rheight;
+	int scale;
+
+	*format = FMT_ERROR;
+#ifdef LOADTIFF_STATS
+	header.stats = opt->stats;
+#endif
+	if (header_getwindow(&header, opt, &x, &y, &rwidth, &rheight))
+		return 0;
+	header.samplebytes = header_samplebytes(&header, opt->highdepth);
+	scale = opt->scale > 1 ? opt->scale : 1;
+	answer = loadraster(&header, src, x, y, rwidth, rheight, opt->nthreads, scale, format);
+	*width = (rwidth + scale - 1) / scale;
+	*height = (rheight + scale - 1) / scale;
+
+	return answer;
+}
+
+/*
+  decode an image from its parsed header a band at a time
+    Params: parsed - the image header, not changed
+            src - the source
+            opt - the options
+            fn - function called with each band of rows
+            ptr - passed to fn
+            width - return for image width
+            height - return for image height;
+            format - return for image format
+    Returns: 0 on success, -1 on error, or -2 if fn returned non-zero
+*/
+static int streampage(const BASICHEADER *parsed, TIFFSOURCE *src, const TIFFOPTIONS *opt, TIFFROWFUNC fn, void *ptr, int *width, int *height, int *format)
+{
+	BASICHEADER header = *parsed;
+	int x, y;
+	int err;
+
+	*format = FMT_ERROR;
+#ifdef LOADTIFF_STATS
+	header.stats = opt->stats;
+#endif
+	if (header_getwindow(&header, opt, &x, &y, width, height))
+		return -1;
+	header.samplebytes = header_samplebytes(&header, opt->highdepth);
+	if (opt->scale > 1)
+	{
+		err = reduceraster(&header, src, x, y, *width, *height, opt->nthreads, opt->scale, fn, ptr, format);
+		*width = (*width + opt->scale - 1) / opt->scale;
+		*height = (*height + opt->scale - 1) / opt->scale;
+	}
+	else
+		err = streamraster(&header, src, x, y, *width, *height, opt->nthreads, fn, ptr, format);
+	if (err == -3)
+		return -2;
+
+	return err ? -1 : 0;
+}
+
+/*
+  decode an image from its parsed header into the caller's raster
+    Params: parsed - the image header, not changed
+            src - the source
+            opt - the options
+            buff - the raster
+            stride - bytes from one row of buff to the next
+            format - the format wanted
+    Returns: 0 on success, -1 on error
+*/
+static int intopage(const BASICHEADER *parsed, TIFFSOURCE *src, const TIFFOPTIONS *opt, unsigned char *buff, size_t stride, int format)
+{
+	BASICHEADER header = *parsed;
+	int x, y, width, height;
+
+#ifdef LOADTIFF_STATS
+	header.stats = opt->stats;
+#endif
+	if (header_getwindow(&header, opt, &x, &y, &width, &height))
+		return -1;
+	header.samplebytes = header_samplebytes(&header, opt->highdepth);
+
+	return rasterinto(&header, src, x, y, width, height, opt->nthreads, opt->scale > 1 ? opt->scale : 1, buff, stride, format) ? -1 : 0;
+}
+
+/*
+  fill in the public summary of an image header
+*/
+static void header_getinfo(BASICHEADER *header, TIFFINFO *info)
+{
+	int i;
+
+	info->width = header->imagewidth;
+	info->height = header->imageheight;
+	info->samplesperpixel = header->samplesperpixel;
+	for (i = 0; i < 16; i++)
+	{
+		info->bitspersample[i] = i < header->samplesperpixel ? header->bitspersample[i] : 0;
+		info->sampleformat[i] = i < header->samplesperpixel ? header->sampleformat[i] : 0;
+	}
+	info->extrasamples = header->extrasamples;
+	info->photometric = header->photometricinterpretation;
+	info->compression = header->compression;
+	info->predictor = header->predictor;
+	info->planarconfig = header->planarconfiguration;
+	if (header->tileoffsets)
+	{
+		info->tiled = 1;
+		info->tilewidth = header->tilewidth;
+		info->tileheight = header->tileheight;
+		info->rowsperstrip = 0;
+	}
+	else
+	{
+		info->tiled = 0;
+		info->tilewidth = 0;
+		info->tileheight = 0;
+		info->rowsperstrip = header->rowsperstrip;
+	}
+	info->subsampling_h = header->photometricinterpretation == PI_YCbCr ? header->YCbCrSubSampling_h : 1;
+	info->subsampling_v = header->photometricinterpretation == PI_YCbCr ? header->YCbCrSubSampling_v : 1;
+	info->xresolution = header->xresolution;
+	info->yresolution = header->yresolution;
+	info->resolutionunit = header->resolutionunit;
+}
+
+/*
+  get the rectangle of the image to decode
+    Params: header - the image header
+            opt - options, with width 0 meaning the whole image
+            x, y - return for rectangle top left
+            width, height - return for rectangle size
+    Returns: 0 on success, -1 if the rectangle isn't in the image
+*/
+static int header_getwindow(BASICHEADER *header, const TIFFOPTIONS *opt, int *x, int *y, int *width, int *height)
+{
+	if (opt->width == 0 && opt->height == 0)
+	{
+		*x = 0;
+		*y = 0;
+		*width = header->imagewidth;
+		*height = header->imageheight;
+		return 0;
+	}
+	if (opt->x < 0 || opt->y < 0 || opt->width <= 0 || opt->height <= 0)
+		return -1;
+	if (opt->x > header->imagewidth - opt->width || opt->y > header->imageheight - opt->height)
+		return -1;
+	*x = opt->x;
+	*y = opt->y;
+	*width = opt->width;
+	*height = opt->height;
+
+	return 0;
+}
+
+/*
+  decide how deep the output samples are. Greyscale, RGB and CMYK 
+  images with all samples 16 bit unsigned, or all 32 or 64 bit float,
+  can keep their depth. Everything else is cut down to 8 bits.
+    Params: header - the image header
+            highdepth - set if the caller wants deep samples
+    Returns: bytes per output sample, 1, 2 (16 bit) or 4 (float)
+*/
+static int header_samplebytes(BASICHEADER *header, int highdepth)
+{
+	int i;
+	int bits = header->bitspersample[0];
+	int sampleformat = header->sampleformat[0];
+
+	if (!highdepth)
+		return 1;
+	switch (header->photometricinterpretation)
+	{
+	case PI_WhiteIsZero:
+	case PI_BlackIsZero:
+	case PI_RGB:
+	case PI_CMYK:
+		break;
+	default:
+		return 1;
+	}
+	for (i = 1; i < header->samplesperpixel; i++)
+		if (header->bitspersample[i] != bits || header->sampleformat[i] != sampleformat)
+			return 1;
+	if (bits == 16 && sampleformat == SAMPLEFORMAT_UINT)
+		return 2;
+	if ((bits == 32 || bits == 64) && sampleformat == SAMPLEFORMAT_IEEEFP && header->predictor == 1)
+		return 4;
+
+	return 1;
+}
+
+static void header_defaults(BASICHEADER *header)
+{
+	int i;
+	header->newsubfiletype = 0;
+	header->packedlutbits = 0;
+	header->page = 0;
+#ifdef LOADTIFF_STATS
+	header->stats = 0;
+#endif
+	header->imagewidth = -1;
+	header->imageheight = -1;
+	header->bitspersample[0] = -1;
+	header->compression = 1;
+	header->fillorder = 1;
+	header->photometricinterpretation =-1;
+	header->stripoffsets = 0;;
+	header->Nstripoffsets = 0;
+	header->samplesperpixel = 1;
+	header->rowsperstrip = 0;
+	header->stripbytecounts = 0;
+	header->Nstripbytecounts = 0;
+	header->xresolution = 1.0;
+	header->yresolution = 1.0;
+	header->resolutionunit = 0;
+	/*  Palette files */
+	header->colormap = 0;
+	header->Ncolormap = 0;
+	header->palette = 0;
+	header->Npalette = 0;
+	/* RGB */
+	header->planarconfiguration =1;
+	header->predictor = 1;
+	/* YCbCr*/
+
+	header->LumaRed = 0.299;
+	header->LumaGreen = 0.587;
+	header->LumaBlue = 0.114;
+	//header->YCbCrCoefficients = 0;
+	header->YCbCrSubSampling_h = 2;
+	header->YCbCrSubSampling_v = 2;
+	header->YCbCrPositioning = 1;
+	header->ReferenceBlackWhite = 0;
+
+	/* Class F */
+
+	//int BadFaxLines;
+	//int CleanFaxData;
+	//int ConsecutiveBadFaxLines;
+	header->T4options = 0;
+
+	header->tilewidth = 0;
+	header->tileheight = 0;
+	header->tileoffsets = 0;
+	header->Ntileoffsets = 0;
+	header->tilebytecounts = 0;
+	header->Ntilebytecounts = 0;
+
+	for (i = 0; i < 16;i++)
+		header->sampleformat[i] = 1;
+	header->smaxsamplevalue = 0;
+	header->Nsmaxsamplevalue = 0;
+	header->sminsamplevalue = 0;
+	header->Nsminsamplevalue = 0;
+        header->extrasamples = 0;
+	header->endianness = -1;
+	header->samplebytes = 1;
+
+
+}
+
+static void freeheader(BASICHEADER *header)
+{
+	free(header->stripbytecounts);
+	free(header->stripoffsets);
+	free(header->tilebytecounts);
+	free(header->tileoffsets);
+	free(header->colormap);
+	free(header->palette);
+	free(header->smaxsamplevalue);
+	free(header->sminsamplevalue);
+}
+/*
+  Some TIFF files have tiles in the strip byte counts and so on
+  fixc this up
+*/
+static int header_fixupsections(BASICHEADER *header)
+{
+	/* default is one strip for the whole image */
+	if (header->rowsperstrip <= 0 || header->rowsperstrip > header->imageheight)
+		header->rowsperstrip = header->imageheight;
+	if (header->tilewidth == 0 && header->tileheight == 0)
+	{
+		if (header->Nstripbytecounts > 0 &&
+			header->Nstripoffsets > 0 &&
+			header->Nstripbytecounts == header->Nstripoffsets
+			&& header->Nstripbytecounts < INT_MAX
+			&& header->Ntileoffsets == 0 &&
+			header->Ntilebytecounts == 0)
+			return 0;
+		else
+			return -1;
+	}
+	else if (header->tilewidth > 0 && header->tileheight > 0)
+	{
+		if (header->Ntilebytecounts == 0)
+		{
+			header->Ntilebytecounts = header->Nstripbytecounts;
+			header->Nstripbytecounts = 0;
+			header->tilebytecounts = header->stripbytecounts;
+			header->stripbytecounts = 0;
+		}
+		if (header->Ntileoffsets == 0)
+		{
+			header->Ntileoffsets = header->Nstripoffsets;
+			header->Nstripoffsets = 0;
+			header->tileoffsets = header->stripoffsets;
+			header->stripoffsets = 0;
+		}
+		if (header->Ntilebytecounts > 0 &&
+			header->Ntileoffsets > 0 &&
+			header->Ntilebytecounts == header->Ntileoffsets
+			&& header->Ntilebytecounts < INT_MAX
+			&& header->Nstripoffsets == 0 &&
+			header->Nstripbytecounts == 0)
+			return 0;
+		else
+			return -1;
+	}
+	else
+	{
+		return -1;
+	}
+	return -1;
+}
+
+static int header_not_ok(BASICHEADER *header)
+{
+	int i;
+	//header->newsubfiletype = 0;
+	//header->imagewidth = -1;
+	//header->imageheight = -1;
+	if (header->imagewidth <= 0 || header->imageheight <= 0
+		|| (double)header->imagewidth * (double)header->imageheight > LONG_MAX / 4)
+		goto parse_error;
+	
+	//header->bitspersample[0] = -1;
+	if (header->samplesperpixel < 1 || header->samplesperpixel > 16)
+		goto parse_error;
+	for (i = 0; i < header->samplesperpixel; i++)
+		if (header->bitspersample[i] < 1 || (header->bitspersample[i] > 32 && header->bitspersample[i] % 8))
+			goto parse_error;
+	//header->compression = 1;
+	//header->fillorder = 1;
+	//header->photometricinterpretation = -1;
+	//header->stripoffsets = 0;;
+	//header->Nstripoffsets = 0;
+	//header->samplesperpixel = 0;
+	//header->rowsperstrip;
+	//header->stripbytecounts;
+	//header->Nstripbytecounts;
+	//header->xresolution = 1.0;
+	//header->yresolution = 1.0;
+	//header->resolutionunit = 0;
+	/*  Palette files */
+	//header->colormap = 0;
+	//header->Ncolormap = 0;
+	if (header->Ncolormap < 0 || header->Ncolormap > INT_MAX / 4)
+		goto parse_error;
+	/* RGB */
+	//header->planarconfiguration = 1;
+	if (header->planarconfiguration != 1 && header->planarconfiguration != 2)
+		goto parse_error;
+	/* YCbCr*/
+
+	//header->LumaRed = 0.299;
+	//header->LumaGreen = 0.587;
+	//header->LumaBlue = 0.114;
+	if (header->LumaRed <= 0 || header->LumaGreen <= 0 || header->LumaBlue <= 0)
+		goto parse_error;
+	//header->YCbCrCoefficients = 0;
+	//header->YCbCrSubSampling_h = 2;
+	//header->YCbCrSubSampling_v = 2;
+	//header->YCbCrPositioning = 1;
+	//header->ReferenceBlackWhite = 0;
+
+	/* Class F */
+
+	//int BadFaxLines;
+	//int CleanFaxData;
+	//int ConsecutiveBadFaxLines;
+
+	//header->tilewidth = 0;
+	//header->tileheight = 0;
+	if (header->tilewidth < 0 || header->tileheight < 0)
+		goto parse_error;
+	if ((double)header->tilewidth * (double)header->tileheight > LONG_MAX / 4)
+		goto parse_error;
+	//header->tileoffsets = 0;
+	//header->Ntileoffsets = 0;
+	//header->tilebytecounts = 0;
+	//header->Ntilebytecounts = 0;
+
+	//header->sampleformat = 1;
+	//header->smaxsamplevalue = 0;
+	//header->Nsmaxsamplevalue = 0;
+	//header->sminsamplevalue = 0;
+	//header->Nsminsamplevalue = 0;
+	//header->endianness = -1;
+	return 0;
+parse_error:
+	return -1;
+
+}
+
+static int fillheader(BASICHEADER *header, TAG *tags, int Ntags)
+{
+	int i;
+	unsigned long ii;
+	int jj;
+
+	for (i = 0; i < Ntags; i++)
 	{
 		if (tags[i].bad)
 			continue;
@@ -831,25 +2232,25 @@ static int fillheader(BASICHEADER *header, TAG *tags, int Ntags)
 			header->fillorder = (int)tags[i].scalar;
 			break;
 		case TID_STRIPOFFSETS:
-			header->stripoffsets = malloc(tags[i].datacount * sizeof(unsigned long));
+			header->stripoffsets = malloc(tags[i].datacount * sizeof(TIFFOFFSET));
 			if (!header->stripoffsets)
 				goto out_of_memory;
 			for (ii = 0; ii < tags[i].datacount; ii++)
-				header->stripoffsets[ii] = (int) tag_getentry(&tags[i], ii);
+				header->stripoffsets[ii] = tag_getoffset(&tags[i], ii);
 			header->Nstripoffsets = tags[i].datacount;
 			break;
 		case TID_SAMPLESPERPIXEL:
 			header->samplesperpixel = (int)tags[i].scalar;
 			break;
 		case TID_ROWSPERSTRIP:
-			header->rowsperstrip = (int)tags[i].scalar;
+			header->rowsperstrip = tags[i].scalar > INT_MAX ? INT_MAX : (int)tags[i].scalar;
 			break;
 		case TID_STRIPBYTECOUNTS:
-			header->stripbytecounts = malloc(tags[i].datacount * sizeof(unsigned long));
+			header->stripbytecounts = malloc(tags[i].datacount * sizeof(TIFFOFFSET));
 			if (!header->stripbytecounts)
 				goto out_of_memory;
 			for (ii = 0; ii < tags[i].datacount; ii++)
-				header->stripbytecounts[ii] = (unsigned long)tag_getentry(&tags[i], ii);
+				header->stripbytecounts[ii] = tag_getoffset(&tags[i], ii);
 			header->Nstripbytecounts =  tags[i].datacount;
 			break;
 		case TID_PLANARCONFIGUATION:
@@ -882,19 +2283,19 @@ static int fillheader(BASICHEADER *header, TAG *tags, int Ntags)
 			header->tileheight = (int)tags[i].scalar;
 			break;
 		case TID_TILEOFFSETS:
-			header->tileoffsets = malloc(tags[i].datacount * sizeof(unsigned long));
+			header->tileoffsets = malloc(tags[i].datacount * sizeof(TIFFOFFSET));
 			if (!header->tileoffsets)
 				goto out_of_memory;
 			for (ii = 0; ii < tags[i].datacount; ii++)
-				header->tileoffsets[ii] = (unsigned long)tag_getentry(&tags[i], ii);
+				header->tileoffsets[ii] = tag_getoffset(&tags[i], ii);
 			header->Ntileoffsets = tags[i].datacount;
 			break;
 		case TID_TILEBYTECOUNTS:
-			header->tilebytecounts = malloc(tags[i].datacount * sizeof(unsigned long));
+			header->tilebytecounts = malloc(tags[i].datacount * sizeof(TIFFOFFSET));
 			if (!header->tilebytecounts)
 				goto out_of_memory;
 			for (ii = 0; ii < tags[i].datacount; ii++)
-				header->tilebytecounts[ii] = (unsigned long)tag_getentry(&tags[i], ii);
+				header->tilebytecounts[ii] = tag_getoffset(&tags[i], ii);
 			header->Ntilebytecounts = tags[i].datacount;
 			break;
 		case TID_SAMPLEFORMAT:
@@ -911,412 +2312,1743 @@ static int fillheader(BASICHEADER *header, TAG *tags, int Ntags)
 				header->sminsamplevalue[ii] = (unsigned long)tag_getentry(&tags[i], ii);
 			header->Nsminsamplevalue = tags[i].datacount;
 			break;
-		case TID_SMAXSAMPLEVALUE:
-			header->smaxsamplevalue = malloc(tags[i].datacount * sizeof(double));
-			if (!header->smaxsamplevalue)
-				goto out_of_memory;
-			for (ii = 0; ii < tags[i].datacount; ii++)
-				header->smaxsamplevalue[ii] = (unsigned long)tag_getentry(&tags[i], ii);
-			header->Nsmaxsamplevalue = tags[i].datacount;
+		case TID_SMAXSAMPLEVALUE:
+			header->smaxsamplevalue = malloc(tags[i].datacount * sizeof(double));
+			if (!header->smaxsamplevalue)
+				goto out_of_memory;
+			for (ii = 0; ii < tags[i].datacount; ii++)
+				header->smaxsamplevalue[ii] = (unsigned long)tag_getentry(&tags[i], ii);
+			header->Nsmaxsamplevalue = tags[i].datacount;
+			break;
+		case TID_YCBCRCOEFFICIENTS:
+			if (tags[i].datacount < 3)
+				goto parse_error;
+			header->LumaRed = tag_getentry(&tags[i], 0);
+			header->LumaGreen = tag_getentry(&tags[i], 1);
+			header->LumaBlue = tag_getentry(&tags[i], 2);
+			break;
+		case TID_YCBCRSUBSAMPLING:
+			if (tags[i].datacount < 2)
+				goto parse_error;
+			header->YCbCrSubSampling_h = (int)tag_getentry(&tags[i], 0);
+			header->YCbCrSubSampling_v = (int)tag_getentry(&tags[i], 1);
+			break;
+		case TID_YCBCRPOSITIONING:
+			header->YCbCrPositioning = (int)tags[i].scalar;
+			break;
+        case TID_EXTRASAMPLES:
+            header->extrasamples = (int) tags[i].scalar;
+            break;
+
+		}
+	}
+
+	return 0;
+out_of_memory:
+	return -1;
+parse_error:
+	return -2;
+}
+
+/*
+  the number of bytes a strip or tile should decompress to
+    Params: header - the image header
+            width, height - the strip or tile dimensions
+            sample_index - the sample, for planar images, else -1
+    Returns: byte count, 0 if it's too big
+*/
+static unsigned long header_unitbytes(BASICHEADER *header, int width, int height, int sample_index)
+{
+	double bits = 0;
+	double answer;
+	int hsub, vsub;
+	int i;
+
+	if (sample_index >= 0)
+		bits = header->bitspersample[sample_index];
+	else
+		for (i = 0; i < header->samplesperpixel; i++)
+			bits += header->bitspersample[i];
+
+	if (sample_index < 0 && header->photometricinterpretation == PI_YCbCr)
+	{
+		/* luma for each subsampling block, then one Cb and one Cr */
+		hsub = header->YCbCrSubSampling_h;
+		vsub = header->YCbCrSubSampling_v;
+		if (hsub < 1 || vsub < 1)
+			return 0;
+		answer = (double)((width + hsub - 1) / hsub) * ((height + vsub - 1) / vsub) * (hsub * vsub + 2);
+		answer = ceil(answer * header->bitspersample[0] / 8);
+	}
+	else
+		answer = floor((width * bits + 7) / 8) * height;
+	if (answer > LONG_MAX)
+		return 0;
+
+	return (unsigned long) answer;
+}
+
+static int header_Noutsamples(BASICHEADER *header)
+{
+
+        switch(header->photometricinterpretation)
+	{
+	case PI_BlackIsZero:
+        case PI_WhiteIsZero:
+	  return 2;
+        case PI_CMYK:
+          if(header->extrasamples == 1)
+	  {
+             return 5;
+	  }
+          else
+	  {
+	    return 4;
+	  }
+          break;
+        case PI_RGB:
+	  return 4;
+        case PI_RGB_Palette:
+	  return 4;
+        case PI_YCbCr:
+          return 4;
+        default:
+	  return 4;
+	}
+  
+}
+
+static int header_Ninsamples(BASICHEADER *header)
+{
+    
+    switch(header->photometricinterpretation)
+    {
+        case PI_BlackIsZero:
+        case PI_WhiteIsZero:
+            return 1 + ((header->extrasamples == 1) ? 1 : 0);
+        case PI_CMYK:
+            return 4 + ((header->extrasamples == 1) ? 1 : 0);
+        case PI_RGB:
+            return 3 + ((header->extrasamples == 1) ? 1 : 0);
+        case PI_RGB_Palette:
+            return 4;
+        case PI_YCbCr:
+            return 4;
+        default:
+            return 4;
+    }
+    
+}
+
+
+static int header_outputformat(BASICHEADER *header)
+{
+	if (header->samplebytes == 2)
+	{
+		switch (header->photometricinterpretation)
+		{
+		case PI_CMYK:
+			return header->extrasamples == 1 ? FMT_CMYKA16 : FMT_CMYK16;
+		case PI_RGB:
+			return FMT_RGBA16;
+		default:
+			return FMT_GREYALPHA16;
+		}
+	}
+	if (header->samplebytes == 4)
+	{
+		switch (header->photometricinterpretation)
+		{
+		case PI_CMYK:
+			return header->extrasamples == 1 ? FMT_CMYKAF : FMT_CMYKF;
+		case PI_RGB:
+			return FMT_RGBAF;
+		default:
+			return FMT_GREYALPHAF;
+		}
+	}
+
+        switch(header->photometricinterpretation)
+	{
+	case PI_BlackIsZero:
+        case PI_WhiteIsZero:
+	  return FMT_GREYALPHA;
+        case PI_CMYK:
+          if(header->extrasamples == 1)
+	  {
+             return FMT_CMYKA;
+	  }
+          else
+	  {
+	    return FMT_CMYK;
+	  }
+          break;
+        case PI_RGB:
+	  return FMT_RGBA;
+        case PI_RGB_Palette:
+	  return FMT_RGBA;
+        case PI_YCbCr:
+          return FMT_RGBA;
+        default:
+	  return FMT_RGBA;
+	}
+
+}
+
+
+
+/*
+  decode the image, or a rectangle of it
+    Params: header - the image header
+            src - the file
+            x, y - rectangle top left
+            width, height - rectangle size
+            nthreads - threads to decode on
+            scale - factor to shrink by, 1 for full size
+            format - return for image format
+    Returns: the raster, 0 on fail
+   A shrunk raster is width / scale by height / scale, rounded up.
+*/
+static unsigned char *loadraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, int scale, int *format)
+{
+	unsigned char *answer = 0;
+	int outsamples;
+	RASTERINTO into;
+	int rwidth, rheight;
+
+
+    *format = header_outputformat(header);
+    outsamples = header_Noutsamples(header);
+	rwidth = (width + scale - 1) / scale;
+	rheight = (height + scale - 1) / scale;
+       
+	answer = malloc((size_t) rwidth * rheight * outsamples * header->samplebytes);
+	if (!answer)
+		goto out_of_memory;
+	STATS_ADD(header->stats, allocations, 1);
+
+	if (scale > 1)
+	{
+		into.buff = answer;
+		into.stride = (size_t) rwidth * outsamples * header->samplebytes;
+		into.format = *format;
+		if (reduceraster(header, src, x, y, width, height, nthreads, scale, intorows, &into, format))
+			goto parse_error;
+	}
+	else if (fillraster(header, src, x, y, width, height, nthreads, answer, (size_t) width * outsamples * header->samplebytes))
+		goto parse_error;
+    
+	return answer;
+
+out_of_memory:
+parse_error:
+	free(answer);
+        *format = 0;
+	return 0;
+}
+
+/*
+  decode the image, or a rectangle of it, into a raster laid out in
+  the output format
+    Params: header - the image header
+            src - the file
+            x, y - rectangle top left
+            width, height - rectangle size
+            nthreads - threads to decode on
+            buff - the raster
+            stride - bytes from one row of the raster to the next
+    Returns: 0 on success, -1 on fail
+*/
+static int fillraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, unsigned char *buff, size_t stride)
+{
+	int outsamples = header_Noutsamples(header);
+	RASTERJOBS jobs;
+	int iy;
+
+	for (iy = 0; iy < height; iy++)
+		setopaque(buff + iy * stride, (unsigned long) width, outsamples, header->samplebytes);
+	if (setupjobs(&jobs, header, src, x, y, width, height))
+		return -1;
+	jobs.answer = buff;
+	jobs.stride = stride;
+	jobs.outsamples = outsamples;
+
+	return rundecodejobs(&jobs, nthreads) ? -1 : 0;
+}
+
+/*
+  decode a raster a band of rows at a time, handing each band to a 
+  callback. A band is a row of strips or tiles, so we only hold one 
+  band, and the strips or tiles making it up, in memory at once.
+    Params: header - the image header
+            src - the source
+            x, y, width, height - the rectangle to decode
+            nthreads - number of threads for the units in a band
+            fn - the callback
+            ptr - passed to the callback
+            format - return for the output format
+    Returns: 0 on success, -1 on out of memory, -2 on parse error,
+      -3 if the callback stopped us
+*/
+static int streamraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, TIFFROWFUNC fn, void *ptr, int *format)
+{
+	unsigned char *band = 0;
+	int outsamples;
+	int bandheight;
+	int top, bottom;
+
+	*format = header_outputformat(header);
+	outsamples = header_Noutsamples(header);
+	bandheight = header->tilewidth ? header->tileheight : header->rowsperstrip;
+	if (bandheight > height)
+		bandheight = height;
+	band = malloc((size_t) width * bandheight * outsamples * header->samplebytes);
+	if (!band)
+		goto out_of_memory;
+	STATS_ADD(header->stats, allocations, 1);
+
+	for (top = y; top < y + height; top = bottom)
+	{
+		/* bands start and end on strip or tile boundaries */
+		if (header->tilewidth)
+			bottom = (top / header->tileheight + 1) * header->tileheight;
+		else
+			bottom = (top / header->rowsperstrip + 1) * header->rowsperstrip;
+		if (bottom > y + height)
+			bottom = y + height;
+		memset(band, 0, (size_t) width * (bottom - top) * outsamples * header->samplebytes);
+		if (fillraster(header, src, x, top, width, bottom - top, nthreads, band, (size_t) width * outsamples * header->samplebytes))
+			goto parse_error;
+		if ((*fn)(ptr, band, top - y, bottom - top, width, *format))
+			goto stopped;
+	}
+	free(band);
+	return 0;
+
+out_of_memory:
+	*format = FMT_ERROR;
+	return -1;
+parse_error:
+	free(band);
+	*format = FMT_ERROR;
+	return -2;
+stopped:
+	free(band);
+	return -3;
+}
+
+/*
+  decode into a raster the caller supplies. If the format is the one 
+  the image decodes to, the strips and tiles go straight in, otherwise
+  a band at a time is decoded and converted.
+    Params: header - the image header
+            src - the source
+            x, y, width, height - the rectangle to decode
+            nthreads - number of threads to decode on
+            scale - factor to shrink by, 1 for full size
+            buff - the raster
+            stride - bytes from one row of the raster to the next
+            format - format wanted
+    Returns: 0 on success, -1 on out of memory, -2 on parse error or
+      if we can't convert to the format
+*/
+static int rasterinto(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, int scale, unsigned char *buff, size_t stride, int format)
+{
+	RASTERINTO into;
+	int native;
+	int err;
+
+	native = header_outputformat(header);
+	if (format == native && scale == 1)
+	{
+		if (stride < (size_t) width * header_Noutsamples(header) * header->samplebytes)
+			return -2;
+		return fillraster(header, src, x, y, width, height, nthreads, buff, stride) ? -2 : 0;
+	}
+	if (format != native)
+	{
+		if (header->samplebytes != 1)
+			return -2;
+		switch (format)
+		{
+		case FMT_RGBA:
+		case FMT_RGB:
+		case FMT_GREYALPHA:
+		case FMT_GREY:
+			break;
+		default:
+			return -2;
+		}
+	}
+	if (stride < (size_t) ((width + scale - 1) / scale) * formatbytes(format))
+		return -2;
+
+	into.buff = buff;
+	into.stride = stride;
+	into.format = format;
+	if (scale > 1)
+		err = reduceraster(header, src, x, y, width, height, nthreads, scale, intorows, &into, &native);
+	else
+		err = streamraster(header, src, x, y, width, height, nthreads, intorows, &into, &native);
+
+	return err == -1 ? -1 : err ? -2 : 0;
+}
+
+/*
+  the streamraster() callback for rasterinto(), copies or converts a band
+*/
+static int intorows(void *ptr, const unsigned char *rows, int y, int Nrows, int width, int format)
+{
+	RASTERINTO *into = ptr;
+	size_t Nbytes = (size_t) width * formatbytes(format);
+	int i;
+
+	for (i = 0; i < Nrows; i++)
+	{
+		if (into->format == format)
+			memcpy(into->buff + (size_t) (y + i) * into->stride, rows + i * Nbytes, Nbytes);
+		else
+			convertpixels(into->buff + (size_t) (y + i) * into->stride, into->format,
+				rows + i * Nbytes, format, width);
+	}
+
+	return 0;
+}
+
+/*
+  decode a raster shrunk by a whole factor, each pixel the average of
+  a scale by scale block (smaller at the right and bottom edges). Each
+  band is added into a single reduced row as it comes out of the 
+  decoder, so we never hold more than a band and that row.
+    Params: header - the image header
+            src - the source
+            x, y, width, height - the rectangle to decode
+            nthreads - number of threads for the units in a band
+            scale - the factor to shrink by
+            fn - called with each reduced row, width / scale rounded up
+              pixels wide
+            ptr - passed to fn
+            format - return for the output format
+    Returns: as streamraster()
+*/
+static int reduceraster(BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height, int nthreads, int scale, TIFFROWFUNC fn, void *ptr, int *format)
+{
+	REDUCER red = {0};
+	size_t Nsums;
+	int err;
+
+	*format = header_outputformat(header);
+	red.scale = scale;
+	red.width = width;
+	red.height = height;
+	red.rwidth = (width + scale - 1) / scale;
+	red.Nsamples = header_Noutsamples(header);
+	red.samplebytes = header->samplebytes;
+	red.fn = fn;
+	red.ptr = ptr;
+	Nsums = (size_t) red.rwidth * red.Nsamples;
+	if (red.samplebytes == 4)
+		red.fsums = calloc(Nsums, sizeof(double));
+	else
+		red.sums = calloc(Nsums, sizeof(unsigned long));
+	red.row = malloc(Nsums * red.samplebytes);
+	if ((!red.sums && !red.fsums) || !red.row)
+		goto out_of_memory;
+	STATS_ADD(header->stats, allocations, 2);
+
+	err = streamraster(header, src, x, y, width, height, nthreads, reducerows, &red, format);
+	free(red.sums);
+	free(red.fsums);
+	free(red.row);
+	return err;
+
+out_of_memory:
+	free(red.sums);
+	free(red.fsums);
+	free(red.row);
+	*format = FMT_ERROR;
+	return -1;
+}
+
+/*
+  the streamraster() callback for reduceraster(), adds a band into the
+  reduced row, passing the row on each time a block of rows is done
+*/
+static int reducerows(void *ptr, const unsigned char *rows, int y, int Nrows, int width, int format)
+{
+	REDUCER *red = ptr;
+	int N = red->Nsamples;
+	int scale = red->scale;
+	size_t Nrow = (size_t) width * N;
+	int i, ix, j, k, end;
+
+	for (i = 0; i < Nrows; i++)
+	{
+		if (red->samplebytes == 1)
+		{
+			const unsigned char *in = rows + i * Nrow;
+			unsigned long *sum = red->sums;
+
+			for (ix = 0; ix < width; ix += scale, sum += N)
+			{
+				end = ix + scale < width ? ix + scale : width;
+				for (j = ix; j < end; j++)
+					for (k = 0; k < N; k++)
+						sum[k] += *in++;
+			}
+		}
+		else if (red->samplebytes == 2)
+		{
+			const unsigned short *in = (const unsigned short *) rows + i * Nrow;
+			unsigned long *sum = red->sums;
+
+			for (ix = 0; ix < width; ix += scale, sum += N)
+			{
+				end = ix + scale < width ? ix + scale : width;
+				for (j = ix; j < end; j++)
+					for (k = 0; k < N; k++)
+						sum[k] += *in++;
+			}
+		}
+		else
+		{
+			const float *in = (const float *) rows + i * Nrow;
+			double *sum = red->fsums;
+
+			for (ix = 0; ix < width; ix += scale, sum += N)
+			{
+				end = ix + scale < width ? ix + scale : width;
+				for (j = ix; j < end; j++)
+					for (k = 0; k < N; k++)
+						sum[k] += *in++;
+			}
+		}
+
+		if ((y + i + 1) % scale == 0 || y + i + 1 == red->height)
+		{
+			reduceaverage(red, (y + i) % scale + 1);
+			if ((*red->fn)(red->ptr, red->row, (y + i) / scale, 1, red->rwidth, format))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+  divide the sums out into the reduced row, and clear them for the 
+  next block of rows
+    Params: red - the reducer
+            Nrows - rows that went into the sums
+*/
+static void reduceaverage(REDUCER *red, int Nrows)
+{
+	int N = red->Nsamples;
+	unsigned long count;
+	int ix, k, i;
+
+	for (ix = 0, i = 0; ix < red->rwidth; ix++)
+	{
+		if (ix == red->rwidth - 1)
+			count = (unsigned long) Nrows * (red->width - ix * red->scale);
+		else
+			count = (unsigned long) Nrows * red->scale;
+		for (k = 0; k < N; k++, i++)
+		{
+			if (red->samplebytes == 1)
+				red->row[i] = (unsigned char) ((red->sums[i] + count / 2) / count);
+			else if (red->samplebytes == 2)
+				((unsigned short *) red->row)[i] = (unsigned short) ((red->sums[i] + count / 2) / count);
+			else
+				((float *) red->row)[i] = (float) (red->fsums[i] / count);
+		}
+	}
+	if (red->sums)
+		memset(red->sums, 0, (size_t) red->rwidth * N * sizeof(unsigned long));
+	else
+		memset(red->fsums, 0, (size_t) red->rwidth * N * sizeof(double));
+}
+
+/*
+  convert 8 bit pixels from one format to another. CMYK goes to RGB
+  the naive way, and colour to grey by the Rec. 601 weights.
+    Params: out - return for the pixels
+            outformat - FMT_RGBA, FMT_RGB, FMT_GREYALPHA or FMT_GREY
+            in - the pixels
+            informat - format of the pixels, an 8 bit format
+            N - number of pixels
+*/
+static void convertpixels(unsigned char *out, int outformat, const unsigned char *in, int informat, int N)
+{
+	int inbytes = formatbytes(informat);
+	int outbytes = formatbytes(outformat);
+	int red, green, blue, alpha;
+	int i;
+
+	for (i = 0; i < N; i++)
+	{
+		switch (informat)
+		{
+		case FMT_GREY:
+		case FMT_GREYALPHA:
+			red = green = blue = in[0];
+			alpha = informat == FMT_GREYALPHA ? in[1] : 255;
+			break;
+		case FMT_CMYK:
+		case FMT_CMYKA:
+			red = (255 - in[0]) * (255 - in[3]) / 255;
+			green = (255 - in[1]) * (255 - in[3]) / 255;
+			blue = (255 - in[2]) * (255 - in[3]) / 255;
+			alpha = informat == FMT_CMYKA ? in[4] : 255;
 			break;
-		case TID_YCBCRCOEFFICIENTS:
-			if (tags[i].datacount < 3)
-				goto parse_error;
-			header->LumaRed = tag_getentry(&tags[i], 0);
-			header->LumaGreen = tag_getentry(&tags[i], 1);
-			header->LumaBlue = tag_getentry(&tags[i], 2);
+		default:
+			red = in[0];
+			green = in[1];
+			blue = in[2];
+			alpha = informat == FMT_RGBA ? in[3] : 255;
 			break;
-		case TID_YCBCRSUBSAMPLING:
-			if (tags[i].datacount < 2)
-				goto parse_error;
-			header->YCbCrSubSampling_h = (int)tag_getentry(&tags[i], 0);
-			header->YCbCrSubSampling_v = (int)tag_getentry(&tags[i], 1);
+		}
+		switch (outformat)
+		{
+		case FMT_RGBA:
+			out[3] = alpha;
+			/* fall through */
+		case FMT_RGB:
+			out[0] = red;
+			out[1] = green;
+			out[2] = blue;
 			break;
-		case TID_YCBCRPOSITIONING:
-			header->YCbCrPositioning = (int)tags[i].scalar;
+		case FMT_GREYALPHA:
+			out[1] = alpha;
+			/* fall through */
+		case FMT_GREY:
+			out[0] = (red * 77 + green * 150 + blue * 29) >> 8;
 			break;
-        case TID_EXTRASAMPLES:
-            header->extrasamples = (int) tags[i].scalar;
-            break;
+		}
+		in += inbytes;
+		out += outbytes;
+	}
+}
+
+/*
+  bytes per pixel of a format, 0 if it isn't one
+*/
+static int formatbytes(int format)
+{
+	switch (format)
+	{
+	case FMT_GREY:
+		return 1;
+	case FMT_GREYALPHA:
+		return 2;
+	case FMT_RGB:
+		return 3;
+	case FMT_RGBA:
+	case FMT_CMYK:
+		return 4;
+	case FMT_CMYKA:
+		return 5;
+	case FMT_GREYALPHA16:
+		return 4;
+	case FMT_RGBA16:
+	case FMT_CMYK16:
+		return 8;
+	case FMT_CMYKA16:
+		return 10;
+	case FMT_GREYALPHAF:
+		return 8;
+	case FMT_RGBAF:
+	case FMT_CMYKF:
+		return 16;
+	case FMT_CMYKAF:
+		return 20;
+	}
+	return 0;
+}
+
+/*
+  work out which strips, tiles or planes cover a rectangle of the image
+    Params: jobs - the jobs to set up (the caller sets answer and 
+              outsamples)
+            header - the image header
+            src - the source
+            x, y, width, height - the rectangle
+    Returns: 0 on success, -1 if we can't decode this layout
+*/
+static int setupjobs(RASTERJOBS *jobs, BASICHEADER *header, TIFFSOURCE *src, int x, int y, int width, int height)
+{
+	int tilesacross = 0;
+	int tilesdown;
+	int stripsperimage;
+	int insamples;
+
+	if (header->tilewidth)
+		tilesacross = (header->imagewidth + header->tilewidth - 1) / header->tilewidth;
+
+	jobs->header = header;
+	jobs->src = src;
+	jobs->answer = 0;
+	jobs->stride = 0;
+	jobs->outsamples = 0;
+	jobs->tilesacross = tilesacross;
+	jobs->x = x;
+	jobs->y = y;
+	jobs->width = width;
+	jobs->height = height;
+	jobs->err = 0;
+#ifdef LOADTIFF_THREADS
+	jobs->Nworkers = 1;
+#endif
+
+	if (tilesacross == 0)
+	{
+		/* strips always span the full image width */
+		stripsperimage = (header->imageheight + header->rowsperstrip - 1) / header->rowsperstrip;
+		jobs->firstrow = y / header->rowsperstrip;
+		jobs->Nrows = (y + height - 1) / header->rowsperstrip - jobs->firstrow + 1;
+		jobs->firstcol = 0;
+		jobs->Ncols = 1;
+		if (header->planarconfiguration == 2)
+		{
+			if (header->photometricinterpretation != PI_RGB &&
+				header->photometricinterpretation != PI_CMYK)
+				return -1;
+			jobs->unit = UNIT_PLANE;
+			insamples = header_Ninsamples(header);
+			if (insamples > (header->Nstripoffsets + stripsperimage - 1) / stripsperimage)
+				insamples = (header->Nstripoffsets + stripsperimage - 1) / stripsperimage;
+			jobs->Nunits = jobs->Nrows * insamples;
+		}
+		else
+		{
+			jobs->unit = UNIT_STRIP;
+			if (jobs->firstrow + jobs->Nrows > header->Nstripoffsets)
+				jobs->Nrows = header->Nstripoffsets - jobs->firstrow;
+			jobs->Nunits = jobs->Nrows;
+		}
+	}
+	else
+	{
+		if (header->planarconfiguration == 2)
+		{
+			if (header->photometricinterpretation != PI_RGB &&
+				header->photometricinterpretation != PI_CMYK)
+				return -1;
+			/* each plane has a full grid of tiles */
+			tilesdown = (header->imageheight + header->tileheight - 1) / header->tileheight;
+			jobs->unit = UNIT_TILEPLANE;
+		}
+		else
+		{
+			tilesdown = (header->Ntileoffsets + tilesacross - 1) / tilesacross;
+			jobs->unit = UNIT_TILE;
+		}
+		jobs->firstrow = y / header->tileheight;
+		jobs->Nrows = (y + height - 1) / header->tileheight - jobs->firstrow + 1;
+		if (jobs->firstrow + jobs->Nrows > tilesdown)
+			jobs->Nrows = tilesdown - jobs->firstrow;
+		jobs->firstcol = x / header->tilewidth;
+		jobs->Ncols = (x + width - 1) / header->tilewidth - jobs->firstcol + 1;
+		jobs->Nunits = jobs->Nrows * jobs->Ncols;
+		if (jobs->unit == UNIT_TILEPLANE && tilesdown > 0)
+		{
+			insamples = header_Ninsamples(header);
+			if (insamples > (header->Ntileoffsets + tilesacross * tilesdown - 1) / (tilesacross * tilesdown))
+				insamples = (header->Ntileoffsets + tilesacross * tilesdown - 1) / (tilesacross * tilesdown);
+			jobs->Nunits *= insamples;
+		}
+	}
+	if (jobs->Nunits < 0)
+		jobs->Nunits = 0;
+
+	return 0;
+}
+
+/*
+  map a job number to a strip or tile index. Jobs run over the 
+  strip or tile grid intersecting the rectangle, then over planes.
+  Planes follow each other in the offsets, so a plane's strips or 
+  tiles start at plane times the strips or tiles in one plane.
+    Params: jobs - the raster being decoded
+            k - job number
+    Returns: index into strip or tile offsets
+*/
+static int unitindex(RASTERJOBS *jobs, int k)
+{
+	BASICHEADER *header = jobs->header;
+	int plane = k / (jobs->Nrows * jobs->Ncols);
+	int row = jobs->firstrow + (k / jobs->Ncols) % jobs->Nrows;
+	int col = jobs->firstcol + k % jobs->Ncols;
+	int stripsperimage;
+	int tilesperplane;
+
+	switch (jobs->unit)
+	{
+	case UNIT_STRIP:
+		return row;
+	case UNIT_TILE:
+		return row * jobs->tilesacross + col;
+	case UNIT_PLANE:
+		stripsperimage = (header->imageheight + header->rowsperstrip - 1) / header->rowsperstrip;
+		return plane * stripsperimage + row;
+	case UNIT_TILEPLANE:
+		tilesperplane = jobs->tilesacross * ((header->imageheight + header->tileheight - 1) / header->tileheight);
+		return plane * tilesperplane + row * jobs->tilesacross + col;
+	}
+	return -1;
+}
+
+/*
+  decode one strip, tile or plane into the raster.
+  Units don't overlap, so this can be called for different units at 
+  the same time.
+    Params: jobs - the raster being decoded
+            k - job number
+    Returns: 0 on success, -1 on fail
+*/
+static int decodeunit(RASTERJOBS *jobs, int k)
+{
+	BASICHEADER *header = jobs->header;
+	TIFFSOURCE *src = jobs->src;
+	RASTERDEST dest;
+	int index;
+	int ux, uy, uwidth, uheight;
+	int stripsperimage;
+	int tilesperplane;
+	int sample_index = 0;
+	int err = -1;
+#ifdef LOADTIFF_STATS
+	/* threads count into their own copies, added up at the end */
+	BASICHEADER unitheader;
+	TIFFSOURCE unitsrc;
+	TIFFSTATS stats = {0};
+#endif
+
+	index = unitindex(jobs, k);
+	switch (jobs->unit)
+	{
+	case UNIT_STRIP:
+		ux = 0;
+		uy = index * header->rowsperstrip;
+		uwidth = header->imagewidth;
+		uheight = index == header->Nstripoffsets - 1 ? header->imageheight - uy : header->rowsperstrip;
+		break;
+	case UNIT_TILE:
+		if (index >= header->Ntileoffsets)
+			return 0;
+		ux = (index % jobs->tilesacross) * header->tilewidth;
+		uy = (index / jobs->tilesacross) * header->tileheight;
+		uwidth = header->tilewidth;
+		uheight = header->tileheight;
+		break;
+	case UNIT_PLANE:
+		if (index >= header->Nstripoffsets)
+			return 0;
+		stripsperimage = (header->imageheight + header->rowsperstrip - 1) / header->rowsperstrip;
+		sample_index = index / stripsperimage;
+		ux = 0;
+		uy = (index % stripsperimage) * header->rowsperstrip;
+		uwidth = header->imagewidth;
+		uheight = index % stripsperimage == stripsperimage - 1 ? header->imageheight - uy : header->rowsperstrip;
+		break;
+	case UNIT_TILEPLANE:
+		if (index >= header->Ntileoffsets)
+			return 0;
+		tilesperplane = jobs->tilesacross * ((header->imageheight + header->tileheight - 1) / header->tileheight);
+		sample_index = index / tilesperplane;
+		ux = (index % jobs->tilesacross) * header->tilewidth;
+		uy = (index % tilesperplane / jobs->tilesacross) * header->tileheight;
+		uwidth = header->tilewidth;
+		uheight = header->tileheight;
+		break;
+	default:
+		return -1;
+	}
+
+	dest.left = jobs->x > ux ? jobs->x - ux : 0;
+	dest.right = jobs->x + jobs->width - ux < uwidth ? jobs->x + jobs->width - ux : uwidth;
+	dest.top = jobs->y > uy ? jobs->y - uy : 0;
+	dest.bottom = jobs->y + jobs->height - uy < uheight ? jobs->y + jobs->height - uy : uheight;
+	if (dest.left >= dest.right || dest.top >= dest.bottom)
+		return 0;
+	dest.depth = jobs->outsamples * header->samplebytes;
+	dest.stride = jobs->stride;
+	dest.pixels = jobs->answer + (size_t) (uy + dest.top - jobs->y) * dest.stride
+		+ (size_t) (ux + dest.left - jobs->x) * dest.depth + sample_index * header->samplebytes;
+	dest.scratch = 0;
+#ifdef LOADTIFF_STATS
+	dest.stats = 0;
+	if (header->stats)
+	{
+		unitheader = *header;
+		unitheader.stats = &stats;
+		header = &unitheader;
+		unitsrc = *src;
+		unitsrc.stats = &stats;
+		src = &unitsrc;
+		dest.stats = &stats;
+	}
+#endif
+	if (src->cache && (jobs->unit == UNIT_STRIP || jobs->unit == UNIT_TILE) &&
+		(size_t) uwidth * uheight * dest.depth <= src->cache->shards[0].maxbytes)
+	{
+		err = cachedunit(jobs, header, src, index, &dest, uwidth, uheight);
+		goto done;
+	}
+	if (dest.left > 0 || dest.right < uwidth)
+	{
+		dest.scratch = malloc((size_t) uwidth * dest.depth);
+		if (!dest.scratch)
+			goto done;
+		STATS_ADD(header->stats, allocations, 1);
+	}
+
+	switch (jobs->unit)
+	{
+	case UNIT_STRIP:
+		err = readstrip(header, index, src, &dest);
+		break;
+	case UNIT_TILE:
+		err = readtile(header, index, src, &dest);
+		break;
+	case UNIT_PLANE:
+		err = readchannel(header, index, src, &dest);
+		break;
+	case UNIT_TILEPLANE:
+		err = readtilechannel(header, index, src, &dest);
+		break;
+	}
+	free(dest.scratch);
+
+done:
+#ifdef LOADTIFF_STATS
+	if (header->stats)
+		unitstats(jobs, &stats);
+#endif
+	return err;
+}
+
+#ifdef LOADTIFF_STATS
+/*
+  add a unit's counts into the caller's stats
+    Params: jobs - the raster being decoded
+            stats - what the unit took
+*/
+static void unitstats(RASTERJOBS *jobs, const TIFFSTATS *stats)
+{
+#ifdef LOADTIFF_THREADS
+	if (jobs->Nworkers > 1)
+		lockacquire(&jobs->lock);
+#endif
+	statsadd(jobs->header->stats, stats);
+#ifdef LOADTIFF_THREADS
+	if (jobs->Nworkers > 1)
+		lockrelease(&jobs->lock);
+#endif
+}
+#endif
+
+/*
+  decode a strip or tile through the cache. If it isn't there we 
+  decode all of it, paste the part we want and keep the rest.
+    Params: jobs - the raster being decoded
+            header - the image header
+            src - the source
+            index - the strip or tile
+            dest - where it goes
+            uwidth, uheight - size of the strip or tile
+    Returns: 0 on success, -1 on fail
+*/
+static int cachedunit(RASTERJOBS *jobs, BASICHEADER *header, TIFFSOURCE *src, int index, RASTERDEST *dest, int uwidth, int uheight)
+{
+	RASTERDEST whole;
+	CACHEKEY key;
+	unsigned char *pixels;
+	size_t Nbytes = (size_t) uwidth * uheight * dest->depth;
+	int err;
+
+	key.fileid = src->fileid;
+	key.page = header->page;
+	key.index = index;
+	key.samplebytes = header->samplebytes;
+	if (cache_paste(src->cache, &key, dest, uwidth))
+		return 0;
+
+	pixels = malloc(Nbytes);
+	if (!pixels)
+		return -1;
+	STATS_ADD(header->stats, allocations, 1);
+	memset(pixels, 0, Nbytes);
+	setopaque(pixels, (unsigned long) uwidth * uheight, jobs->outsamples, header->samplebytes);
+	whole.pixels = pixels;
+	whole.stride = (size_t) uwidth * dest->depth;
+	whole.depth = dest->depth;
+	whole.left = 0;
+	whole.right = uwidth;
+	whole.top = 0;
+	whole.bottom = uheight;
+	whole.scratch = 0;
+#ifdef LOADTIFF_STATS
+	whole.stats = dest->stats;
+#endif
+	if (jobs->unit == UNIT_TILE)
+		err = readtile(header, index, src, &whole);
+	else
+		err = readstrip(header, index, src, &whole);
+	if (err)
+	{
+		free(pixels);
+		return -1;
+	}
+	pastedest(dest, pixels, uwidth, dest->depth);
+	cache_insert(src->cache, &key, pixels, Nbytes);
+
+	return 0;
+}
+
+/*
+  set the last sample of each pixel, the alpha, to opaque
+    Params: buff - the raster
+            Npixels - number of pixels
+            outsamples - samples per pixel
+            samplebytes - 1 or 2 for integer samples, 4 for float
+*/
+static void setopaque(unsigned char *buff, unsigned long Npixels, int outsamples, int samplebytes)
+{
+	unsigned long ii;
+	float one = 1.0f;
+
+	for (ii = 0; ii < Npixels; ii++)
+	{
+		if (samplebytes == 4)
+			memcpy(buff + (ii + 1) * outsamples * samplebytes - 4, &one, 4);
+		else
+			memset(buff + (ii + 1) * outsamples * samplebytes - samplebytes, 255, samplebytes);
+	}
+}
+
+#ifdef LOADTIFF_THREADS
+
+static void lockinit(LOCK *lock)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(lock);
+#else
+	pthread_mutex_init(lock, 0);
+#endif
+}
+
+static void lockkill(LOCK *lock)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(lock);
+#else
+	pthread_mutex_destroy(lock);
+#endif
+}
+
+static void lockacquire(LOCK *lock)
+{
+#ifdef _WIN32
+	EnterCriticalSection(lock);
+#else
+	pthread_mutex_lock(lock);
+#endif
+}
+
+static void lockrelease(LOCK *lock)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(lock);
+#else
+	pthread_mutex_unlock(lock);
+#endif
+}
+
+typedef struct
+{
+	RASTERJOBS *jobs;
+	int id;
+} WORKER;
+
+/*
+  get the next unit for a worker to decode. Each worker owns a 
+  contiguous run of units. When its run is used up it steals the 
+  back half of the longest run left, so a few slow strips don't
+  leave the other threads idle.
+    Params: jobs - the raster being decoded
+            id - the worker
+    Returns: index of unit to decode, -1 when there's no work left
+*/
+static int nextunit(RASTERJOBS *jobs, int id)
+{
+	int answer = -1;
+	int victim = -1;
+	int most = 0;
+	int mid;
+	int i;
 
+	lockacquire(&jobs->lock);
+	if (!jobs->err)
+	{
+		if (jobs->next[id] >= jobs->end[id])
+		{
+			for (i = 0; i < jobs->Nworkers; i++)
+			{
+				if (jobs->end[i] - jobs->next[i] > most)
+				{
+					most = jobs->end[i] - jobs->next[i];
+					victim = i;
+				}
+			}
+			if (victim >= 0)
+			{
+				mid = jobs->next[victim] + most / 2;
+				jobs->next[id] = mid;
+				jobs->end[id] = jobs->end[victim];
+				jobs->end[victim] = mid;
+			}
 		}
+		if (jobs->next[id] < jobs->end[id])
+			answer = jobs->next[id]++;
 	}
+	lockrelease(&jobs->lock);
 
-	return 0;
-out_of_memory:
-	return -1;
-parse_error:
-	return -2;
+	return answer;
 }
 
-static int header_Noutsamples(BASICHEADER *header)
+static void workerloop(WORKER *worker)
 {
+	RASTERJOBS *jobs = worker->jobs;
+	int index;
 
-        switch(header->photometricinterpretation)
+	while ((index = nextunit(jobs, worker->id)) >= 0)
 	{
-	case PI_BlackIsZero:
-        case PI_WhiteIsZero:
-	  return 2;
-        case PI_CMYK:
-          if(header->extrasamples == 1)
-	  {
-             return 5;
-	  }
-          else
-	  {
-	    return 4;
-	  }
-          break;
-        case PI_RGB:
-	  return 4;
-        case PI_RGB_Palette:
-	  return 4;
-        case PI_YCbCr:
-          return 4;
-        default:
-	  return 4;
+		if (decodeunit(jobs, index))
+		{
+			lockacquire(&jobs->lock);
+			jobs->err = -1;
+			lockrelease(&jobs->lock);
+		}
 	}
-  
 }
 
-static int header_Ninsamples(BASICHEADER *header)
+#ifdef _WIN32
+static DWORD WINAPI workerthread(LPVOID arg)
 {
-    
-    switch(header->photometricinterpretation)
-    {
-        case PI_BlackIsZero:
-        case PI_WhiteIsZero:
-            return 1 + ((header->extrasamples == 1) ? 1 : 0);
-        case PI_CMYK:
-            return 4 + ((header->extrasamples == 1) ? 1 : 0);
-        case PI_RGB:
-            return 3 + ((header->extrasamples == 1) ? 1 : 0);
-        case PI_RGB_Palette:
-            return 4;
-        case PI_YCbCr:
-            return 4;
-        default:
-            return 4;
-    }
-    
+	workerloop(arg);
+	return 0;
+}
+#else
+static void *workerthread(void *arg)
+{
+	workerloop(arg);
+	return 0;
 }
+#endif
 
+#endif
 
-static int header_outputformat(BASICHEADER *header)
+/*
+  decode all the units, on up to nthreads threads. The calling thread
+  is one of the workers. If threads can't be started, the other 
+  workers simply take their share.
+    Params: jobs - the raster to decode
+            nthreads - number of threads to use
+    Returns: 0 on success, -1 on fail
+*/
+static int rundecodejobs(RASTERJOBS *jobs, int nthreads)
 {
+	int i;
+#ifdef LOADTIFF_THREADS
+	WORKER *workers = 0;
+	THREAD *threads = 0;
+	char *started = 0;
+
+	if (nthreads > jobs->Nunits)
+		nthreads = jobs->Nunits;
+	if (nthreads <= 1)
+		goto single_thread;
+
+	workers = malloc(nthreads * sizeof(WORKER));
+	threads = malloc(nthreads * sizeof(THREAD));
+	started = malloc(nthreads);
+	jobs->next = malloc(nthreads * sizeof(int));
+	jobs->end = malloc(nthreads * sizeof(int));
+	if (!workers || !threads || !started || !jobs->next || !jobs->end)
+	{
+		free(workers);
+		free(threads);
+		free(started);
+		free(jobs->next);
+		free(jobs->end);
+		goto single_thread;
+	}
+	jobs->Nworkers = nthreads;
+	for (i = 0; i < nthreads; i++)
+	{
+		jobs->next[i] = (int) ((double)jobs->Nunits * i / nthreads);
+		jobs->end[i] = (int) ((double)jobs->Nunits * (i + 1) / nthreads);
+		workers[i].jobs = jobs;
+		workers[i].id = i;
+	}
+	lockinit(&jobs->lock);
 
-        switch(header->photometricinterpretation)
+	for (i = 1; i < nthreads; i++)
 	{
-	case PI_BlackIsZero:
-        case PI_WhiteIsZero:
-	  return FMT_GREYALPHA;
-        case PI_CMYK:
-          if(header->extrasamples == 1)
-	  {
-             return FMT_CMYKA;
-	  }
-          else
-	  {
-	    return FMT_CMYK;
-	  }
-          break;
-        case PI_RGB:
-	  return FMT_RGBA;
-        case PI_RGB_Palette:
-	  return FMT_RGBA;
-        case PI_YCbCr:
-          return FMT_RGBA;
-        default:
-	  return FMT_RGBA;
+#ifdef _WIN32
+		threads[i] = CreateThread(0, 0, workerthread, &workers[i], 0, 0);
+		started[i] = threads[i] != 0;
+#else
+		started[i] = pthread_create(&threads[i], 0, workerthread, &workers[i]) == 0;
+#endif
+	}
+	workerloop(&workers[0]);
+	for (i = 1; i < nthreads; i++)
+	{
+		if (!started[i])
+			continue;
+#ifdef _WIN32
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+#else
+		pthread_join(threads[i], 0);
+#endif
 	}
 
+	lockkill(&jobs->lock);
+	free(workers);
+	free(threads);
+	free(started);
+	free(jobs->next);
+	free(jobs->end);
+
+	return jobs->err;
+
+single_thread:
+#else
+	(void) nthreads;
+#endif
+	for (i = 0; i < jobs->Nunits; i++)
+		if (decodeunit(jobs, i))
+			return -1;
+	return 0;
 }
 
+#ifdef LOADTIFF_STATS
+/*//////////////////////////////////////////////////////////////////////////////////////////////////*/
+/* statistics section*/
+/*//////////////////////////////////////////////////////////////////////////////////////////////////*/
+
+/*
+  a clock in nanoseconds, for timing stages
+*/
+static unsigned long long statsclock(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (unsigned long long) ((double) count.QuadPart * 1e9 / frequency.QuadPart);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
+/*
+  add the time since start to a converter's total, less the time spent
+  on the predictor and pasting, which have totals of their own
+    Params: stats - the stats, or 0
+            field - the converter's total
+            start - the clock when the converter started
+            inner - predictor_ns + paste_ns when it started
+*/
+static void statsconvert(TIFFSTATS *stats, unsigned long long *field, unsigned long long start, unsigned long long inner)
+{
+	if (!stats)
+		return;
+	*field += statsclock() - start - (stats->predictor_ns + stats->paste_ns - inner);
+}
 
-static unsigned char *loadraster(BASICHEADER *header, FILE *fp, int *format)
+/*
+  add one set of stats to another
+*/
+static void statsadd(TIFFSTATS *stats, const TIFFSTATS *add)
 {
-	unsigned char *answer = 0;
-	unsigned char *strip = 0;
 	int i;
-	unsigned long ii;
-	int row = 0;
-	int swidth, sheight;
-	int tilesacross = 0;
-	int sample_index;
-	int outsamples;
-    int insamples;
 
+	stats->parse_ns += add->parse_ns;
+	stats->io_ns += add->io_ns;
+	for (i = 0; i < TIFFSTATS_CODECS; i++)
+		stats->decompress_ns[i] += add->decompress_ns[i];
+	stats->unpack_ns += add->unpack_ns;
+	stats->palette_ns += add->palette_ns;
+	stats->ycbcr_ns += add->ycbcr_ns;
+	stats->deep_ns += add->deep_ns;
+	stats->predictor_ns += add->predictor_ns;
+	stats->paste_ns += add->paste_ns;
+	stats->bytesread += add->bytesread;
+	stats->reads += add->reads;
+	stats->allocations += add->allocations;
+	stats->units += add->units;
+	stats->compressedbytes += add->compressedbytes;
+	stats->decompressedbytes += add->decompressedbytes;
+}
 
-    *format = header_outputformat(header);
-    outsamples = header_Noutsamples(header);
-    insamples = header_Ninsamples(header);
-       
-	answer = malloc(header->imagewidth* header->imageheight *outsamples);
-	if (!answer)
-		goto out_of_memory;
+/*
+  the decompress_ns slot for a compression
+*/
+static int statscodec(int compression)
+{
+	switch (compression)
+	{
+	case 1:
+		return TIFFSTATS_NONE;
+	case COMPRESSION_CCITTRLE:
+		return TIFFSTATS_CCITTRLE;
+	case COMPRESSION_CCITTFAX3:
+		return TIFFSTATS_GROUP3;
+	case COMPRESSION_CCITTFAX4:
+		return TIFFSTATS_GROUP4;
+	case COMPRESSION_LZW:
+		return TIFFSTATS_LZW;
+	case COMPRESSION_ADOBE_DEFLATE:
+	case COMPRESSION_DEFLATE:
+		return TIFFSTATS_DEFLATE;
+	case COMPRESSION_PACKBITS:
+		return TIFFSTATS_PACKBITS;
+	}
+	return TIFFSTATS_OTHER;
+}
+#endif
+
+/*//////////////////////////////////////////////////////////////////////////////////////////////////*/
+/* decoded strip and tile cache section*/
+/*//////////////////////////////////////////////////////////////////////////////////////////////////*/
+
+/*
+   make a cache of decoded strips and tiles, to share between open files
+    Params: maxbytes - most memory the pixels it keeps may take
+    Returns: the cache, 0 on out of memory
+   The budget is split between shards, each of which can be locked on
+   its own, but there are never so many that a shard holds less than 
+   4MB. A strip or tile too big for a shard isn't kept.
+ */
+TIFFCACHE *loadtiff_createcache(size_t maxbytes)
+{
+	TIFFCACHE *cache;
+	int i;
 
-        for(ii=0;ii<header->imagewidth * header->imageheight;ii++)
+	cache = malloc(sizeof(TIFFCACHE));
+	if (!cache)
+		return 0;
+	cache->Nshards = CACHE_SHARDS;
+	while (cache->Nshards > 1 && maxbytes / cache->Nshards < 4 * 1024 * 1024)
+		cache->Nshards /= 2;
+	cache->shards = calloc(cache->Nshards, sizeof(CACHESHARD));
+	if (!cache->shards)
 	{
-	  answer[ii*outsamples+outsamples-1] = 255;
+		free(cache);
+		return 0;
 	}
-	if (header->tilewidth)
-		tilesacross = (header->imagewidth + header->tilewidth - 1) / header->tilewidth;
+	for (i = 0; i < cache->Nshards; i++)
+	{
+		cache->shards[i].maxbytes = maxbytes / cache->Nshards;
+#ifdef LOADTIFF_THREADS
+		lockinit(&cache->shards[i].lock);
+#endif
+	}
+	cache->nextid = 0;
+#ifdef LOADTIFF_THREADS
+	lockinit(&cache->lock);
+#endif
 
-	if (header->planarconfiguration == 2)
+	return cache;
+}
+
+/*
+   free a cache. Files using it must be closed first.
+ */
+void loadtiff_killcache(TIFFCACHE *cache)
+{
+	CACHEENTRY *entry, *next;
+	int i;
+
+	if (!cache)
+		return;
+	for (i = 0; i < cache->Nshards; i++)
 	{
-		if (header->photometricinterpretation == PI_RGB)
+		for (entry = cache->shards[i].newest; entry; entry = next)
 		{
-			sample_index = 0;
-			for (i = 0; i < header->Nstripoffsets; i++)
-			{
-				if (sample_index >= insamples)
-					continue;    
-				strip = readchannel(header, i, &swidth, &sheight, fp);
-				if (!strip)
-					goto out_of_memory;
-				for (ii = 0; ii < (unsigned long) (swidth * sheight); ii++)
-				{
-					answer[((row + ii / swidth)*header->imagewidth + (ii%swidth)) * outsamples + sample_index] = strip[ii];
-				}
-			
-				row += sheight;
-				if (row >= header->imageheight)
-				{
-					row = 0;
-					sample_index++;
-				}
-			
-				free(strip);
-			}
-			return answer;
+			next = entry->next;
+			free(entry->pixels);
+			free(entry);
 		}
-		else if (header->photometricinterpretation == PI_CMYK)
-		{
-			sample_index = 0;
-			for (i = 0; i < header->Nstripoffsets; i++)
-			{
-				if (sample_index >= insamples)
-					continue;
-				strip = readchannel(header, i, &swidth, &sheight, fp);
-				if (!strip)
-					goto out_of_memory;
-				for (ii = 0; ii < (unsigned long)(swidth * sheight); ii++)
-				{
-					answer[((row + ii / swidth)*header->imagewidth + (ii%swidth)) * outsamples + sample_index] = strip[ii];
-				}
+#ifdef LOADTIFF_THREADS
+		lockkill(&cache->shards[i].lock);
+#endif
+	}
+#ifdef LOADTIFF_THREADS
+	lockkill(&cache->lock);
+#endif
+	free(cache->shards);
+	free(cache);
+}
 
-				row += sheight;
-				if (row >= header->imageheight)
-				{
-					row = 0;
-					sample_index++;
-				}
+/*
+   keep the strips and tiles decoded from an open file in a cache, so 
+   later calls for overlapping regions don't decode them again
+    Params: tf - the file
+            cache - the cache, 0 to stop caching
+   Call before decoding from the file. The file's entries are thrown
+   away when it is closed.
+ */
+void loadtiff_setcache(TIFFFILE *tf, TIFFCACHE *cache)
+{
+	if (tf->src.cache)
+		cache_purge(tf->src.cache, tf->src.fileid);
+	tf->src.cache = cache;
+	if (!cache)
+		return;
+#ifdef LOADTIFF_THREADS
+	lockacquire(&cache->lock);
+#endif
+	tf->src.fileid = ++cache->nextid;
+#ifdef LOADTIFF_THREADS
+	lockrelease(&cache->lock);
+#endif
+}
 
-				free(strip);
-			}
-			return answer;
-		}
-        else
-            goto parse_error;
-            
+/*
+   get the counters of a cache, added up over the shards
+    Params: cache - the cache
+            stats - return for the counters
+ */
+void loadtiff_cachestats(TIFFCACHE *cache, TIFFCACHESTATS *stats)
+{
+	CACHESHARD *shard;
+	int i;
+
+	stats->hits = 0;
+	stats->misses = 0;
+	stats->evictions = 0;
+	stats->entries = 0;
+	stats->bytes = 0;
+	for (i = 0; i < cache->Nshards; i++)
+	{
+		shard = &cache->shards[i];
+#ifdef LOADTIFF_THREADS
+		lockacquire(&shard->lock);
+#endif
+		stats->hits += shard->hits;
+		stats->misses += shard->misses;
+		stats->evictions += shard->evictions;
+		stats->entries += shard->entries;
+		stats->bytes += shard->bytes;
+#ifdef LOADTIFF_THREADS
+		lockrelease(&shard->lock);
+#endif
 	}
+}
+
+/*
+  find the shard and hash bucket for a key
+*/
+static CACHESHARD *cache_shard(struct tiffcache *cache, const CACHEKEY *key, int *bucket)
+{
+	unsigned long hash;
+
+	hash = key->fileid * 2654435761UL;
+	hash = (hash ^ (unsigned long) key->page) * 2654435761UL;
+	hash = (hash ^ (unsigned long) key->index) * 2654435761UL;
+	hash ^= (unsigned long) key->samplebytes;
+	hash ^= hash >> 15;
+	*bucket = (int) ((hash / cache->Nshards) % CACHE_BUCKETS);
+
+	return &cache->shards[hash % cache->Nshards];
+}
+
+/*
+  test if two keys are for the same strip or tile
+*/
+static int cache_samekey(const CACHEKEY *a, const CACHEKEY *b)
+{
+	return a->fileid == b->fileid && a->page == b->page && 
+		a->index == b->index && a->samplebytes == b->samplebytes;
+}
+
+/*
+  paste a strip or tile out of the cache, if it is there, and mark it
+  as just used. The copy is made under the shard lock so the entry 
+  can't be evicted under us.
+    Params: cache - the cache
+            key - the strip or tile
+            dest - where it goes
+            width - width of the strip or tile
+    Returns: 1 if it was there, 0 if not
+*/
+static int cache_paste(struct tiffcache *cache, const CACHEKEY *key, RASTERDEST *dest, int width)
+{
+	CACHESHARD *shard;
+	CACHEENTRY *entry;
+	int bucket;
 
-	if (header->Nstripoffsets > 0 && tilesacross == 0)
+	shard = cache_shard(cache, key, &bucket);
+#ifdef LOADTIFF_THREADS
+	lockacquire(&shard->lock);
+#endif
+	for (entry = shard->buckets[bucket]; entry; entry = entry->chain)
+		if (cache_samekey(&entry->key, key))
+			break;
+	if (entry)
 	{
-		for (i = 0; i < header->Nstripoffsets; i++)
+		shard->hits++;
+		if (entry != shard->newest)
 		{
-			strip = readstrip(header, i, &swidth, &sheight, fp, &insamples);
-			if (!strip)
-				goto out_of_memory;
-            pasteflexible(answer, header->imagewidth, header->imageheight, outsamples,
-                          strip, swidth, sheight, insamples, 0, row);
-			row += sheight;
-			free(strip);
+			entry->prev->next = entry->next;
+			if (entry->next)
+				entry->next->prev = entry->prev;
+			else
+				shard->oldest = entry->prev;
+			entry->prev = 0;
+			entry->next = shard->newest;
+			shard->newest->prev = entry;
+			shard->newest = entry;
 		}
+		pastedest(dest, entry->pixels, width, dest->depth);
+	}
+	else
+		shard->misses++;
+#ifdef LOADTIFF_THREADS
+	lockrelease(&shard->lock);
+#endif
+
+	return entry ? 1 : 0;
+}
+
+/*
+  add a decoded strip or tile to the cache, evicting the least 
+  recently used entries to make room
+    Params: cache - the cache
+            key - the strip or tile
+            pixels - the pixels, which the cache takes over
+            Nbytes - size of pixels
+*/
+static void cache_insert(struct tiffcache *cache, const CACHEKEY *key, unsigned char *pixels, size_t Nbytes)
+{
+	CACHESHARD *shard;
+	CACHEENTRY *entry;
+	CACHEENTRY *other;
+	int bucket;
+	int oldbucket;
+
+	shard = cache_shard(cache, key, &bucket);
+	entry = malloc(sizeof(CACHEENTRY));
+	if (!entry || Nbytes > shard->maxbytes)
+	{
+		free(entry);
+		free(pixels);
+		return;
 	}
+	entry->key = *key;
+	entry->pixels = pixels;
+	entry->Nbytes = Nbytes;
+
+#ifdef LOADTIFF_THREADS
+	lockacquire(&shard->lock);
+#endif
+	/* another thread may have decoded it at the same time */
+	for (other = shard->buckets[bucket]; other; other = other->chain)
+		if (cache_samekey(&other->key, key))
+			break;
+	if (other)
+	{
+#ifdef LOADTIFF_THREADS
+		lockrelease(&shard->lock);
+#endif
+		free(entry);
+		free(pixels);
+		return;
+	}
+	while (shard->oldest && shard->bytes + Nbytes > shard->maxbytes)
+	{
+		cache_shard(cache, &shard->oldest->key, &oldbucket);
+		cache_unlink(shard, shard->oldest, oldbucket);
+		shard->evictions++;
+	}
+	entry->prev = 0;
+	entry->next = shard->newest;
+	if (shard->newest)
+		shard->newest->prev = entry;
+	else
+		shard->oldest = entry;
+	shard->newest = entry;
+	entry->chain = shard->buckets[bucket];
+	shard->buckets[bucket] = entry;
+	shard->bytes += Nbytes;
+	shard->entries++;
+#ifdef LOADTIFF_THREADS
+	lockrelease(&shard->lock);
+#endif
+}
+
+/*
+  take an entry out of a shard and free it. Call with the shard locked.
+    Params: shard - the shard
+            entry - the entry
+            bucket - its hash bucket
+*/
+static void cache_unlink(CACHESHARD *shard, CACHEENTRY *entry, int bucket)
+{
+	CACHEENTRY **link;
+
+	for (link = &shard->buckets[bucket]; *link != entry; link = &(*link)->chain)
+		;
+	*link = entry->chain;
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		shard->newest = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		shard->oldest = entry->prev;
+	shard->bytes -= entry->Nbytes;
+	shard->entries--;
+	free(entry->pixels);
+	free(entry);
+}
 
-	if (header->Nstripoffsets > 0 && tilesacross != 0)
-	{
-		header->Ntileoffsets = header->Nstripoffsets;
-		header->tileoffsets = header->stripoffsets;
-		header->stripoffsets = 0;
-		header->Nstripoffsets = 0;
-	}
-	if (header->Ntilebytecounts == 0 && tilesacross != 0)
-	{
-		header->Ntilebytecounts = header->Nstripoffsets;
-		header->tilebytecounts = header->stripbytecounts;
-		header->stripbytecounts = 0;
-		header->Nstripbytecounts = 0;
-	}
-    if (header->Ntileoffsets > 0)
+/*
+  throw away all the entries of a file
+    Params: cache - the cache
+            fileid - the file
+*/
+static void cache_purge(struct tiffcache *cache, unsigned long fileid)
+{
+	CACHESHARD *shard;
+	CACHEENTRY *entry, *next;
+	int bucket;
+	int i;
+
+	for (i = 0; i < cache->Nshards; i++)
 	{
-		for (i = 0; i < header->Ntileoffsets; i++)
+		shard = &cache->shards[i];
+#ifdef LOADTIFF_THREADS
+		lockacquire(&shard->lock);
+#endif
+		for (entry = shard->newest; entry; entry = next)
 		{
-			strip = readtile(header, i, &swidth, &sheight, fp, &insamples);
-			if (!strip)
-				goto out_of_memory;
-            
-        
-            pasteflexible(answer, header->imagewidth, header->imageheight, outsamples,
-                          strip, swidth, sheight, insamples,
-                          (i % tilesacross) * header->tilewidth,
-                          (i/tilesacross) * header->tileheight);
-			free(strip);
+			next = entry->next;
+			if (entry->key.fileid == fileid)
+			{
+				cache_shard(cache, &entry->key, &bucket);
+				cache_unlink(shard, entry, bucket);
+			}
 		}
+#ifdef LOADTIFF_THREADS
+		lockrelease(&shard->lock);
+#endif
 	}
-    
-	return answer;
-
-out_of_memory:
-parse_error:
-	free(answer);
-	free(strip);
-        *format = 0;
-	return 0;
 }
 
 /*//////////////////////////////////////////////////////////////////////////////////////////////////*/
 /* stip tile and plane loading section*/
 /*//////////////////////////////////////////////////////////////////////////////////////////////////*/
 
-static int planetochannel(unsigned char *out, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int sample_index);
+static void chooseunpacker(UNPACKER *up, BASICHEADER *header, int sample_index, int Nin, int Nout, int step);
+static void header_packedlut(BASICHEADER *header, int bits, int scale);
+static int header_palette(BASICHEADER *header);
+static int unpacksamples(RASTERDEST *dest, int width, int height, const unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, const UNPACKER *up);
 
-static int greytogrey(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long N, BASICHEADER *header, int insamples);
-static int paltorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header);
+static int paltorgba(RASTERDEST *dest, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header);
 static int ycbcrtorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long N, BASICHEADER *header);
-static int cmyktocmyk(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int insamples);
-static int bitstreamtorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int insamples);
 
 
-static void unpredictsamples(unsigned char *buff, int width, int height, int depth, BASICHEADER *header);
+static void unpredictrow(unsigned char *row, int width, int Nsamples, int step);
+static void unpredictrow16(unsigned char *row, int width, int Nsamples, int bigendian);
 
-static int readbytesample(unsigned char *bytes, BASICHEADER *header, int sample_index);
+static int readbytesample(const unsigned char *bytes, const BASICHEADER *header, int sample_index);
+static int deepsamples(unsigned char *out, int width, int height, const unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int sample_index, int Nin, int Nout);
 static int readintsample(unsigned char *bytes, BASICHEADER *header, int sample_index);
 
 
-static unsigned char *readtile(BASICHEADER *header, int index, int *tile_width, int *tile_height, FILE *fp, int *insamples)
+/*
+  decode a tile into the raster
+    Params: header - the image header
+            index - index of the tile
+            src - the source
+            dest - where the tile goes
+    Returns: 0 on success, -1 on out of memory
+*/
+static int readtile(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest)
 {
 	unsigned char *data = 0;
-	unsigned char *answer = 0;
 	unsigned long N;
-    
-    *insamples = header_Ninsamples(header);
 
-	fseek(fp, header->tileoffsets[index], SEEK_SET);
-	data = decompress(fp, header->tilebytecounts[index], header->compression, &N, header->tilewidth, header->tileheight, header->T4options);
+	data = decompress(src, header->tileoffsets[index], header->tilebytecounts[index], header->compression, &N, header->tilewidth, header->tileheight, header->T4options, header->fillorder,
+		header_unitbytes(header, header->tilewidth, header->tileheight, -1));
 	if (!data)
 		goto out_of_memory;
-	answer = malloc(*insamples * header->tilewidth * header->tileheight);
-	if (!answer)
+	if (convertunit(header, data, N, header->tilewidth, header->tileheight, 0, dest))
 		goto out_of_memory;
-	*tile_width = header->tilewidth;
-	*tile_height = header->tileheight;
 
-	switch (header->photometricinterpretation)
-	{
-	case PI_WhiteIsZero:
-	case PI_BlackIsZero:
-		greytogrey(answer, header->tilewidth, header->tileheight, data, N, header, *insamples);
-		if (header->predictor == 2)
-		{
-			unpredictsamples(answer, header->tilewidth, header->tileheight, *insamples, header);
-		}
-		break;
-	case PI_RGB:
-		bitstreamtorgba(answer, header->tilewidth, header->tileheight, data, N, header, *insamples);
-		if (header->predictor == 2)
-		{
-			unpredictsamples(answer, header->tilewidth, *insamples, header->tileheight, header);
-		}
-		break;
-	case PI_RGB_Palette:
-		paltorgba(answer, header->tilewidth, header->tileheight, data, N, header);
-		break;
-	case PI_CMYK:
-		cmyktocmyk(answer, header->tilewidth, header->tileheight, data, N, header, *insamples);
-		break;
-	case PI_YCbCr:
-		ycbcrtorgba(answer, header->tilewidth, header->tileheight, data, N, header);
-		break;
-	}
-	
-	free(data);
-	return answer;
-out_of_memory:
-	free(data);
-	free(answer);
+	releasedecompressed(src, header->compression, data);
 	return 0;
-
-
+out_of_memory:
+	releasedecompressed(src, header->compression, data);
+	return -1;
 }
 
-
-static unsigned char *readstrip(BASICHEADER *header, int index, int *strip_width, int *strip_height, FILE *fp, int *insamples)
+/*
+  decode a strip into the raster
+    Params: header - the image header
+            index - index of the strip
+            src - the source
+            dest - where the strip goes
+    Returns: 0 on success, -1 on out of memory
+*/
+static int readstrip(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest)
 {
 	unsigned char *data = 0;
-	unsigned char *answer = 0;
 	unsigned long N;
 	int stripheight;
 
-	fseek(fp, header->stripoffsets[index], SEEK_SET);
 	if (index == header->Nstripoffsets - 1)
 	{
 		stripheight = header->imageheight - header->rowsperstrip *index;
 	}
 	else
 		stripheight = header->rowsperstrip;
-	data = decompress(fp, header->stripbytecounts[index], header->compression, &N, header->imagewidth, stripheight, header->T4options);
+	data = decompress(src, header->stripoffsets[index], header->stripbytecounts[index], header->compression, &N, header->imagewidth, stripheight, header->T4options, header->fillorder,
+		header_unitbytes(header, header->imagewidth, stripheight, -1));
 	if (!data)
 		goto out_of_memory;
-	
-    *insamples = header_Ninsamples(header);
-	answer = malloc(*insamples * header->imagewidth * stripheight);
-	if (!answer)
+	if (convertunit(header, data, N, header->imagewidth, stripheight, 0, dest))
 		goto out_of_memory;
-	*strip_width = header->imagewidth;
-	*strip_height = stripheight;
-	switch (header->photometricinterpretation)
-	{
-	case PI_WhiteIsZero:
-	case PI_BlackIsZero:
-		greytogrey(answer, header->imagewidth, stripheight, data, N, header, *insamples);
-		if (header->predictor == 2)
-        {
-			unpredictsamples(answer, header->imagewidth, stripheight, *insamples, header);
-		}
-		break;
-	case PI_RGB:
-		bitstreamtorgba(answer, header->imagewidth, stripheight, data, N, header, *insamples);
-		if (header->predictor == 2)
-		{
-			unpredictsamples(answer, header->imagewidth, stripheight, *insamples, header);
-		}
-		break;
-	case PI_RGB_Palette:
-		paltorgba(answer, header->imagewidth, stripheight, data, N, header);
-		break;
-	case PI_CMYK:
-		cmyktocmyk(answer, header->imagewidth, stripheight, data, N, header, *insamples);
-		break;
-	case PI_YCbCr:
-		ycbcrtorgba(answer, header->imagewidth, stripheight, data, N, header);
-		break;
-	}
-	
-	free(data);
-	return answer;
-out_of_memory:
-	free(data);
-	free(answer);
+
+	releasedecompressed(src, header->compression, data);
 	return 0;
+out_of_memory:
+	releasedecompressed(src, header->compression, data);
+	return -1;
 }
 
-static unsigned char *readchannel(BASICHEADER *header, int index, int *channel_width, int *channel_height, FILE *fp)
+/*
+  decode a strip of one plane into its channel of the raster
+    Params: header - the image header
+            index - index of the strip
+            src - the source
+            dest - where the strip goes, pointing at the channel
+    Returns: 0 on success, -1 on out of memory
+*/
+static int readchannel(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest)
 {
 	unsigned char *data = 0;
-	unsigned char *out = 0;
 	unsigned long N;
 	int stripheight;
 	int stripsperimage = (header->imageheight + header->rowsperstrip - 1) / header->rowsperstrip;
@@ -1326,528 +4058,976 @@ static unsigned char *readchannel(BASICHEADER *header, int index, int *channel_w
 	if (sample_index < 0 || sample_index >= header->samplesperpixel)
 		return 0;
 
-	fseek(fp, header->stripoffsets[index], SEEK_SET);
 	if ((index % stripsperimage) == stripsperimage - 1)
 	{
 		stripheight = header->imageheight - header->rowsperstrip *(index%stripsperimage);
 	}
 	else
 		stripheight = header->rowsperstrip;
-	data = decompress(fp, header->stripbytecounts[index], header->compression, &N, header->imagewidth, stripheight, header->T4options);
+	data = decompress(src, header->stripoffsets[index], header->stripbytecounts[index], header->compression, &N, header->imagewidth, stripheight, header->T4options, header->fillorder,
+		header_unitbytes(header, header->imagewidth, stripheight, sample_index));
 	if (!data)
 		goto out_of_memory;
-	
-	out = malloc(header->imagewidth * stripheight);
-	if (!out)
+	if (convertunit(header, data, N, header->imagewidth, stripheight, sample_index, dest))
+		goto out_of_memory;
+
+	releasedecompressed(src, header->compression, data);
+	return 0;
+out_of_memory:
+	releasedecompressed(src, header->compression, data);
+	return -1;
+}
+
+/*
+  decode a tile of one plane into its channel of the raster
+    Params: header - the image header
+            index - index of the tile
+            src - the source
+            dest - where the tile goes, pointing at the channel
+    Returns: 0 on success, -1 on out of memory
+*/
+static int readtilechannel(BASICHEADER *header, int index, TIFFSOURCE *src, RASTERDEST *dest)
+{
+	unsigned char *data = 0;
+	unsigned long N;
+	int tilesacross = (header->imagewidth + header->tilewidth - 1) / header->tilewidth;
+	int tilesdown = (header->imageheight + header->tileheight - 1) / header->tileheight;
+	int sample_index;
+
+	sample_index = index / (tilesacross * tilesdown);
+	if (sample_index < 0 || sample_index >= header->samplesperpixel)
+		return 0;
+
+	data = decompress(src, header->tileoffsets[index], header->tilebytecounts[index], header->compression, &N, header->tilewidth, header->tileheight, header->T4options, header->fillorder,
+		header_unitbytes(header, header->tilewidth, header->tileheight, sample_index));
+	if (!data)
 		goto out_of_memory;
-	*channel_width = header->imagewidth;
-	*channel_height = stripheight;
-	planetochannel(out, header->imagewidth, stripheight, data, N, header, index / stripsperimage);
+	if (convertunit(header, data, N, header->tilewidth, header->tileheight, sample_index, dest))
+		goto out_of_memory;
+
+	releasedecompressed(src, header->compression, data);
+	return 0;
+out_of_memory:
+	releasedecompressed(src, header->compression, data);
+	return -1;
+}
+
+/*
+  convert a decompressed strip, tile or plane into the raster. 8 bit
+  greyscale, RGB, CMYK and palette go straight in, the rest through
+  a buffer of their own.
+    Params: header - the image header
+            data - the decompressed data
+            N - bytes of data
+            width, height - size of the strip, tile or plane
+            sample_index - the plane, 0 if samples are interleaved
+            dest - where the pixels go
+    Returns: 0 on success, -1 on out of memory
+*/
+static int convertunit(BASICHEADER *header, unsigned char *data, unsigned long N, int width, int height, int sample_index, RASTERDEST *dest)
+{
+	unsigned char *buff = 0;
+	int insamples;
+	int err;
+	STATS_TIMER(t0);
+	STATS_TIMER(inner);
+
+	STATS_START(t0);
+	STATS_INNER(header->stats, inner);
+	if (header->samplebytes == 1)
+	{
+		switch (header->photometricinterpretation)
+		{
+		case PI_WhiteIsZero:
+		case PI_BlackIsZero:
+		case PI_RGB:
+		case PI_CMYK:
+			err = unpacksamples(dest, width, height, data, N, header, &header->unpacker[sample_index]);
+			STATS_CONVERT(header->stats, unpack_ns, t0, inner);
+			return err == -2 ? -1 : 0;
+		case PI_RGB_Palette:
+			paltorgba(dest, width, height, data, N, header);
+			STATS_CONVERT(header->stats, palette_ns, t0, inner);
+			return 0;
+		}
+	}
+
+	insamples = header->planarconfiguration == 2 ? 1 : header_Ninsamples(header);
+	buff = malloc((size_t) insamples * width * height * header->samplebytes);
+	if (!buff)
+		return -1;
+	STATS_ADD(header->stats, allocations, 1);
+	if (header->samplebytes > 1)
+	{
+		deepsamples(buff, width, height, data, N, header, sample_index, header->planarconfiguration == 2 ? 1 : header->samplesperpixel, insamples);
+		STATS_CONVERT(header->stats, deep_ns, t0, inner);
+	}
+	else if (header->photometricinterpretation == PI_YCbCr)
+	{
+		ycbcrtorgba(buff, width, height, data, N, header);
+		STATS_CONVERT(header->stats, ycbcr_ns, t0, inner);
+	}
+	else
+		memset(buff, 0, (size_t) insamples * width * height);
+	pastedest(dest, buff, width, insamples * header->samplebytes);
+	free(buff);
+
+	return 0;
+}
+
+/*
+  copy a strip, tile or plane we decoded into a buffer of its own into
+  the raster
+    Params: dest - where it goes
+            buff - the pixels
+            width - width of the strip, tile or plane
+            depth - bytes per pixel in buff
+*/
+static void pastedest(RASTERDEST *dest, const unsigned char *buff, int width, int depth)
+{
+	int Nbytes = depth < dest->depth ? depth : dest->depth;
+	unsigned char *out;
+	const unsigned char *in;
+	int ix, iy;
+	STATS_TIMER(t0);
+
+	STATS_START(t0);
+	for (iy = dest->top; iy < dest->bottom; iy++)
+	{
+		out = dest->pixels + (size_t) (iy - dest->top) * dest->stride;
+		in = buff + ((size_t) iy * width + dest->left) * depth;
+		if (Nbytes == dest->depth && Nbytes == depth)
+			memcpy(out, in, (size_t) (dest->right - dest->left) * depth);
+		else
+		{
+			for (ix = dest->left; ix < dest->right; ix++)
+			{
+				memcpy(out, in, Nbytes);
+				out += dest->depth;
+				in += depth;
+			}
+		}
+	}
+	STATS_STOP(dest->stats, paste_ns, t0);
+}
+
+/*
+  get the row to convert a row of a strip or tile into. That is the
+  raster itself if the strip or tile isn't clipped, otherwise a 
+  scratch row which copyrow() copies across.
+    Params: dest - where the strip or tile goes
+            width - width of the strip or tile
+            iy - the row, dest->top to dest->bottom - 1
+    Returns: pointer to column 0 of the row, dest->depth bytes a pixel
+*/
+static unsigned char *destrow(RASTERDEST *dest, int width, int iy)
+{
+	if (dest->left == 0 && dest->right == width)
+		return dest->pixels + (size_t) (iy - dest->top) * dest->stride;
+	return dest->scratch;
+}
+
+/*
+  copy the visible part of a row from the scratch row into the raster
+    Params: dest - where the strip or tile goes
+            row - the row from destrow()
+            iy - the row
+            Nbytes - bytes to copy of each pixel
+*/
+static void copyrow(RASTERDEST *dest, const unsigned char *row, int iy, int Nbytes)
+{
+	unsigned char *out = dest->pixels + (size_t) (iy - dest->top) * dest->stride;
+	int ix;
+	STATS_TIMER(t0);
+
+	if (row != dest->scratch)
+		return;
+	STATS_START(t0);
+	row += (size_t) dest->left * dest->depth;
+	if (Nbytes == dest->depth)
+		memcpy(out, row, (size_t) (dest->right - dest->left) * dest->depth);
+	else
+	{
+		for (ix = dest->left; ix < dest->right; ix++)
+		{
+			memcpy(out, row, Nbytes);
+			out += dest->depth;
+			row += dest->depth;
+		}
+	}
+	STATS_STOP(dest->stats, paste_ns, t0);
+}
+
+/*
+  zero rows the data didn't reach
+    Params: dest - where the strip or tile goes
+            top - first row to zero
+            Nbytes - bytes to zero of each pixel
+*/
+static void zerorows(RASTERDEST *dest, int top, int Nbytes)
+{
+	unsigned char *out;
+	int ix, iy;
+
+	for (iy = top < dest->top ? dest->top : top; iy < dest->bottom; iy++)
+	{
+		out = dest->pixels + (size_t) (iy - dest->top) * dest->stride;
+		for (ix = dest->left; ix < dest->right; ix++)
+		{
+			memset(out, 0, Nbytes);
+			out += dest->depth;
+		}
+	}
+}
+
+/*
+  palette indices to RGBA, through header->palette
+    Params: dest - where the pixels go
+            width, height - size of the strip or tile
+            bits - the decompressed data
+            Nbytes - number of bytes of data
+            header - the image header
+    Returns: 0 on success, -1 if the data ran out (the rest is black)
+*/
+static int paltorgba(RASTERDEST *dest, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header)
+{
+	unsigned char *rgba;
+	const unsigned char *palette = header->palette;
+	const unsigned char *in;
+	const unsigned char *lut = 0;
+	unsigned long rowbytes;
+	int totbits = 0;
+	int bitstreamflag = 0;
+	int Nrows;
+	int index;
+	int left;
+	int i, ii, iii;
+
+	for (i = 0; i < header->samplesperpixel; i++)
+	{
+		totbits += header->bitspersample[i];
+		if ((header->bitspersample[i] % 8) != 0)
+			bitstreamflag = 1;
+	}
+	rowbytes = ((unsigned long) width * totbits + 7) / 8;
+	Nrows = (int) (Nbytes / rowbytes < (unsigned long) height ? Nbytes / rowbytes : (unsigned long) height);
+
+	for (i = dest->top; i < dest->bottom && i < Nrows; i++)
+	{
+		rgba = destrow(dest, width, i);
+		in = bits + i * rowbytes;
+		if (header->samplesperpixel == 1 && totbits == 8)
+		{
+			for (ii = 0; ii < width; ii++)
+				memcpy(rgba + ii * 4, palette + in[ii] * 4, 4);
+		}
+		else if (header->samplesperpixel == 1 && totbits == 4)
+		{
+			for (ii = 0; ii + 1 < width; ii += 2, in++)
+			{
+				memcpy(rgba + ii * 4, palette + (in[0] >> 4) * 4, 4);
+				memcpy(rgba + ii * 4 + 4, palette + (in[0] & 0x0F) * 4, 4);
+			}
+			if (ii < width)
+				memcpy(rgba + ii * 4, palette + (in[0] >> 4) * 4, 4);
+		}
+		else if (header->samplesperpixel == 1 && header->packedlutbits == totbits)
+		{
+			left = 0;
+			for (ii = 0; ii < width; ii++)
+			{
+				if (left-- == 0)
+				{
+					lut = header->packedlut[*in++];
+					left = 8 / totbits - 1;
+				}
+				memcpy(rgba + ii * 4, palette + *lut++ * 4, 4);
+			}
+		}
+		else if (bitstreamflag == 0)
+		{
+			for (ii = 0; ii < width; ii++)
+			{
+				index = readintsample((unsigned char *) in, header, 0);
+				if (index < 0 || index >= header->Npalette)
+					index = header->Npalette;
+				memcpy(rgba + ii * 4, palette + index * 4, 4);
+				for (iii = 0; iii < header->samplesperpixel; iii++)
+					in += header->bitspersample[iii] / 8;
+			}
+		}
+		else
+		{
+			BSTREAM *bs = bstream(in, rowbytes, BIG_ENDIAN);
+			if (!bs)
+				return -1;
+			for (ii = 0; ii < width; ii++)
+			{
+				index = getbits(bs, header->bitspersample[0]);
+				for (iii = 1; iii < header->samplesperpixel; iii++)
+					getbits(bs, header->bitspersample[iii]);
+				if (index < 0 || index >= header->Npalette)
+					index = header->Npalette;
+				memcpy(rgba + ii * 4, palette + index * 4, 4);
+			}
+			killbstream(bs);
+		}
+		copyrow(dest, rgba, i, 4);
+	}
+	zerorows(dest, Nrows, 3);
+
+	return Nrows < height ? -1 : 0;
+}
+
+/*
+  YCbCr to RGB in fixed point, 16 bits of fraction. Chroma is centred
+  on 128, and the coefficients come from the luma weights so that
+    R = Y + (2 - 2 LumaRed) Cr
+    B = Y + (2 - 2 LumaBlue) Cb
+    G = (Y - LumaBlue B - LumaRed R) / LumaGreen
+*/
+typedef struct
+{
+	int crtored;
+	int cbtoblue;
+	int cbtogreen;
+	int crtogreen;
+	int ytogreen;
+} YCBCRCOEFFS;
+
+/*
+  the red, green and blue offsets of a chroma pair, shared by all the
+  pixels of a block
+*/
+typedef struct
+{
+	int red;
+	int green;
+	int blue;
+} YCBCRCHROMA;
+
+static void ycbcrcoeffs(YCBCRCOEFFS *k, BASICHEADER *header)
+{
+	double lr = header->LumaRed;
+	double lg = header->LumaGreen;
+	double lb = header->LumaBlue;
+
+	k->crtored = (int) floor((2 - 2 * lr) * 65536 + 0.5);
+	k->cbtoblue = (int) floor((2 - 2 * lb) * 65536 + 0.5);
+	k->cbtogreen = (int) floor(-lb * (2 - 2 * lb) / lg * 65536 + 0.5);
+	k->crtogreen = (int) floor(-lr * (2 - 2 * lr) / lg * 65536 + 0.5);
+	k->ytogreen = (int) floor((1 - lb - lr) / lg * 65536 + 0.5);
+}
+
+static void ycbcrchroma(YCBCRCHROMA *c, const YCBCRCOEFFS *k, int Cb, int Cr)
+{
+	Cb -= 128;
+	Cr -= 128;
+	c->red = (k->crtored * Cr + 0x8000) >> 16;
+	c->blue = (k->cbtoblue * Cb + 0x8000) >> 16;
+	c->green = k->cbtogreen * Cb + k->crtogreen * Cr + 0x8000;
+}
+
+static unsigned char clampbyte(int x)
+{
+	return (unsigned char) (x < 0 ? 0 : x > 255 ? 255 : x);
+}
+
+static void ycbcrpixel(unsigned char *rgba, int Y, const YCBCRCHROMA *c, const YCBCRCOEFFS *k)
+{
+	rgba[0] = clampbyte(Y + c->red);
+	rgba[1] = clampbyte((k->ytogreen * Y + c->green) >> 16);
+	rgba[2] = clampbyte(Y + c->blue);
+	rgba[3] = 255;
+}
+
+/*
+  8 bit YCbCr, no subsampling. Pixels are Y, Cb, Cr.
+  Returns: number of rows converted
+*/
+static int ycbcr11torgba(unsigned char *rgba, int width, int height, const unsigned char *bits, unsigned long Nbytes, const YCBCRCOEFFS *k)
+{
+	YCBCRCHROMA c;
+	unsigned long Npixels = Nbytes / 3;
+	unsigned long i;
 
-    if(header->predictor == 2)
+	if (Npixels > (unsigned long) width * height)
+		Npixels = (unsigned long) width * height;
+	for (i = 0; i < Npixels; i++)
 	{
-	  unpredictsamples(out, header->imagewidth, stripheight, 1, header);
+		ycbcrchroma(&c, k, bits[1], bits[2]);
+		ycbcrpixel(rgba, bits[0], &c, k);
+		bits += 3;
+		rgba += 4;
 	}
-	free(data);
-	return out;
-out_of_memory:
-	free(data);
-	free(out);
-	return 0;
+
+	return (int) (Npixels / width);
 }
 
-static int planetochannel(unsigned char *out, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int sample_index)
+/*
+  8 bit YCbCr, chroma halved horizontally. Blocks are Y0, Y1, Cb, Cr.
+  Returns: number of rows converted
+*/
+static int ycbcr21torgba(unsigned char *rgba, int width, int height, const unsigned char *bits, unsigned long Nbytes, const YCBCRCOEFFS *k)
 {
-	int bitstreamflag = 0;
-	unsigned long i;
-	int ii;
-	int val;
-	unsigned long counter = 0;
+	YCBCRCHROMA c;
+	int blocksacross = (width + 1) / 2;
+	int iy, ix;
 
-	if ((header->bitspersample[sample_index] % 8) != 0)
-		bitstreamflag = 1;
-	if (bitstreamflag == 0)
+	for (iy = 0; iy < height; iy++)
 	{
-		i = 0;
-
-		while (i < Nbytes)
+		if (Nbytes < (unsigned long) blocksacross * 4)
+			return iy;
+		Nbytes -= blocksacross * 4;
+		for (ix = 0; ix < width - 1; ix += 2)
 		{
-			out[0] = readbytesample(bits, header, sample_index);
-			if (header->photometricinterpretation == PI_WhiteIsZero)
-				out[0] = 255 - out[0];
-			bits += header->bitspersample[sample_index] / 8;
-			i += header->bitspersample[sample_index] / 8;
-			out++;
-			if (counter++ > (unsigned long) (width * height) )
-				return -1;
+			ycbcrchroma(&c, k, bits[2], bits[3]);
+			ycbcrpixel(rgba, bits[0], &c, k);
+			ycbcrpixel(rgba + 4, bits[1], &c, k);
+			bits += 4;
+			rgba += 8;
+		}
+		if (ix < width)
+		{
+			ycbcrchroma(&c, k, bits[2], bits[3]);
+			ycbcrpixel(rgba, bits[0], &c, k);
+			bits += 4;
+			rgba += 4;
 		}
 	}
-	else
+
+	return height;
+}
+
+/*
+  8 bit YCbCr, chroma halved both ways. Blocks are Y00, Y01, Y10, Y11,
+  Cb, Cr and cover two rows.
+  Returns: number of rows converted
+*/
+static int ycbcr22torgba(unsigned char *rgba, int width, int height, const unsigned char *bits, unsigned long Nbytes, const YCBCRCOEFFS *k)
+{
+	YCBCRCHROMA c;
+	int blocksacross = (width + 1) / 2;
+	unsigned char *row0, *row1;
+	int iy, ix;
+
+	for (iy = 0; iy < height; iy += 2)
 	{
-		BSTREAM *bs = bstream(bits, Nbytes, BIG_ENDIAN);
-		for (i = 0; i < height; i++)
+		if (Nbytes < (unsigned long) blocksacross * 6)
+			return iy;
+		Nbytes -= blocksacross * 6;
+		row0 = rgba + (size_t) iy * width * 4;
+		/* the last block row may hang off the bottom of the image */
+		row1 = iy + 1 < height ? row0 + width * 4 : 0;
+		for (ix = 0; ix < width; ix += 2)
 		{
-			for (ii = 0; ii < width; ii++)
+			ycbcrchroma(&c, k, bits[4], bits[5]);
+			ycbcrpixel(row0, bits[0], &c, k);
+			if (ix + 1 < width)
+				ycbcrpixel(row0 + 4, bits[1], &c, k);
+			if (row1)
 			{
-				val = getbits(bs, header->bitspersample[sample_index]);
-				val = (val * 255) / ((1 << header->bitspersample[sample_index]) - 1);
-			       
-				*out++ = val;
+				ycbcrpixel(row1, bits[2], &c, k);
+				if (ix + 1 < width)
+					ycbcrpixel(row1 + 4, bits[3], &c, k);
+				row1 += 8;
 			}
-			synchtobyte(bs);
+			row0 += 8;
+			bits += 6;
 		}
-		killbstream(bs);
-		return 0;
 	}
-	return 0;
+
+	return height;
 }
 
-static int greytogrey(unsigned char *grey, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int insamples)
+static int ycbcrtorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header)
 {
-
+	YCBCRCOEFFS k;
+	YCBCRCHROMA c;
 	unsigned long i;
-	int ii, iii;
-	int totbits = 0;
-	int bitstreamflag = 0;
-	unsigned long counter = 0;
+	int ii;
+	int Y[16];
+	int Cb, Cr;
+	int x, y;
+	int ix, iy;
+	int hsub = header->YCbCrSubSampling_h;
+	int vsub = header->YCbCrSubSampling_v;
+	int blockbytes = 0;
+	int Nrows;
 
-	for (i = 0; i < header->samplesperpixel; i++)
-		totbits += header->bitspersample[i];
+	if (hsub < 1 || vsub < 1 || hsub * vsub > 16)
+		goto parse_error;
+	if (header->samplesperpixel < 3)
+		goto parse_error;
 	for (i = 0; i < header->samplesperpixel; i++)
 		if ((header->bitspersample[i] % 8) != 0)
-			bitstreamflag = 1;
+			goto parse_error;
+	ycbcrcoeffs(&k, header);
 
-	if (bitstreamflag == 0)
+	if (header->samplesperpixel == 3 && header->bitspersample[0] == 8 &&
+		header->bitspersample[1] == 8 && header->bitspersample[2] == 8 &&
+		header->sampleformat[0] == SAMPLEFORMAT_UINT)
 	{
-		i = 0;
-
-		while (i < Nbytes - totbits/8 + 1)
+		if (hsub == 1 && vsub == 1)
+			Nrows = ycbcr11torgba(rgba, width, height, bits, Nbytes, &k);
+		else if (hsub == 2 && vsub == 1)
+			Nrows = ycbcr21torgba(rgba, width, height, bits, Nbytes, &k);
+		else if (hsub == 2 && vsub == 2)
+			Nrows = ycbcr22torgba(rgba, width, height, bits, Nbytes, &k);
+		else
+			Nrows = -1;
+		if (Nrows >= 0)
 		{
-			grey[0] = readbytesample(bits, header, 0);
-			if (header->photometricinterpretation == PI_WhiteIsZero)
-				grey[0] = 255 - grey[0];
-			bits += header->bitspersample[0] / 8;
-			i += header->bitspersample[0] / 8;
-			
-            if(insamples == 2 && header->samplesperpixel > 1)
-            {
-                grey[1] = readbytesample(bits, header, 0);
-                bits += header->bitspersample[1] / 8;
-                i += header->bitspersample[1] / 8;
-            }
-            
-			for (ii = insamples; ii < header->samplesperpixel; ii++)
-			{
-				bits += header->bitspersample[ii] / 8;
-				i += header->bitspersample[ii] / 8;
-			}
-            
-			grey += insamples;
-
-			if (counter++ > width * height)
-				break;
+			if (Nrows < height)
+				memset(rgba + (size_t) Nrows * width * 4, 0, (size_t) (height - Nrows) * width * 4);
+			return 0;
 		}
-
-		return 0;
 	}
-	else
+
+	/* any other layout, a block at a time */
+	memset(rgba, 0, (size_t) width * height * 4);
+	blockbytes = hsub * vsub * (header->bitspersample[0] / 8);
+	for (ii = 1; ii < header->samplesperpixel; ii++)
+		blockbytes += header->bitspersample[ii] / 8;
+	x = 0; y = 0;
+	for (i = 0; i + blockbytes <= Nbytes && y < height; i += blockbytes)
 	{
-		BSTREAM *bs = bstream(bits, Nbytes, BIG_ENDIAN);
-		for (i = 0; i < height; i++)
+		for (ii = 0; ii < hsub * vsub; ii++)
 		{
-			for (ii = 0; ii < width; ii++)
-			{
-				int val = getbits(bs, header->bitspersample[0]);
-				grey[0] = (val * 255) / ((1 << (header->bitspersample[0])) -1);
-				if(header->photometricinterpretation == PI_WhiteIsZero)
-				  grey[0] = 255 - grey[0];
-				if(insamples == 2 && header->samplesperpixel > 1 )
-                {
-                    val = getbits(bs, header->bitspersample[1]);
-                    grey[1] = (val * 255) / ((1 << (header->bitspersample[1])) -1);
-                }
-				for (iii = insamples; iii < header->samplesperpixel; iii++)
-				{
-					getbits(bs, header->bitspersample[iii]);
-				}
-				grey += insamples;
-			}
-			synchtobyte(bs);
+			Y[ii] = readbytesample(bits, header, 0);
+			bits += header->bitspersample[0] / 8;
+		}
+		Cb = readbytesample(bits, header, 1);
+		bits += header->bitspersample[1] / 8;
+		Cr = readbytesample(bits, header, 2);
+		bits += header->bitspersample[2] / 8;
+		for (ii = 3; ii < header->samplesperpixel; ii++)
+			bits += header->bitspersample[ii] / 8;
+
+		ycbcrchroma(&c, &k, Cb, Cr);
+		for (ii = 0; ii < hsub * vsub; ii++)
+		{
+			ix = x + (ii % hsub);
+			iy = y + (ii / hsub);
+			if (ix < width && iy < height)
+				ycbcrpixel(rgba + ((size_t) iy * width + ix) * 4, Y[ii], &c, &k);
+		}
+		x += hsub;
+		if (x >= width)
+		{
+			x = 0;
+			y += vsub;
 		}
+	}
 
-		return 0;
+	return 0;
+
+parse_error:
+	return -2;
+}
+
+/*
+  unpack a row of samples to 8 bits, up->step apart in the output.
+  Kernels for the common layouts are picked once per image by 
+  chooseunpacker()
+*/
+static void unpack8copy(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	memcpy(out, in, (size_t) width * up->Nout);
+}
+
+/* 8 bit RGB into RGBA, leaving alpha alone */
+static void unpack8rgb(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	int step = up->step;
+	int i;
+
+	for (i = 0; i < width; i++)
+	{
+		out[0] = in[0];
+		out[1] = in[1];
+		out[2] = in[2];
+		in += 3;
+		out += step;
 	}
-	
 }
 
-static int paltorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header)
+static void unpack8(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
 {
-	unsigned long i;
-	unsigned long counter = 0;
-	int index;
-	int ii, iii;
-	int totbits = 0;
-	int bitstreamflag = 0;
+	int Nin = up->Nin;
+	int Nout = up->Nout;
+	int step = up->step;
+	int i, ii;
 
+	for (i = 0; i < width; i++)
+	{
+		for (ii = 0; ii < Nout; ii++)
+			out[ii] = in[ii];
+		in += Nin;
+		out += step;
+	}
+}
 
-	for (i = 0; i < header->samplesperpixel; i++)
-		totbits += header->bitspersample[i];
-	for (i = 0; i < header->samplesperpixel; i++)
-		if ((header->bitspersample[i] % 8) != 0)
-			bitstreamflag = 1;
+static void unpack16be(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	int Nin = up->Nin;
+	int Nout = up->Nout;
+	int i, ii;
 
-	if (bitstreamflag == 0)
+	for (i = 0; i < width; i++)
 	{
-		i = 0;
+		for (ii = 0; ii < Nout; ii++)
+			out[ii] = in[ii * 2];
+		in += Nin * 2;
+		out += up->step;
+	}
+}
 
-		while (i < Nbytes -totbits/8 + 1)
-		{
-			index = readintsample(bits, header, 0);
-			bits += header->bitspersample[0] / 8;
-			i += header->bitspersample[0] / 8;
+static void unpack16le(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	int Nin = up->Nin;
+	int Nout = up->Nout;
+	int i, ii;
 
-			if (index >= 0 && index < header->Ncolormap)
-			{
-				rgba[0] = header->colormap[index * 3];
-				rgba[1] = header->colormap[index * 3 + 1];
-				rgba[2] = header->colormap[index * 3 + 2];
-			}
+	for (i = 0; i < width; i++)
+	{
+		for (ii = 0; ii < Nout; ii++)
+			out[ii] = in[ii * 2 + 1];
+		in += Nin * 2;
+		out += up->step;
+	}
+}
 
-			for (ii = 1; ii < header->samplesperpixel; ii++)
-			{
-				bits += header->bitspersample[ii] / 8;
-				i += header->bitspersample[ii] / 8;
-			}
-			rgba += 4;
-			counter++;
-			if (counter > (unsigned long) (width * height) )
-			{
-				break;
-			}
-		}
+/*
+  1, 2 or 4 bit samples, all wanted, a byte at a time through 
+  header->packedlut
+*/
+static void unpacklut(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	const BASICHEADER *header = up->header;
+	int per = 8 / up->bits;
+	long N = (long) width * up->Nin;
+	const unsigned char *lut;
+	long i;
+	int ii;
 
-		return 0;
+	if (up->step != up->Nin)
+	{
+		/* one sample a pixel, usually bilevel into grey and alpha */
+		for (i = 0; i < width; i += per)
+		{
+			lut = header->packedlut[*in++];
+			for (ii = 0; ii < per && i + ii < width; ii++)
+				out[(i + ii) * up->step] = lut[ii];
+		}
+		return;
+	}
+	if (per == 8)
+	{
+		for (i = 0; i + 8 <= N; i += 8)
+			memcpy(out + i, header->packedlut[*in++], 8);
+	}
+	else if (per == 4)
+	{
+		for (i = 0; i + 4 <= N; i += 4)
+			memcpy(out + i, header->packedlut[*in++], 4);
 	}
 	else
 	{
-		BSTREAM *bs = bstream(bits, Nbytes, BIG_ENDIAN);
-		for (i = 0; i < height; i++)
+		for (i = 0; i + 2 <= N; i += 2)
+			memcpy(out + i, header->packedlut[*in++], 2);
+	}
+	if (i < N)
+		memcpy(out + i, header->packedlut[*in], N - i);
+}
+
+/*
+  1, 2 or 4 bit samples, packed high bits first. The samples of a
+  pixel follow on from each other, and only rows are byte aligned.
+*/
+static void unpackpacked(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	int bits = up->bits;
+	int mask = (1 << bits) - 1;
+	int scale = 255 / mask;
+	int Nin = up->Nin;
+	int Nout = up->Nout;
+	unsigned long pos = 0;
+	int i, ii;
+
+	for (i = 0; i < width; i++)
+	{
+		for (ii = 0; ii < Nin; ii++)
 		{
-			for (ii = 0; ii < width; ii++)
-			{
-				index = getbits(bs, header->bitspersample[0]);
-				if (index >= 0 && index < header->Ncolormap)
-				{
-					rgba[0] = header->colormap[index * 3];
-					rgba[1] = header->colormap[index * 3 + 1];
-				    rgba[2] = header->colormap[index * 3 + 2];
-				}
-				for (iii = 1; iii < header->samplesperpixel; iii++)
-				{
-					getbits(bs, header->bitspersample[iii]);
-				}
-				rgba += 4;
-			}
-			synchtobyte(bs);
+			if (ii < Nout)
+				out[ii] = (unsigned char) (((in[pos >> 3] >> (8 - bits - (pos & 7))) & mask) * scale);
+			pos += bits;
 		}
-		killbstream(bs);
-		return 0;
+		out += up->step;
 	}
+}
 
+/*
+  samples of any whole number of bytes, or mixed sizes, through 
+  readbytesample()
+*/
+static void unpackbytes(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
+{
+	const BASICHEADER *header = up->header;
+	int i, ii;
 
-	
-	return -1;
+	for (i = 0; i < width; i++)
+	{
+		for (ii = 0; ii < up->Nin; ii++)
+		{
+			if (ii < up->Nout)
+				out[ii] = (unsigned char) readbytesample(in, header, up->sample_index + ii);
+			in += header->bitspersample[up->sample_index + ii] / 8;
+		}
+		/* samples the file doesn't have, which can only be alpha */
+		for (; ii < up->Nout; ii++)
+			out[ii] = 255;
+		out += up->step;
+	}
 }
 
-static int ycbcrtorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header)
+/*
+  samples of any number of bits, packed high bits first
+*/
+static void unpackanybits(unsigned char *out, const unsigned char *in, int width, const UNPACKER *up)
 {
-	unsigned long i;
-	int ii;
-	int totbits = 0;
-	int bitstreamflag = 0;
-	int Y[16];
-	int Cb, Cr;
-	int x, y;
-	int ix, iy;
-	unsigned long counter = 0;
+	const BASICHEADER *header = up->header;
+	unsigned long pos = 0;
+	unsigned long val;
+	int bits;
+	int i, ii, iii;
 
-	if (header->YCbCrSubSampling_h * header->YCbCrSubSampling_v > 16)
-		goto parse_error;
-	if (header->LumaGreen == 0.0)
-		header->LumaGreen = 1.0;
+	for (i = 0; i < width; i++)
+	{
+		for (ii = 0; ii < up->Nin; ii++)
+		{
+			bits = header->bitspersample[up->sample_index + ii];
+			val = 0;
+			for (iii = 0; iii < bits; iii++, pos++)
+				val = (val << 1) | ((in[pos >> 3] >> (7 - (pos & 7))) & 1);
+			if (ii < up->Nout)
+				out[ii] = (unsigned char) (val * 255.0 / (ldexp(1.0, bits) - 1));
+		}
+		for (; ii < up->Nout; ii++)
+			out[ii] = 255;
+		out += up->step;
+	}
+}
 
-	for (i = 0; i < header->samplesperpixel; i++)
-		totbits += header->bitspersample[i];
-	for (i = 0; i < header->samplesperpixel; i++)
-		if ((header->bitspersample[i] % 8) != 0)
-			bitstreamflag = 1;
+/*
+  pick the unpackers for an image, once it is known to be valid.
+  Palette and YCbCr images have their own converters, but palette
+  images get their colour table built here.
+  Returns: 0 on success, -1 on out of memory
+*/
+static int header_unpackers(BASICHEADER *header)
+{
+	int Nout = header_Ninsamples(header);
+	int step = header_Noutsamples(header);
+	int i;
 
-	x = 0; y = 0;
-	// Need for some YcbCr images -
-	//bits += 3;
-	if (bitstreamflag == 0)
+	switch (header->photometricinterpretation)
 	{
-		i = 0;
-
-		while (i < Nbytes - totbits/8 +1)
+	case PI_WhiteIsZero:
+	case PI_BlackIsZero:
+	case PI_RGB:
+	case PI_CMYK:
+		if (header->planarconfiguration == 2)
 		{
-			for (ii = 0; ii < header->YCbCrSubSampling_h * header->YCbCrSubSampling_v; ii++)
-			{
-				Y[ii] = readbytesample(bits, header, 0);
-				bits += header->bitspersample[0] / 8;
-				i += header->bitspersample[0] / 8;
-			}
-			Cb = readbytesample(bits, header, 1);
-			bits += header->bitspersample[1] / 8;
-			i += header->bitspersample[1] / 8;
-			Cr = readbytesample(bits, header, 2);
-			bits += header->bitspersample[2] / 8;
-			i += header->bitspersample[2] / 8;
-			
-			
-			for (ii = 0; ii < header->YCbCrSubSampling_h * header->YCbCrSubSampling_v; ii++)
-			{
-				int red, green, blue;
-				red = (int) ((Cr - 127 )*(2 - 2 * header->LumaRed) + Y[ii]);
-				blue = (int) ((Cb -127) * (2 - 2 * header->LumaBlue) + Y[ii]);
-				green = (int) ((Y[ii] - header->LumaBlue * blue - header->LumaRed * red) / header->LumaGreen);
-
-				red = red < 0 ? 0 : red > 255 ? 255 : red;
-				green = green < 0 ? 0 : green > 255 ? 255 : green;
-				blue = blue < 0 ? 0 : blue > 255 ? 255 : blue;
-				ix = x + (ii % header->YCbCrSubSampling_h);
-				iy = y + (ii / header->YCbCrSubSampling_h);
-				//YcbcrToRGB(Y[ii], Cb, Cr, &r, &g, &b);
-				if (ix < width && iy < height)
-				{
-					rgba[(iy * width + ix) * 4] = red;
-					rgba[(iy * width + ix) * 4 + 1] = green;
-					rgba[(iy * width + ix) * 4 + 2] = blue;
-				}
-
-			}
-			x += header->YCbCrSubSampling_h;
-			if (x >= width)
-			{
-				x = 0;
-				y += header->YCbCrSubSampling_v;
-			}
-			for (ii = 3; ii < header->samplesperpixel; ii++)
-			{
-		        bits += header->bitspersample[ii] / 8;
-				i += header->bitspersample[ii] / 8;
-			}
+			for (i = 0; i < header->samplesperpixel; i++)
+				chooseunpacker(&header->unpacker[i], header, i, 1, 1, step);
 		}
-
-		return 0;
+		else
+			chooseunpacker(&header->unpacker[0], header, 0, header->samplesperpixel, Nout, step);
+		break;
+	case PI_RGB_Palette:
+		if (header->samplesperpixel == 1 && (header->bitspersample[0] == 1 || header->bitspersample[0] == 2))
+			header_packedlut(header, header->bitspersample[0], 0);
+		return header_palette(header);
 	}
-
-parse_error:
-	return -2;
+	return 0;
 }
 
-static int cmyktocmyk(unsigned char *cmyk, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int insamples)
+/*
+  expand the colormap to RGBA, one entry for every index the samples
+  can hold, and one more for indices out of range. Indices past the
+  end of the colormap are opaque black.
+    Returns: 0 on success, -1 on out of memory
+*/
+static int header_palette(BASICHEADER *header)
 {
-	unsigned long i;
-	int ii;
-	int totbits = 0;
-	int bitstreamflag = 0;
-	int C, M, Y, K, A;
-    int Cprev = 0, Yprev = 0, Mprev = 0, Kprev = 0, Aprev = 0;
-	int red, green, blue;
-	int x, y;
-	unsigned long counter = 0;
-
+	int bits = header->bitspersample[0];
+	int i;
 
-	for (i = 0; i < header->samplesperpixel; i++)
-		totbits += header->bitspersample[i];
-	for (i = 0; i < header->samplesperpixel; i++)
-		if ((header->bitspersample[i] % 8) != 0)
-			bitstreamflag = 1;
+	header->Npalette = bits <= 16 ? 1 << bits : header->Ncolormap;
+	header->palette = malloc(((size_t) header->Npalette + 1) * 4);
+	if (!header->palette)
+		return -1;
+	for (i = 0; i <= header->Npalette; i++)
+	{
+		if (i < header->Ncolormap)
+		{
+			header->palette[i * 4] = header->colormap[i * 3];
+			header->palette[i * 4 + 1] = header->colormap[i * 3 + 1];
+			header->palette[i * 4 + 2] = header->colormap[i * 3 + 2];
+		}
+		else
+		{
+			header->palette[i * 4] = 0;
+			header->palette[i * 4 + 1] = 0;
+			header->palette[i * 4 + 2] = 0;
+		}
+		header->palette[i * 4 + 3] = 255;
+	}
+	return 0;
+}
 
-	x = 0; y = 0;
+/*
+  build the table that expands a byte of packed samples
+    Params: header - the image header
+            bits - 1, 2 or 4
+            scale - set to scale samples to 0-255, clear for palette
+              indices
+*/
+static void header_packedlut(BASICHEADER *header, int bits, int scale)
+{
+	int mask = (1 << bits) - 1;
+	int per = 8 / bits;
+	int i, ii;
+	int val;
 
-	if (bitstreamflag == 0)
+	for (i = 0; i < 256; i++)
 	{
-		i = 0;
-
-		while (i < Nbytes - totbits/8 +1)
+		for (ii = 0; ii < per; ii++)
 		{
-			C = readbytesample(bits, header, 0);
-			bits += header->bitspersample[0] / 8;
-			i += header->bitspersample[0] / 8;
-			M = readbytesample(bits, header, 1);
-			bits += header->bitspersample[1] / 8;
-			i += header->bitspersample[1] / 8;
-			Y = readbytesample(bits, header, 2);
-			bits += header->bitspersample[2] / 8;
-			i += header->bitspersample[2] / 8;
-			K = readbytesample(bits, header, 3);
-			bits += header->bitspersample[3] / 8;
-			i += header->bitspersample[3] / 8;
-            
-            if(insamples == 5)
-            {
-                A = readbytesample(bits, header, 4);
-                bits += header->bitspersample[4]/8;
-                i += header->bitspersample[4] / 8;
-            }
-			
-			if (header->predictor == 2)
-			{
-				C = (C + Cprev) & 0xFF;
-				M = (M + Mprev) & 0xFF;
-				Y = (Y + Yprev) & 0xFF;
-				K = (K + Kprev) & 0xFF;
-                A = (A + Aprev) & 0xFF;
-				Cprev = C;
-				Mprev = M;
-				Yprev = Y;
-				Kprev = K;
-                Aprev = A;
-			}
-				
-			//red = (255 * (255 - C) * (255 - K))/(255 * 255);
-			//green = (255 * (255 - M) * (255 - K))/(255 * 255);
-			//blue = (255 * (255 - Y) * (255 - K))/(255 * 255);
-
-			//rgba[0] = red;
-			//rgba[1] = green;
-			//rgba[2] = blue;
-		
-            cmyk[0] = C;
-            cmyk[1] = M;
-            cmyk[2] = Y;
-            cmyk[3] = K;
-            if(insamples == 5)
-                cmyk[4] = A;
-		    cmyk += insamples;
-			
-			for (ii = insamples; ii < header->samplesperpixel; ii++)
-			{
-				bits += header->bitspersample[ii] / 8;
-				i += header->bitspersample[ii] / 8;
-			}
-
-			x++;
-			if (x == width)
-			{
-				x = 0;
-				y++;
-				Cprev = 0;
-				Mprev = 0;
-				Yprev = 0;
-				Kprev = 0;
-                Aprev = 0;
-			}
-			if (counter++ > width * height)
-				goto parse_error;
+			val = (i >> (8 - bits * (ii + 1))) & mask;
+			header->packedlut[i][ii] = (unsigned char) (scale ? val * 255 / mask : val);
 		}
+	}
+	header->packedlutbits = bits;
+}
 
-		return 0;
+/*
+  pick the unpacker for some samples of the image
+    Params: up - return for the unpacker
+            header - the image header
+            sample_index - first sample (the plane for separate planes)
+            Nin - samples per pixel in the data
+            Nout - samples per pixel wanted
+            step - samples per pixel in the raster
+*/
+static void chooseunpacker(UNPACKER *up, BASICHEADER *header, int sample_index, int Nin, int Nout, int step)
+{
+	int bits = header->bitspersample[sample_index];
+	int uniform = 1;
+	int i;
+
+	up->Nin = Nin;
+	up->Nout = Nout;
+	up->step = step;
+	up->sample_index = sample_index;
+	up->header = header;
+	up->bits = bits;
+	up->rowbits = 0;
+	for (i = sample_index; i < sample_index + Nin; i++)
+	{
+		up->rowbits += header->bitspersample[i];
+		if (header->bitspersample[i] != bits || header->sampleformat[i] != SAMPLEFORMAT_UINT)
+			uniform = 0;
+	}
+
+	if (uniform && Nout == Nin && Nout == step && bits == 8)
+		up->fn = unpack8copy;
+	else if (uniform && Nin == 3 && Nout == 3 && step == 4 && bits == 8)
+		up->fn = unpack8rgb;
+	else if (uniform && Nout <= Nin && bits == 8)
+		up->fn = unpack8;
+	else if (uniform && Nout <= Nin && bits == 16)
+		up->fn = header->endianness == BIG_ENDIAN ? unpack16be : unpack16le;
+	else if (uniform && Nout == Nin && (Nin == step || Nin == 1) && (bits == 1 || bits == 2 || bits == 4)
+		&& (header->packedlutbits == 0 || header->packedlutbits == bits))
+	{
+		header_packedlut(header, bits, 1);
+		up->fn = unpacklut;
 	}
+	else if (uniform && Nout <= Nin && (bits == 1 || bits == 2 || bits == 4))
+		up->fn = unpackpacked;
 	else
 	{
-		goto parse_error;
+		for (i = sample_index; i < sample_index + Nin; i++)
+			if (header->bitspersample[i] % 8)
+				break;
+		up->fn = i == sample_index + Nin ? unpackbytes : unpackanybits;
 	}
-	return 0;
-
-parse_error:
-	return -2;
 }
 
 /*
-  
+  unpack a strip, tile or plane of greyscale, RGB or CMYK to 8 bit 
+  samples in the raster, then undo the predictor and WhiteIsZero.
+  16 bit samples have the predictor undone before they are cut down,
+  or carries out of the low byte would be lost.
+    Params: dest - where the samples go
+            width, height - size of the strip, tile or plane
+            bits - the decompressed data
+            Nbytes - number of bytes of data
+            header - the image header
+            up - the unpacker
+    Returns: 0 on success, -1 if the data ran out (the rest is zero),
+      -2 on out of memory
 */
-static int bitstreamtorgba(unsigned char *rgba, int width, int height, unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int insamples)
+static int unpacksamples(RASTERDEST *dest, int width, int height, const unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, const UNPACKER *up)
 {
-	unsigned long i;
-	int ii, iii;
-	int totbits = 0;
-	int bitstreamflag = 0;
-	int red, green, blue, alpha;
-	unsigned long counter = 0;
-        int lastsample;
-
-	for (i = 0; i < header->samplesperpixel; i++)
-		totbits += header->bitspersample[i];
-	for (i = 0; i < header->samplesperpixel; i++)
-		if ((header->bitspersample[i] % 8) != 0)
-			bitstreamflag = 1;
+	unsigned long rowbytes = ((unsigned long) width * up->rowbits + 7) / 8;
+	unsigned char *row;
+	unsigned char *raw = 0;
+	const unsigned char *in;
+	int Nrows;
+	int ix, iy;
+	STATS_TIMER(t0);
 
-	if (bitstreamflag == 0)
+	if (header->predictor == 2 && up->rowbits == 16 * up->Nin)
 	{
-		i = 0;
-
-		while (i < Nbytes -totbits/8 +1)
-		{
-			rgba[0] = readbytesample(bits, header, 0);
-			bits += header->bitspersample[0] / 8;
-			i += header->bitspersample[0] / 8;
-			rgba[1] = readbytesample(bits, header, 1);
-			bits += header->bitspersample[1] / 8;
-			i += header->bitspersample[1] / 8;
-			rgba[2] = readbytesample(bits, header, 2);
-			bits += header->bitspersample[2] / 8;
-			i += header->bitspersample[2] / 8;
-
-            if(insamples == 4)
-			{
-			  rgba[3] = readbytesample(bits, header, 3);
-		          bits += header->bitspersample[3]/8;
-                          i+=header->bitspersample[3]/8;
-                          lastsample = 4;
-			}
-            else
-            {
-                lastsample = 3;
-            }
-            
-
-			for (ii = lastsample; ii < header->samplesperpixel; ii++)
-			{
-				bits += header->bitspersample[ii] / 8;
-				i += header->bitspersample[ii] / 8;
-			}
-			rgba += insamples;
-		}
-
-		return 0;
+		raw = malloc(rowbytes ? rowbytes : 1);
+		if (!raw)
+			return -2;
+		STATS_ADD(header->stats, allocations, 1);
 	}
-	else
+	Nrows = rowbytes ? (int) (Nbytes / rowbytes < (unsigned long) height ? Nbytes / rowbytes : (unsigned long) height) : 0;
+	for (iy = dest->top; iy < dest->bottom && iy < Nrows; iy++)
 	{
-		BSTREAM *bs = bstream(bits, Nbytes, BIG_ENDIAN);
-		for (i = 0; i < height; i++)
+		row = destrow(dest, width, iy);
+		in = bits + iy * rowbytes;
+		if (raw)
 		{
-			for (ii = 0; ii < width; ii++)
-			{
-				red = getbits(bs, header->bitspersample[0]);
-				red = (red * 255) / ((1 << (header->bitspersample[0])) - 1);
-				green = getbits(bs, header->bitspersample[1]);
-				green = (green * 255) / ((1 << (header->bitspersample[1])) - 1);
-				blue = getbits(bs, header->bitspersample[2]);
-				blue = (blue * 255) / ((1 << (header->bitspersample[2])) - 1);
-				rgba[0] = red;
-				rgba[1] = green;
-				rgba[2] = blue;
-                if(insamples == 4)
-                {
-                    alpha = getbits(bs, header->bitspersample[3]);
-                    alpha = (alpha * 255) / ((1 << (header->bitspersample[3])) - 1);
-                    rgba[3] = alpha;
-                }
-				for (iii = insamples; iii < header->samplesperpixel; iii++)
-				{
-					getbits(bs, header->bitspersample[iii]);
-				}
-				rgba += insamples;
-			}
-			synchtobyte(bs);
+			STATS_START(t0);
+			memcpy(raw, in, rowbytes);
+			unpredictrow16(raw, width, up->Nin, header->endianness == BIG_ENDIAN);
+			STATS_STOP(header->stats, predictor_ns, t0);
+			in = raw;
+		}
+		(*up->fn)(row, in, width, up);
+		if (header->predictor == 2 && !raw)
+		{
+			STATS_START(t0);
+			unpredictrow(row, width, up->Nout, up->step);
+			STATS_STOP(header->stats, predictor_ns, t0);
 		}
-		killbstream(bs);
+		if (header->photometricinterpretation == PI_WhiteIsZero && up->sample_index == 0)
+		{
+			for (ix = 0; ix < width; ix++)
+				row[ix * up->step] = 255 - row[ix * up->step];
+		}
+		copyrow(dest, row, iy, up->Nout);
 	}
+	zerorows(dest, Nrows, up->Nout);
+	free(raw);
 
-	return 0;
+	return Nrows < height ? -1 : 0;
 }
 
 /*
@@ -1889,12 +5069,11 @@ static int readintsample(unsigned char *bytes, BASICHEADER *header, int sample_i
   read a sample froma  byte stream ( as tream where all the filedsa re whole byte multiples)
   Returns: sample in range 0 - 255
 */
-static int readbytesample(unsigned char *bytes, BASICHEADER *header, int sample_index)
+static int readbytesample(const unsigned char *bytes, const BASICHEADER *header, int sample_index)
 {
 	int answer = -1;
-	double real;
+	double real = 0;
 	double low, high;
-	static double highest = 0.0;
 
 	if (header->sampleformat[sample_index] == SAMPLEFORMAT_UINT)
 	{
@@ -1913,39 +5092,140 @@ static int readbytesample(unsigned char *bytes, BASICHEADER *header, int sample_
 			real = memreadieee754(bytes, header->endianness == BIG_ENDIAN ? 1 : 0);
 		else if (header->bitspersample[sample_index] == 32)
 			real = memreadieee754f(bytes, header->endianness == BIG_ENDIAN ? 1 : 0);
-		if (header->sminsamplevalue)
-			low = header->smaxsamplevalue[sample_index];
+		if (sample_index < header->Nsminsamplevalue)
+			low = header->sminsamplevalue[sample_index];
 		else
 			low = 0;
 
-		if (header->smaxsamplevalue)
+		if (sample_index < header->Nsmaxsamplevalue)
 			high = header->smaxsamplevalue[sample_index];
 		else
 			high = 512.0;
-		if (highest < real)
-		{
-			highest = real;
-		}
-		return (int)((real - low) * 255.0 / (high - low));
+		if (!(high > low))
+			return 0;
+		real = (real - low) * 255.0 / (high - low);
+		if (!(real > 0))
+			return 0;
+		return real < 255 ? (int) real : 255;
 	}
 
 	return answer;
 }
 
-static void unpredictsamples(unsigned char *buff, int width, int height, int depth, BASICHEADER *header)
+/*
+  unpack 16 bit or floating point samples, keeping their depth. 
+  Predictor 2 and WhiteIsZero are handled here too.
+    Params: out - return for the samples, unsigned shorts or floats
+            width, height - size of the strip, tile or plane
+            bits - the decompressed data
+            Nbytes - number of bytes of data
+            header - the image header
+            sample_index - index of the first sample (the plane index
+              for separate planes)
+            Nin - samples per pixel in the data
+            Nout - samples per pixel to unpack
+    Returns: 0 on success, -1 if the data ran out (the rest is zero)
+*/
+static int deepsamples(unsigned char *out, int width, int height, const unsigned char *bits, unsigned long Nbytes, BASICHEADER *header, int sample_index, int Nin, int Nout)
 {
+	unsigned short *out16 = (unsigned short *) out;
+	float *outf = (float *) out;
+	int bytes = header->bitspersample[sample_index] / 8;
+	int bigendian = header->endianness == BIG_ENDIAN ? 1 : 0;
+	unsigned long rowbytes = (unsigned long) width * Nin * bytes;
+	const unsigned char *in;
+	unsigned long k;
+	int Nrows;
 	int i, ii, iii;
+	STATS_TIMER(t0);
 
-    for (i = 0; i < height; i++)
-    {
-        for (ii = 1; ii < width; ii++)
-        {
-            for(iii=0;iii<depth;iii++)
-                buff[(i*width + ii) * depth+iii] += buff[(i*width + ii - 1) * depth + iii];
- 
-        }
-    }
+	Nrows = rowbytes ? (int) (Nbytes / rowbytes) : 0;
+	if (Nrows > height)
+		Nrows = height;
+	for (i = 0; i < Nrows; i++)
+	{
+		for (ii = 0; ii < width; ii++)
+		{
+			for (iii = 0; iii < Nout; iii++)
+			{
+				k = ((unsigned long) i * width + ii) * Nout + iii;
+				if (iii >= Nin)
+				{
+					memset(out + k * header->samplebytes, 0, header->samplebytes);
+					continue;
+				}
+				in = bits + i * rowbytes + (ii * Nin + iii) * bytes;
+				if (header->samplebytes == 2)
+					out16[k] = (unsigned short) memread16(header->endianness, in);
+				else if (bytes == 4)
+					outf[k] = memreadieee754f(in, bigendian);
+				else
+					outf[k] = (float) memreadieee754(in, bigendian);
+			}
+		}
+	}
+	memset(out + (unsigned long) Nrows * width * Nout * header->samplebytes, 0,
+		(unsigned long) (height - Nrows) * width * Nout * header->samplebytes);
+
+	if (header->samplebytes == 2)
+	{
+		if (header->predictor == 2)
+		{
+			STATS_START(t0);
+			for (i = 0; i < Nrows; i++)
+				for (k = (unsigned long) i * width * Nout + Nout; k < (unsigned long) (i + 1) * width * Nout; k++)
+					out16[k] = (unsigned short) (out16[k] + out16[k - Nout]);
+			STATS_STOP(header->stats, predictor_ns, t0);
+		}
+		if (header->photometricinterpretation == PI_WhiteIsZero && sample_index == 0)
+		{
+			for (k = 0; k < (unsigned long) Nrows * width; k++)
+				out16[k * Nout] = (unsigned short) (65535 - out16[k * Nout]);
+		}
+	}
+
+	return Nrows < height ? -1 : 0;
+}
+
+/*
+  undo predictor 2 (horizontal differencing) on a row
+    Params: row - the row
+            width - pixels in the row
+            Nsamples - samples to undo
+            step - samples from one pixel to the next
+*/
+static void unpredictrow(unsigned char *row, int width, int Nsamples, int step)
+{
+	int ix, i;
+
+	for (ix = 1; ix < width; ix++)
+	{
+		for (i = 0; i < Nsamples; i++)
+			row[ix * step + i] += row[(ix - 1) * step + i];
+	}
+}
+
+/*
+  undo predictor 2 on a row of 16 bit samples as they are in the file
+    Params: row - the row
+            width - pixels in the row
+            Nsamples - samples per pixel
+            bigendian - set if the samples are big endian
+*/
+static void unpredictrow16(unsigned char *row, int width, int Nsamples, int bigendian)
+{
+	unsigned long N = (unsigned long) width * Nsamples;
+	unsigned long i;
+	unsigned int val;
+	unsigned char *hi = row + (bigendian ? 0 : 1);
+	unsigned char *lo = row + (bigendian ? 1 : 0);
 
+	for (i = Nsamples; i < N; i++)
+	{
+		val = ((hi[i * 2] << 8) | lo[i * 2]) + ((hi[(i - Nsamples) * 2] << 8) | lo[(i - Nsamples) * 2]);
+		hi[i * 2] = (unsigned char) (val >> 8);
+		lo[i * 2] = (unsigned char) val;
+	}
 }
 
 
@@ -1959,201 +5239,173 @@ typedef struct LodePNGDecompressSettings
 	unsigned custom_decoder; /*use custom decoder if LODEPNG_CUSTOM_ZLIB_DECODER and LODEPNG_COMPILE_ZLIB are enabled*/
 } LodePNGDecompressSettings;
 
-static void invert(unsigned char *bits, unsigned long N);
-static unsigned char *unpackbits(FILE *fp, unsigned long count, unsigned long *Nret);
-static unsigned char *ccittdecompress(unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int eol);
-static unsigned char *ccittgroup4decompress(unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int eol);
-static int loadlzw(unsigned char *out, FILE *fp, unsigned long count, unsigned long *Nret);
+static unsigned char *unpackbits(const unsigned char *in, unsigned long count, unsigned long *Nret);
+static unsigned char *ccittdecompress(const unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int compression, unsigned long T4options, int lsbfirst);
+static unsigned char *ccittgroup4decompress(const unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int lsbfirst);
+static int loadlzw(unsigned char *out, unsigned long Nout, const unsigned char *in, unsigned long count, unsigned long *Nret);
 static unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const unsigned char* in,
 	size_t insize, const LodePNGDecompressSettings* settings);
+static unsigned lodepng_zlib_decompress_into(unsigned char* out, size_t outsize, size_t* decoded,
+	const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings);
 
 /*
   Master decompression function
   Params:
-    fp - input file, pointing to start of data section
+    src - the source
+	offset - position of the data section in the source
 	count - number of bytes in stream to decompress
 	Nret - return for number of decompressed bytes
 	width, height - width and height of strip or tile
 	T4option - T4 twiddle
+	fillorder - FillOrder, 2 if bits are lowest first
+	Nexpected - bytes the strip or tile should decompress to
   Returns: pointer to decompressed dta, 0 on fail
-
+  Release the data with releasedecompressed(). Uncompressed data from a
+  memory source is not copied, we just hand back a pointer to it.
 */
-static unsigned char *decompress(FILE *fp, unsigned long count, int compression, unsigned long *Nret, int width, int height, unsigned long T4options)
+static unsigned char *decompress(TIFFSOURCE *src, TIFFOFFSET offset, TIFFOFFSET count, int compression, unsigned long *Nret, int width, int height, unsigned long T4options, int fillorder, unsigned long Nexpected)
 {
 	unsigned char *answer = 0;
+	const unsigned char *in;
+	unsigned long N;
+	STATS_TIMER(t0);
+
+	/* a strip or tile has to fit in memory, even if the file doesn't */
+	N = (unsigned long) count;
+	if ((TIFFOFFSET) N != count)
+		goto out_of_memory;
+	in = fetchbytes(src, offset, &N);
+	if (!in)
+		goto out_of_memory;
+	STATS_ADD(src->stats, units, 1);
+	STATS_ADD(src->stats, compressedbytes, N);
+	STATS_START(t0);
 	if (compression == 1)
 	{
-		answer = malloc(count);
-		if (!answer)
-			goto out_of_memory;
-		fread(answer, 1, count, fp);
-		*Nret = count;
-		return answer;
-	}
-	else if (compression == COMPRESSION_CCITTRLE)
-	{
-		unsigned char *buff = malloc(count);
-		unsigned long i;
-		if (!buff)
-			goto out_of_memory;
-		fread(buff, 1, count, fp);
-		answer = ccittdecompress(buff, count, Nret, width, height, 0);
-		if (answer)
-			invert(answer, *Nret);
-		free(buff);
-		return answer;
+		*Nret = N;
+		STATS_ADD(src->stats, decompressedbytes, N);
+		return (unsigned char *) in;
 	}
-	else if (compression == COMPRESSION_CCITTFAX3)
+	else if (compression == COMPRESSION_CCITTRLE || compression == COMPRESSION_CCITTFAX3)
 	{
-		unsigned char *buff = malloc(count);
-		if (!buff)
-			goto out_of_memory;
-		fread(buff, 1, count, fp);
-		if ((T4options & 0x04) == 0)
-			answer = ccittdecompress(buff, count, Nret, width, height, 1);
+		if ((T4options & 0x02) == 0)
+			answer = ccittdecompress(in, N, Nret, width, height, compression, T4options, fillorder == 2);
 		else
-			answer = 0; /* not handling for now */
-		if (answer)
-			invert(answer, *Nret);
-		free(buff);
-		return answer;
+			answer = 0; /* uncompressed mode, not handling for now */
 	}
 	else if (compression == COMPRESSION_CCITTFAX4)
 	{
-		unsigned char *buff = malloc(count);
-		if (!buff)
-			goto out_of_memory;
-		fread(buff, 1, count, fp);
-		answer = ccittgroup4decompress(buff, count, Nret, width, height, 0);
-		if (answer)
-			invert(answer, *Nret);
-		free(buff);
-		return answer;
+		answer = ccittgroup4decompress(in, N, Nret, width, height, fillorder == 2);
 	}
 	else if (compression == COMPRESSION_PACKBITS)
 	{
-		answer = unpackbits(fp, count, Nret);
-		return answer;
+		answer = unpackbits(in, N, Nret);
 	}
 	else if (compression == COMPRESSION_LZW)
 	{
-		unsigned long pos = ftell(fp);
-		int err;
-		err = loadlzw(0, fp, count, Nret);
-		answer = malloc(*Nret);
-		if (!answer)
-			goto out_of_memory;
-		fseek(fp, pos, SEEK_SET);
-		loadlzw(answer, fp, count, Nret);
-		return answer;
+		if (Nexpected > 0)
+			answer = malloc(Nexpected);
+		if (answer && loadlzw(answer, Nexpected, in, N, Nret) != 0)
+		{
+			free(answer);
+			answer = 0;
+		}
 	}
 	else if (compression == COMPRESSION_ADOBE_DEFLATE || compression == COMPRESSION_DEFLATE)
 	{
 		LodePNGDecompressSettings settings;
+		size_t decompsize = 0;
+
 		settings.custom_decoder = 0;
 		settings.ignore_adler32 = 0;
-		unsigned char *buff = malloc(count);
-		if (!buff)
-			goto out_of_memory;
-		fread(buff, 1, count, fp);
 		*Nret = 0;
 		answer = 0;
-        size_t decompsize = 0;
-		lodepng_zlib_decompress(&answer, &decompsize, buff, count, &settings);
-        *Nret = (unsigned long) decompsize;
-		free(buff);
-		return answer;
+		if (Nexpected > 0)
+		{
+			/* we know the size, so inflate straight into a buffer of it */
+			answer = malloc(Nexpected);
+			if (answer)
+				lodepng_zlib_decompress_into(answer, Nexpected, &decompsize, in, N, &settings);
+		}
+		else
+			lodepng_zlib_decompress(&answer, &decompsize, in, N, &settings);
+		*Nret = (unsigned long) decompsize;
 	}
-	return 0;
+	STATS_STOP(src->stats, decompress_ns[statscodec(compression)], t0);
+	if (answer)
+	{
+		STATS_ADD(src->stats, allocations, 1);
+		STATS_ADD(src->stats, decompressedbytes, *Nret);
+	}
+	releasebytes(src, in);
+	return answer;
 
 out_of_memory:
 	return 0;
 }
 
-static void invert(unsigned char *bits, unsigned long N)
+/*
+  release the return from decompress()
+*/
+static void releasedecompressed(TIFFSOURCE *src, int compression, unsigned char *data)
 {
-	unsigned long i;
-
-	for (i = 0; i < N; i++)
-		bits[i] ^= 0xFF;
+	if (compression == 1)
+		releasebytes(src, data);
+	else
+		free(data);
 }
 
 /*
   unpackbits decompressor. 
   Nice and easy compression scheme
 */
-static unsigned char *unpackbits(FILE *fp, unsigned long count, unsigned long *Nret)
+static unsigned char *unpackbits(const unsigned char *in, unsigned long count, unsigned long *Nret)
 {
-	unsigned long pos = ftell(fp);
 	unsigned long N = 0;
 	unsigned long i, j;
-	long Nleft;
+	unsigned long pos;
 	signed char header;
-	int ch;
 	unsigned char *answer = 0;
 
-	Nleft = count;
-	while (Nleft > 0)
+	pos = 0;
+	while (pos < count)
 	{
-		if ((ch = fgetc(fp)) == EOF)
-			goto parse_error;
-		Nleft--;
-		header = (signed char) ch;
-		if (header > 0)
+		header = (signed char) in[pos++];
+		if (header >= 0)
 		{
 			N += header + 1;
-			for (i = 0; i < header +1; i++)
-			{
-				fgetc(fp);
-				Nleft--;
-			}
+			pos += header + 1;
 		}
 		else if (header > -128)
 		{
 			N += 1 - header;
-			fgetc(fp);
-			Nleft--;
-		}
-		else
-		{
+			pos++;
 		}
 	}
-	fseek(fp, pos, SEEK_SET);
-	Nleft = count;
 	answer = malloc(N);
 	if (!answer)
 		goto out_of_memory;
 	j = 0;
-	while (Nleft > 0)
+	pos = 0;
+	while (pos < count)
 	{
-		if ((ch = fgetc(fp)) == EOF)
-			goto parse_error;
-		Nleft--;
-		header = (signed char) ch;
-		if (header > 0)
+		header = (signed char) in[pos++];
+		if (header >= 0)
 		{
-			for (i = 0; i < header +1; i++)
-			{
-				answer[j++] = fgetc(fp);
-				Nleft--;
-			}
+			for (i = 0; i < (unsigned long) header + 1; i++)
+				answer[j++] = pos < count ? in[pos++] : 0;
 		}
 		else if (header > -128)
 		{
-			ch  = fgetc(fp);
-			Nleft--;
-			for (i = 0; i < 1 - header; i++)
-				answer[j++] = ch;
+			unsigned char ch = pos < count ? in[pos] : 0;
+			pos++;
+			memset(answer + j, ch, 1 - header);
+			j += 1 - header;
 		}
-		else
-		{
-		}
-
 	}
 
 	*Nret = N;
 	return answer;
-parse_error:
 out_of_memory:
 	free(answer);
     *Nret = 0;
@@ -2164,741 +5416,769 @@ out_of_memory:
 
 typedef struct
 {
-	int code;
-	int prefix;
-	int suffix;
+	unsigned long offset;
 	int len;
-	unsigned char *ptr;
 } ENTRY;
 
 
-typedef struct huffnode
+/*///////////////////////////////////////////////////////////////////////////////////////////////////*/
+/*   CCITT decoding section*/
+/*///////////////////////////////////////////////////////////////////////////////////////////////////*/
+#define CCITT_PASS 101
+#define CCITT_HORIZONTAL 102
+#define CCITT_VERTICAL_0 103
+#define CCITT_VERTICAL_R1 104
+#define CCITT_VERTICAL_R2 105
+#define CCITT_VERTICAL_R3 106
+#define CCITT_VERTICAL_L1 107
+#define CCITT_VERTICAL_L2 108
+#define CCITT_VERTICAL_L3 109
+#define CCITT_EXTENSION 110
+#define CCITT_ENDOFFAXBLOCK 110
+#define EOL -2
+
+/*
+  CCITT code lookup tables, one entry per code. The first 256 entries
+  are indexed by the next 8 bits of the stream. An entry with bits set
+  is a code of that many bits, and value is its run length (or EOL, or
+  mode). An entry with subbits set is a code longer than 8 bits, and 
+  value is the index of a subtable indexed by the following subbits bits,
+  whose entries give the bits beyond the first 8. Anything else is not 
+  a valid code. The tables are generated from T.4 tables 2 and 3, and
+  T.6 table 1.
+*/
+typedef struct
+{
+	short value;
+	unsigned char bits;
+	unsigned char subbits;
+} FAXCODE;
+
+#define FAXROOTBITS 8
+
+/*
+  fax bitstream reader, refilled a byte at a time. Reads past the end 
+  give zeros, and a code which runs into them is an error.
+*/
+typedef struct
+{
+	const unsigned char *data;
+	unsigned long N;
+	unsigned long pos;
+	unsigned long buffer;
+	int bitcount;
+	int padbits;
+	int lsbfirst;
+} FAXBITS;
+
+static void faxbitsinit(FAXBITS *fb, const unsigned char *data, unsigned long N, int lsbfirst);
+static unsigned int faxpeekbits(FAXBITS *fb, int nbits);
+static int faxskipbits(FAXBITS *fb, int nbits);
+static int faxgetbit(FAXBITS *fb);
+static int faxdecode(FAXBITS *fb, const FAXCODE *table);
+
+
+static const FAXCODE faxwhitetable[304] =
+{
+	{ 256, 0, 4 }, { 272, 0, 4 }, { 29, 8, 0 }, { 30, 8, 0 }, { 45, 8, 0 }, { 46, 8, 0 }, { 22, 7, 0 }, { 22, 7, 0 },
+	{ 23, 7, 0 }, { 23, 7, 0 }, { 47, 8, 0 }, { 48, 8, 0 }, { 13, 6, 0 }, { 13, 6, 0 }, { 13, 6, 0 }, { 13, 6, 0 },
+	{ 20, 7, 0 }, { 20, 7, 0 }, { 33, 8, 0 }, { 34, 8, 0 }, { 35, 8, 0 }, { 36, 8, 0 }, { 37, 8, 0 }, { 38, 8, 0 },
+	{ 19, 7, 0 }, { 19, 7, 0 }, { 31, 8, 0 }, { 32, 8, 0 }, { 1, 6, 0 }, { 1, 6, 0 }, { 1, 6, 0 }, { 1, 6, 0 },
+	{ 12, 6, 0 }, { 12, 6, 0 }, { 12, 6, 0 }, { 12, 6, 0 }, { 53, 8, 0 }, { 54, 8, 0 }, { 26, 7, 0 }, { 26, 7, 0 },
+	{ 39, 8, 0 }, { 40, 8, 0 }, { 41, 8, 0 }, { 42, 8, 0 }, { 43, 8, 0 }, { 44, 8, 0 }, { 21, 7, 0 }, { 21, 7, 0 },
+	{ 28, 7, 0 }, { 28, 7, 0 }, { 61, 8, 0 }, { 62, 8, 0 }, { 63, 8, 0 }, { 0, 8, 0 }, { 320, 8, 0 }, { 384, 8, 0 },
+	{ 10, 5, 0 }, { 10, 5, 0 }, { 10, 5, 0 }, { 10, 5, 0 }, { 10, 5, 0 }, { 10, 5, 0 }, { 10, 5, 0 }, { 10, 5, 0 },
+	{ 11, 5, 0 }, { 11, 5, 0 }, { 11, 5, 0 }, { 11, 5, 0 }, { 11, 5, 0 }, { 11, 5, 0 }, { 11, 5, 0 }, { 11, 5, 0 },
+	{ 27, 7, 0 }, { 27, 7, 0 }, { 59, 8, 0 }, { 60, 8, 0 }, { 288, 0, 1 }, { 290, 0, 1 }, { 18, 7, 0 }, { 18, 7, 0 },
+	{ 24, 7, 0 }, { 24, 7, 0 }, { 49, 8, 0 }, { 50, 8, 0 }, { 51, 8, 0 }, { 52, 8, 0 }, { 25, 7, 0 }, { 25, 7, 0 },
+	{ 55, 8, 0 }, { 56, 8, 0 }, { 57, 8, 0 }, { 58, 8, 0 }, { 192, 6, 0 }, { 192, 6, 0 }, { 192, 6, 0 }, { 192, 6, 0 },
+	{ 1664, 6, 0 }, { 1664, 6, 0 }, { 1664, 6, 0 }, { 1664, 6, 0 }, { 448, 8, 0 }, { 512, 8, 0 }, { 292, 0, 1 }, { 640, 8, 0 },
+	{ 576, 8, 0 }, { 294, 0, 1 }, { 296, 0, 1 }, { 298, 0, 1 }, { 300, 0, 1 }, { 302, 0, 1 }, { 256, 7, 0 }, { 256, 7, 0 },
+	{ 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 },
+	{ 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 }, { 2, 4, 0 },
+	{ 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 },
+	{ 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 }, { 3, 4, 0 },
+	{ 128, 5, 0 }, { 128, 5, 0 }, { 128, 5, 0 }, { 128, 5, 0 }, { 128, 5, 0 }, { 128, 5, 0 }, { 128, 5, 0 }, { 128, 5, 0 },
+	{ 8, 5, 0 }, { 8, 5, 0 }, { 8, 5, 0 }, { 8, 5, 0 }, { 8, 5, 0 }, { 8, 5, 0 }, { 8, 5, 0 }, { 8, 5, 0 },
+	{ 9, 5, 0 }, { 9, 5, 0 }, { 9, 5, 0 }, { 9, 5, 0 }, { 9, 5, 0 }, { 9, 5, 0 }, { 9, 5, 0 }, { 9, 5, 0 },
+	{ 16, 6, 0 }, { 16, 6, 0 }, { 16, 6, 0 }, { 16, 6, 0 }, { 17, 6, 0 }, { 17, 6, 0 }, { 17, 6, 0 }, { 17, 6, 0 },
+	{ 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 },
+	{ 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 }, { 4, 4, 0 },
+	{ 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 },
+	{ 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 },
+	{ 14, 6, 0 }, { 14, 6, 0 }, { 14, 6, 0 }, { 14, 6, 0 }, { 15, 6, 0 }, { 15, 6, 0 }, { 15, 6, 0 }, { 15, 6, 0 },
+	{ 64, 5, 0 }, { 64, 5, 0 }, { 64, 5, 0 }, { 64, 5, 0 }, { 64, 5, 0 }, { 64, 5, 0 }, { 64, 5, 0 }, { 64, 5, 0 },
+	{ 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 },
+	{ 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 },
+	{ 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 },
+	{ 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 }, { 7, 4, 0 },
+	{ -1, 0, 0 }, { -2, 4, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 },
+	{ -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 },
+	{ 1792, 3, 0 }, { 1792, 3, 0 }, { 1984, 4, 0 }, { 2048, 4, 0 }, { 2112, 4, 0 }, { 2176, 4, 0 }, { 2240, 4, 0 }, { 2304, 4, 0 },
+	{ 1856, 3, 0 }, { 1856, 3, 0 }, { 1920, 3, 0 }, { 1920, 3, 0 }, { 2368, 4, 0 }, { 2432, 4, 0 }, { 2496, 4, 0 }, { 2560, 4, 0 },
+	{ 1472, 1, 0 }, { 1536, 1, 0 }, { 1600, 1, 0 }, { 1728, 1, 0 }, { 704, 1, 0 }, { 768, 1, 0 }, { 832, 1, 0 }, { 896, 1, 0 },
+	{ 960, 1, 0 }, { 1024, 1, 0 }, { 1088, 1, 0 }, { 1152, 1, 0 }, { 1216, 1, 0 }, { 1280, 1, 0 }, { 1344, 1, 0 }, { 1408, 1, 0 }
+};
+
+static const FAXCODE faxblacktable[408] =
+{
+	{ 256, 0, 3 }, { 264, 0, 4 }, { 280, 0, 5 }, { 312, 0, 5 }, { 13, 8, 0 }, { 344, 0, 4 }, { 360, 0, 4 }, { 14, 8, 0 },
+	{ 10, 7, 0 }, { 10, 7, 0 }, { 11, 7, 0 }, { 11, 7, 0 }, { 376, 0, 4 }, { 392, 0, 4 }, { 12, 7, 0 }, { 12, 7, 0 },
+	{ 9, 6, 0 }, { 9, 6, 0 }, { 9, 6, 0 }, { 9, 6, 0 }, { 8, 6, 0 }, { 8, 6, 0 }, { 8, 6, 0 }, { 8, 6, 0 },
+	{ 7, 5, 0 }, { 7, 5, 0 }, { 7, 5, 0 }, { 7, 5, 0 }, { 7, 5, 0 }, { 7, 5, 0 }, { 7, 5, 0 }, { 7, 5, 0 },
+	{ 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 },
+	{ 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 }, { 6, 4, 0 },
+	{ 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 },
+	{ 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 }, { 5, 4, 0 },
+	{ 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 },
+	{ 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 },
+	{ 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 },
+	{ 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 }, { 1, 3, 0 },
+	{ 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 },
+	{ 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 },
+	{ 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 },
+	{ 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 }, { 4, 3, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 }, { 3, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 }, { 2, 2, 0 },
+	{ -2, 3, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 },
+	{ 1792, 3, 0 }, { 1792, 3, 0 }, { 1984, 4, 0 }, { 2048, 4, 0 }, { 2112, 4, 0 }, { 2176, 4, 0 }, { 2240, 4, 0 }, { 2304, 4, 0 },
+	{ 1856, 3, 0 }, { 1856, 3, 0 }, { 1920, 3, 0 }, { 1920, 3, 0 }, { 2368, 4, 0 }, { 2432, 4, 0 }, { 2496, 4, 0 }, { 2560, 4, 0 },
+	{ 18, 2, 0 }, { 18, 2, 0 }, { 18, 2, 0 }, { 18, 2, 0 }, { 18, 2, 0 }, { 18, 2, 0 }, { 18, 2, 0 }, { 18, 2, 0 },
+	{ 52, 4, 0 }, { 52, 4, 0 }, { 640, 5, 0 }, { 704, 5, 0 }, { 768, 5, 0 }, { 832, 5, 0 }, { 55, 4, 0 }, { 55, 4, 0 },
+	{ 56, 4, 0 }, { 56, 4, 0 }, { 1280, 5, 0 }, { 1344, 5, 0 }, { 1408, 5, 0 }, { 1472, 5, 0 }, { 59, 4, 0 }, { 59, 4, 0 },
+	{ 60, 4, 0 }, { 60, 4, 0 }, { 1536, 5, 0 }, { 1600, 5, 0 }, { 24, 3, 0 }, { 24, 3, 0 }, { 24, 3, 0 }, { 24, 3, 0 },
+	{ 25, 3, 0 }, { 25, 3, 0 }, { 25, 3, 0 }, { 25, 3, 0 }, { 1664, 5, 0 }, { 1728, 5, 0 }, { 320, 4, 0 }, { 320, 4, 0 },
+	{ 384, 4, 0 }, { 384, 4, 0 }, { 448, 4, 0 }, { 448, 4, 0 }, { 512, 5, 0 }, { 576, 5, 0 }, { 53, 4, 0 }, { 53, 4, 0 },
+	{ 54, 4, 0 }, { 54, 4, 0 }, { 896, 5, 0 }, { 960, 5, 0 }, { 1024, 5, 0 }, { 1088, 5, 0 }, { 1152, 5, 0 }, { 1216, 5, 0 },
+	{ 64, 2, 0 }, { 64, 2, 0 }, { 64, 2, 0 }, { 64, 2, 0 }, { 64, 2, 0 }, { 64, 2, 0 }, { 64, 2, 0 }, { 64, 2, 0 },
+	{ 23, 3, 0 }, { 23, 3, 0 }, { 50, 4, 0 }, { 51, 4, 0 }, { 44, 4, 0 }, { 45, 4, 0 }, { 46, 4, 0 }, { 47, 4, 0 },
+	{ 57, 4, 0 }, { 58, 4, 0 }, { 61, 4, 0 }, { 256, 4, 0 }, { 16, 2, 0 }, { 16, 2, 0 }, { 16, 2, 0 }, { 16, 2, 0 },
+	{ 17, 2, 0 }, { 17, 2, 0 }, { 17, 2, 0 }, { 17, 2, 0 }, { 48, 4, 0 }, { 49, 4, 0 }, { 62, 4, 0 }, { 63, 4, 0 },
+	{ 30, 4, 0 }, { 31, 4, 0 }, { 32, 4, 0 }, { 33, 4, 0 }, { 40, 4, 0 }, { 41, 4, 0 }, { 22, 3, 0 }, { 22, 3, 0 },
+	{ 15, 1, 0 }, { 15, 1, 0 }, { 15, 1, 0 }, { 15, 1, 0 }, { 15, 1, 0 }, { 15, 1, 0 }, { 15, 1, 0 }, { 15, 1, 0 },
+	{ 128, 4, 0 }, { 192, 4, 0 }, { 26, 4, 0 }, { 27, 4, 0 }, { 28, 4, 0 }, { 29, 4, 0 }, { 19, 3, 0 }, { 19, 3, 0 },
+	{ 20, 3, 0 }, { 20, 3, 0 }, { 34, 4, 0 }, { 35, 4, 0 }, { 36, 4, 0 }, { 37, 4, 0 }, { 38, 4, 0 }, { 39, 4, 0 },
+	{ 21, 3, 0 }, { 21, 3, 0 }, { 42, 4, 0 }, { 43, 4, 0 }, { 0, 2, 0 }, { 0, 2, 0 }, { 0, 2, 0 }, { 0, 2, 0 }
+};
+
+static const FAXCODE faxmodetable[272] =
+{
+	{ 256, 0, 4 }, { -1, 0, 0 }, { 110, 7, 0 }, { 110, 7, 0 }, { 109, 7, 0 }, { 109, 7, 0 }, { 106, 7, 0 }, { 106, 7, 0 },
+	{ 108, 6, 0 }, { 108, 6, 0 }, { 108, 6, 0 }, { 108, 6, 0 }, { 105, 6, 0 }, { 105, 6, 0 }, { 105, 6, 0 }, { 105, 6, 0 },
+	{ 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 },
+	{ 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 }, { 101, 4, 0 },
+	{ 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 },
+	{ 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 },
+	{ 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 },
+	{ 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 }, { 102, 3, 0 },
+	{ 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 },
+	{ 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 },
+	{ 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 },
+	{ 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 }, { 107, 3, 0 },
+	{ 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 },
+	{ 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 },
+	{ 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 },
+	{ 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 }, { 104, 3, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 }, { 103, 1, 0 },
+	{ -1, 0, 0 }, { 110, 4, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 },
+	{ -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }, { -1, 0, 0 }
+};
+
+static void faxbitsinit(FAXBITS *fb, const unsigned char *data, unsigned long N, int lsbfirst)
+{
+	fb->data = data;
+	fb->N = N;
+	fb->pos = 0;
+	fb->buffer = 0;
+	fb->bitcount = 0;
+	fb->padbits = 0;
+	fb->lsbfirst = lsbfirst;
+}
+
+/*
+  look at the next bits of the stream without consuming them
+    Params: fb - the stream
+	        nbits - number of bits (up to 24)
+	Returns: the bits, first bit most significant
+*/
+static unsigned int faxpeekbits(FAXBITS *fb, int nbits)
+{
+	unsigned int byte;
+
+	while (fb->bitcount <= 24)
+	{
+		if (fb->pos < fb->N)
+			byte = fb->data[fb->pos++];
+		else
+		{
+			byte = 0;
+			fb->padbits += 8;
+		}
+		if (fb->lsbfirst)
+		{
+			byte = ((byte & 0xF0) >> 4) | ((byte & 0x0F) << 4);
+			byte = ((byte & 0xCC) >> 2) | ((byte & 0x33) << 2);
+			byte = ((byte & 0xAA) >> 1) | ((byte & 0x55) << 1);
+		}
+		fb->buffer = (fb->buffer << 8) | byte;
+		fb->bitcount += 8;
+	}
+	return (unsigned int) (fb->buffer >> (fb->bitcount - nbits)) & ((1u << nbits) - 1);
+}
+
+/*
+  consume bits already peeked
+  Returns: 0 on success, -1 if that takes us past the end of the data
+*/
+static int faxskipbits(FAXBITS *fb, int nbits)
+{
+	fb->bitcount -= nbits;
+	return fb->bitcount < fb->padbits ? -1 : 0;
+}
+
+static int faxgetbit(FAXBITS *fb)
+{
+	int answer = faxpeekbits(fb, 1);
+
+	if (faxskipbits(fb, 1))
+		return -1;
+	return answer;
+}
+
+/*
+  read a code from the stream
+    Params: fb - the stream
+	        table - the code table
+	Returns: the value of the code, -1 if not a valid code
+*/
+static int faxdecode(FAXBITS *fb, const FAXCODE *table)
+{
+	const FAXCODE *code;
+
+	code = &table[faxpeekbits(fb, FAXROOTBITS)];
+	if (code->subbits)
+	{
+		faxskipbits(fb, FAXROOTBITS);
+		code = &table[code->value + faxpeekbits(fb, code->subbits)];
+	}
+	if (code->bits == 0 || faxskipbits(fb, code->bits))
+		return -1;
+
+	return code->value;
+}
+
+
+/*
+  add a changing element to a row. A change back at the position of the
+  last one cancels it (a zero-length run), so the list stays increasing
+  and alternates white to black, black to white.
+*/
+static void faxaddchange(int *changes, int *N, int pos, int width)
+{
+	if (*N > 0 && changes[*N - 1] == pos)
+		(*N)--;
+	else if (pos < width)
+		changes[(*N)++] = pos;
+}
+
+/*
+  read a white or black run, makeup codes and all
+  Returns: run length, EOL, or -1 on a bad code
+*/
+static int faxrun(FAXBITS *fb, const FAXCODE *table)
+{
+	int len;
+	int seg;
+
+	len = faxdecode(fb, table);
+	if (len < 64)
+		return len;
+	do
+	{
+		seg = faxdecode(fb, table);
+		if (seg < 0)
+			return -1;
+		len += seg;
+	} while (seg >= 64 && len <= 0x10000);
+
+	return len;
+}
+
+/*
+  decode a one-dimensional (Modified Huffman) row
+    Params: fb - the stream
+	        width - row width
+			changes - return for the changing elements
+  Returns: number of changing elements, -1 on parse error
+  An EOL in place of a white run ends the row early, the rest is white.
+*/
+static int faxrow1d(FAXBITS *fb, int width, int *changes)
 {
-	struct huffnode *zero;
-	struct huffnode *one;
-	int symbol;
-} HUFFNODE;
+	int N = 0;
+	int pos = 0;
+	int len;
+	int colour = 0;
 
-static HUFFNODE *addhuffmansymbol(HUFFNODE *root, const char *str, int symbol, int *err);
-static void killhuffmantree(HUFFNODE *root);
+	while (pos < width)
+	{
+		len = faxrun(fb, colour ? faxblacktable : faxwhitetable);
+		if (len == EOL && colour == 0)
+			break;
+		if (len < 0 || pos + len > width)
+			return -1;
+		pos += len;
+		faxaddchange(changes, &N, pos, width);
+		colour ^= 1;
+	}
 
+	return N;
+}
 
 /*
-  add a symbol to the tree
-  root - original tree (start off with null)
-         str - the code, to add, encoded in ascii
-		 symbol - associated symbol
-		 err - error return sticky, 0 = success
-  Returns: new tree (meaningful internally, after the first external call will
-           always return the root)
-   
+  decode a two-dimensional (READ) row
+    Params: fb - the stream
+	        width - row width
+			ref - changing elements of the row above, followed by at least 
+			   two entries of width
+			Nref - number of changing elements in ref
+			changes - return for changing elements of this row
+  Returns: number of changing elements, -1 on parse error, -2 on end of
+    block (nothing decoded)
 */
-static HUFFNODE *addhuffmansymbol(HUFFNODE *root, const char *str, int symbol, int *err)
+static int faxrow2d(FAXBITS *fb, int width, const int *ref, int Nref, int *changes)
 {
-	HUFFNODE *answer;
-	if (root)
-	{
-		if (str[0] == '0')
-			root->zero = addhuffmansymbol(root->zero, str + 1, symbol, err);
-		else if (str[0] == '1')
-			root->one = addhuffmansymbol(root->one, str + 1, symbol, err);
-		else if (str[0] == 0)
-			root->symbol = symbol;
+	int N = 0;
+	int a0 = -1;
+	int a1, a2;
+	int b1, b2;
+	int k = 0;
+	int colour = 0;
+	int mode;
+	int len;
 
-		return root;
-	}
-	else
+	while (a0 < width)
 	{
-		answer = malloc(sizeof(HUFFNODE));
-		if (!answer)
+		/* b1 is the first change on the reference line past a0 to the 
+		   opposite colour of a0 */
+		while (k > 0 && ref[k - 1] > a0)
+			k--;
+		while (k < Nref && ref[k] <= a0)
+			k++;
+		if ((k & 1) != colour)
+			k++;
+		b1 = ref[k];
+		b2 = ref[k + 1];
+		if (a0 < 0)
+			a0 = 0;
+
+		mode = faxdecode(fb, faxmodetable);
+		switch (mode)
 		{
-			*err = -1;
-			return 0;
+		case CCITT_PASS:
+			a1 = b2;
+			break;
+		case CCITT_HORIZONTAL:
+			len = faxrun(fb, colour ? faxblacktable : faxwhitetable);
+			if (len < 0)
+				return -1;
+			a1 = a0 + len;
+			len = faxrun(fb, colour ? faxwhitetable : faxblacktable);
+			if (len < 0 || a1 > width)
+				return -1;
+			a2 = a1 + len;
+			if (a2 > width)
+				a2 = width;
+			faxaddchange(changes, &N, a1, width);
+			faxaddchange(changes, &N, a2, width);
+			a0 = a2;
+			continue;
+		case CCITT_VERTICAL_0:
+			a1 = b1;
+			break;
+		case CCITT_VERTICAL_R1:
+			a1 = b1 + 1;
+			break;
+		case CCITT_VERTICAL_R2:
+			a1 = b1 + 2;
+			break;
+		case CCITT_VERTICAL_R3:
+			a1 = b1 + 3;
+			break;
+		case CCITT_VERTICAL_L1:
+			a1 = b1 - 1;
+			break;
+		case CCITT_VERTICAL_L2:
+			a1 = b1 - 2;
+			break;
+		case CCITT_VERTICAL_L3:
+			a1 = b1 - 3;
+			break;
+		case CCITT_ENDOFFAXBLOCK:
+			return N == 0 && a0 == 0 ? -2 : -1;
+		default:
+			return -1;
+		}
+		if (a1 < 0 || (a1 <= a0 && a0 != 0))
+			return -1;
+		if (a1 > width)
+			a1 = width;
+		if (mode != CCITT_PASS)
+		{
+			faxaddchange(changes, &N, a1, width);
+			colour ^= 1;
 		}
-		answer->zero = 0;
-		answer->one = 0;
-		answer->symbol = -1;
-		return addhuffmansymbol(answer, str, symbol, err);
+		a0 = a1;
 	}
-	return 0;
+
+	return N;
 }
 
 /*
-  Huffman tree destructor
+  write a decoded row out as bits, black as 0 and white as 1
+    Params: row - output row, (width + 7)/8 bytes
+	        width - row width
+			changes - the changing elements
+			N - number of changing elements
+  Runs are filled a byte at a time, with memset for the whole bytes.
 */
-static void killhuffmantree(HUFFNODE *root)
+static void faxputrow(unsigned char *row, int width, const int *changes, int N)
 {
-	if (root)
+	int i;
+	int start, end;
+	int startbyte, endbyte;
+
+	memset(row, 0xFF, (width + 7) / 8);
+	for (i = 0; i < N; i += 2)
 	{
-		killhuffmantree(root->zero);
-		killhuffmantree(root->one);
-		free(root);
+		start = changes[i];
+		end = i + 1 < N ? changes[i + 1] : width;
+		startbyte = start >> 3;
+		endbyte = end >> 3;
+		if (startbyte == endbyte)
+		{
+			row[startbyte] &= (unsigned char) ~((0xFF >> (start & 7)) & ~(0xFF >> (end & 7)));
+			continue;
+		}
+		row[startbyte] &= (unsigned char) ~(0xFF >> (start & 7));
+		memset(row + startbyte + 1, 0, endbyte - startbyte - 1);
+		if (end & 7)
+			row[endbyte] &= (unsigned char) (0xFF >> (end & 7));
 	}
 }
 
 /*
-static void debughufftree(HUFFNODE *root, int N)
-{
-	int i;
-		for (i = 0; i < N * 2; i++)
-			printf(" ");
-		printf("%d %p %p\n", root->symbol, root->zero, root->one);
-		if (root->zero)
-			debug(root->zero, N + 1);
-		if (root->one)
-			debug(root->one, N+1);
-
-}
+  skip an EOL code, and any fill bits before it, if there is one next
+  Returns: 1 if there was an EOL, else 0
 */
-
-static int gethuffmansymbol(HUFFNODE *root, BSTREAM *bs)
+static int faxskipeol(FAXBITS *fb)
 {
-	int bit;
-
-	if (root->zero == 0 && root->one == 0)
+	if (faxpeekbits(fb, 11) != 0)
+		return 0;
+	while (faxpeekbits(fb, 1) == 0)
 	{
-		//printf("\n");
-		return root->symbol;
+		if (faxskipbits(fb, 1))
+			return 0;
 	}
-	bit = getbit(bs);
-	//printf("%d", bit);
-	if (bit == 0 && root->zero)
-		return gethuffmansymbol(root->zero, bs);
-	else if (bit == 1 && root->one)
-		return gethuffmansymbol(root->one, bs);
-	else
-		return root->symbol;
+	faxskipbits(fb, 1);
+	return 1;
 }
 
-/*///////////////////////////////////////////////////////////////////////////////////////////////////*/
-/*   CCITT decoding section*/
-/*///////////////////////////////////////////////////////////////////////////////////////////////////*/
-#define CCITT_PASS 101
-#define CCITT_HORIZONTAL 102
-#define CCITT_VERTICAL_0 103
-#define CCITT_VERTICAL_R1 104
-#define CCITT_VERTICAL_R2 105
-#define CCITT_VERTICAL_R3 106
-#define CCITT_VERTICAL_L1 107
-#define CCITT_VERTICAL_L2 108
-#define CCITT_VERTICAL_L3 109
-#define CCITT_EXTENSION 110
-#define CCITT_ENDOFFAXBLOCK 110
-
-struct ccitt2dcode { int symbol; const char *code; };
-
-static struct ccitt2dcode ccitt2dtable[11] =
-{
-	{ CCITT_PASS, "0001" },
-	{ CCITT_HORIZONTAL, "001" },
-	{ CCITT_VERTICAL_0, "1" },
-	{ CCITT_VERTICAL_R1, "011" },
-	{ CCITT_VERTICAL_R2, "000011" },
-	{ CCITT_VERTICAL_R3, "0000011" },
-	{ CCITT_VERTICAL_L1, "010" },
-	{ CCITT_VERTICAL_L2, "000010" },
-	{ CCITT_VERTICAL_L3, "0000010" },
-	{ CCITT_EXTENSION, "0000001" },
-    { CCITT_ENDOFFAXBLOCK, "000000000001"}
-};
-
-struct ccittcode { int whitelen; const char *whitecode; int blacklen; const char *blackcode; };
-#define EOL -2
-static struct ccittcode ccitttable[105] =
-{
-	{ 0, "00110101", 0, "0000110111" },
-	{ 1, "000111", 1, "010" },
-	{ 2, "0111", 2, "11" },
-	{ 3, "1000", 3, "10" },
-	{ 4, "1011", 4, "011" },
-	{ 5, "1100", 5, "0011" },
-	{ 6, "1110", 6, "0010" },
-	{ 7, "1111", 7, "00011" },
-	{ 8, "10011", 8, "000101" },
-	{ 9, "10100", 9, "000100" },
-	{ 10, "00111", 10, "0000100" },
-	{ 11, "01000", 11, "0000101" },
-	{ 12, "001000", 12, "0000111" },
-	{ 13, "000011", 13, "00000100" },
-	{ 14, "110100", 14, "00000111" },
-	{ 15, "110101", 15, "000011000" },
-	{ 16, "101010", 16, "0000010111" },
-	{ 17, "101011", 17, "0000011000" },
-	{ 18, "0100111", 18, "0000001000" },
-	{ 19, "0001100", 19, "00001100111" },
-	{ 20, "0001000", 20, "00001101000" },
-	{ 21, "0010111", 21, "00001101100" },
-	{ 22, "0000011", 22, "00000110111" },
-	{ 23, "0000100", 23, "00000101000" },
-	{ 24, "0101000", 24, "00000010111" },
-	{ 25, "0101011", 25, "00000011000" },
-	{ 26, "0010011", 26, "000011001010" },
-	{ 27, "0100100", 27, "000011001011" },
-	{ 28, "0011000", 28, "000011001100" },
-	{ 29, "00000010", 29, "000011001101" },
-	{ 30, "00000011", 30, "000001101000" },
-	{ 31, "00011010", 31, "000001101001" },
-	{ 32, "00011011", 32, "000001101010" },
-	{ 33, "00010010", 33, "000001101011" },
-	{ 34, "00010011", 34, "000011010010" },
-	{ 35, "00010100", 35, "000011010011" },
-	{ 36, "00010101", 36, "000011010100" },
-	{ 37, "00010110", 37, "000011010101" },
-	{ 38, "00010111", 38, "000011010110" },
-	{ 39, "00101000", 39, "000011010111" },
-	{ 40, "00101001", 40, "000001101100" },
-	{ 41, "00101010", 41, "000001101101" },
-	{ 42, "00101011", 42, "000011011010" },
-	{ 43, "00101100", 43, "000011011011" },
-	{ 44, "00101101", 44, "000001010100" },
-	{ 45, "00000100", 45, "000001010101" },
-	{ 46, "00000101", 46, "000001010110" },
-	{ 47, "00001010", 47, "000001010111" },
-	{ 48, "00001011", 48, "000001100100" },
-	{ 49, "01010010", 49, "000001100101" },
-	{ 50, "01010011", 50, "000001010010" },
-	{ 51, "01010100", 51, "000001010011" },
-	{ 52, "01010101", 52, "000000100100" },
-	{ 53, "00100100", 53, "000000110111" },
-	{ 54, "00100101", 54, "000000111000" },
-	{ 55, "01011000", 55, "000000100111" },
-	{ 56, "01011001", 56, "000000101000" },
-	{ 57, "01011010", 57, "000001011000" },
-	{ 58, "01011011", 58, "000001011001" },
-	{ 59, "01001010", 59, "000000101011" },
-	{ 60, "01001011", 60, "000000101100" },
-	{ 61, "00110010", 61, "000001011010" },
-	{ 62, "00110011", 62, "000001100110" },
-	{ 63, "00110100", 63, "000001100111" },
-	{ 64, "11011", 64, "0000001111" },
-	{ 128, "10010", 128, "000011001000" },
-	{ 192, "010111", 192, "000011001001" },
-	{ 256, "0110111", 256, "000001011011" },
-	{ 320, "00110110", 320, "000000110011" },
-	{ 384, "00110111", 384, "000000110100" },
-	{ 448, "01100100", 448, "000000110101" },
-	{ 512, "01100101", 512, "0000001101100" },
-	{ 576, "01101000", 576, "0000001101101" },
-	{ 640, "01100111", 640, "0000001001010" },
-	{ 704, "011001100", 704, "0000001001011" },
-	{ 768, "011001101", 768, "0000001001100" },
-	{ 832, "011010010", 832, "0000001001101" },
-	{ 896, "011010011", 896, "0000001110010" },
-	{ 960, "011010100", 960, "0000001110011" },
-	{ 1024, "011010101", 1024, "0000001110100" },
-	{ 1088, "011010110", 1088, "0000001110101" },
-	{ 1152, "011010111", 1152, "0000001110110" },
-	{ 1216, "011011000", 1216, "0000001110111" },
-	{ 1280, "011011001", 1280, "0000001010010" },
-	{ 1344, "011011010", 1344, "0000001010011" },
-	{ 1408, "011011011", 1408, "0000001010100" },
-	{ 1472, "010011000", 1472, "0000001010101" },
-	{ 1536, "010011001", 1536, "0000001011010" },
-	{ 1600, "010011010", 1600, "0000001011011" },
-	{ 1664, "011000", 1664, "0000001100100" },
-	{ 1728, "010011011", 1728, "0000001100101" },
-	{ EOL, "000000000001", EOL, "00000000000" },
-	{ 1792, "00000001000", 1792, "00000001000" },
-	{ 1856, "00000001100", 1856, "00000001100" },
-	{ 1920, "00000001101", 1920, "00000001101" },
-	{ 1984, "000000010010", 1984, "000000010010" },
-	{ 2048, "000000010011", 2048, "000000010011" },
-	{ 2112, "000000010100", 2112, "000000010100" },
-	{ 2176, "000000010101", 2176, "000000010101" },
-	{ 2240, "00000001011", 2240, "000000010110" },
-	{ 2304, "000000010111", 2304, "000000010111" },
-	{ 2368, "000000011100", 2368, "000000011100" },
-	{ 2432, "000000011101", 2432, "000000011101" },
-	{ 2496, "000000011110", 2496, "000000011110" },
-	{ 2560, "000000011111", 2560, "000000011111" },
-};
-
-static unsigned char *ccittdecompress(unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int eol)
+/*
+  decompress Group 3 (CCITT RLE and T.4) fax data
+    Params: in - the compressed stream
+	        count - number of bytes in the stream
+			Nret - return for number of bytes decompressed
+			width, height - strip or tile dimensions
+			compression - COMPRESSION_CCITTRLE or COMPRESSION_CCITTFAX3
+			T4options - T4Options tag, 1 set for two-dimensional coding
+			lsbfirst - set if the FillOrder is lowest bit first
+  Returns: bitmap, rows padded to a byte, white 1, 0 on fail
+  CCITT RLE rows start on a byte boundary. T.4 rows are preceded by EOL 
+  codes, and with two-dimensional coding a tag bit saying which coding
+  the row uses.
+*/
+static unsigned char *ccittdecompress(const unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int compression, unsigned long T4options, int lsbfirst)
 {
-	HUFFNODE * whitetree = 0;
-	HUFFNODE * blacktree = 0;
-	BSTREAM *bs = 0;
-	BSTREAM *bout = 0;
-	int i, ii;
-	int err = 0;
-	int totlen;
-	int len;
-	int whitelen, blacklen;
+	FAXBITS fb;
 	unsigned char *answer = 0;
-	int Nout;
+	int *reference = 0;
+	int *current = 0;
+	int *temp;
+	int Nref = 0;
+	int Ncur;
+	int rowbytes;
+	int twod;
+	int i;
 
-	Nout = (width + 7) / 8 * height;
-	answer = malloc(Nout);
-	if (!answer)
-		goto out_of_memory;
-	bout = bstream(answer, Nout, BIG_ENDIAN);
-	if (!bout)
-		goto out_of_memory;
-	bs = bstream(in, count, LITTLE_ENDIAN);
-	if (!bs)
+	rowbytes = (width + 7) / 8;
+	answer = malloc(rowbytes * height);
+	reference = malloc((width + 3) * sizeof(int));
+	current = malloc((width + 3) * sizeof(int));
+	if (!answer || !reference || !current)
 		goto out_of_memory;
-	for (i = 0; i < 105; i++)
-		whitetree = addhuffmansymbol(whitetree, ccitttable[i].whitecode, ccitttable[i].whitelen, &err);
-	for (i = 0; i < 105; i++)
-		blacktree = addhuffmansymbol(blacktree, ccitttable[i].blackcode, ccitttable[i].blacklen, &err);
-	if (err)
-		goto out_of_memory;
-	
-	//debug(whitetree, 0);
-	if(eol)
-		len = gethuffmansymbol(whitetree, bs);
+	faxbitsinit(&fb, in, count, lsbfirst);
+
 	for (i = 0; i < height; i++)
 	{
-		totlen = 0;
-		while (totlen < width)
-		{ 
-			len = gethuffmansymbol(whitetree, bs);
-			if (len == -1)
-				goto parse_error;
-			if (len == -2)
-				whitelen = width - totlen;
-			else
-			  whitelen = len;
-			while (len >= 64)
-			{
-				len = gethuffmansymbol(whitetree, bs);
-				if (len == EOL || len == -1 || totlen + len + whitelen > width)
-					goto parse_error;
-				whitelen += len;
-			}
-			for (ii = 0; ii < whitelen; ii++)
-				writebit(bout, 0);
-			totlen += whitelen;
-			if (totlen >= width)
-				break;
-			len = gethuffmansymbol(blacktree, bs);
-			if (len < 0)
-				goto parse_error;
-			blacklen = len;
-			while (len >= 64)
-			{
-				len = gethuffmansymbol(blacktree, bs);
-				if (len == EOL || len == -1 || totlen + len + blacklen > width)
-					goto parse_error;
-				blacklen += len;
-			}
-			for (ii = 0; ii < blacklen; ii++)
-				writebit(bout, 1);
-			totlen += blacklen;
-
+		twod = 0;
+		if (compression == COMPRESSION_CCITTFAX3)
+		{
+			faxskipeol(&fb);
+			if (T4options & 0x01)
+				twod = faxgetbit(&fb) == 0;
 		}
-		//synchtobyte(bs);
-		if (width & 0x07)
+		if (twod)
 		{
-			for (ii = 0; ii < 8 - (width & 0x07); ii++)
-				writebit(bout, 0);
+			reference[Nref] = width;
+			reference[Nref + 1] = width;
+			reference[Nref + 2] = width;
+			Ncur = faxrow2d(&fb, width, reference, Nref, current);
 		}
-		if(eol)
-			gethuffmansymbol(whitetree, bs);
-		///synchtobyte(bs);
+		else
+			Ncur = faxrow1d(&fb, width, current);
+		if (Ncur < 0)
+			goto parse_error;
+		faxputrow(answer + i * rowbytes, width, current, Ncur);
+		if (compression == COMPRESSION_CCITTRLE)
+			faxskipbits(&fb, (fb.bitcount - fb.padbits) & 7);
+		temp = reference;
+		reference = current;
+		current = temp;
+		Nref = Ncur;
 	}
-	*Nret = Nout;
-	killhuffmantree(whitetree);
-	killhuffmantree(blacktree);
-	free(bs);
-	free(bout);
+	*Nret = rowbytes * height;
+	free(reference);
+	free(current);
 	return answer;
 parse_error:
 out_of_memory:
-	killhuffmantree(whitetree);
-	killhuffmantree(blacktree);
-	free(bs);
-	free(bout);
 	free(answer);
+	free(reference);
+	free(current);
 	return 0;
 }
 
-static unsigned char *ccittgroup4decompress(unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int eol)
+/*
+  decompress Group 4 (T.6) fax data
+    Params: in - the compressed stream
+	        count - number of bytes in the stream
+			Nret - return for number of bytes decompressed
+			width, height - strip or tile dimensions
+			lsbfirst - set if the FillOrder is lowest bit first
+  Returns: bitmap, rows padded to a byte, white 1, 0 on fail
+  Each row is coded as changing elements relative to the one above. If 
+  the data is corrupt, the rows decoded so far are returned and the rest
+  are left white.
+*/
+static unsigned char *ccittgroup4decompress(const unsigned char *in, unsigned long count, unsigned long *Nret, int width, int height, int lsbfirst)
 {
-	unsigned char *reference;
-	unsigned char *current;
-	unsigned char *temp;
+	FAXBITS fb;
+	unsigned char *answer = 0;
+	int *reference = 0;
+	int *current = 0;
+	int *temp;
+	int Nref = 0;
+	int Ncur;
+	int rowbytes;
 	int i;
-	int a0;
-	int a1;
-	int a2;
-	int a1span, a2span;
-	int seg;
-	int b1, b2;
-	HUFFNODE * twodtree = 0;
-	HUFFNODE * whitetree = 0;
-	HUFFNODE * blacktree = 0;
-	BSTREAM *bs = 0;
-	BSTREAM *bout = 0;
-	unsigned long Nout;
-	unsigned char *answer;
-	int err =0;
-	int mode;
-	int colour;
-
-	Nout = (width + 7) / 8 * height;
-	answer = malloc(Nout);
-	if (!answer)
-		goto out_of_memory;
-	//debug memset
-	memset(answer, 0, Nout);
-	bout = bstream(answer, Nout, BIG_ENDIAN);
-	if (!bout)
-		goto out_of_memory;
-	bs = bstream(in, count, eol ? LITTLE_ENDIAN : BIG_ENDIAN);
-	if (!bs)
-		goto out_of_memory;
-	for (i = 0; i < 105; i++)
-		whitetree = addhuffmansymbol(whitetree, ccitttable[i].whitecode, ccitttable[i].whitelen, &err);
-	for (i = 0; i < 105; i++)
-		blacktree = addhuffmansymbol(blacktree, ccitttable[i].blackcode, ccitttable[i].blacklen, &err);
-	for (i = 0; i < 11; i++)
-		twodtree = addhuffmansymbol(twodtree, ccitt2dtable[i].code, ccitt2dtable[i].symbol, &err);
-	if (err)
-		goto out_of_memory;
 
-
-
-	reference = malloc(width);
-	for (i = 0; i < width; i++)
-		reference[i] = 0;
-	current = malloc(width);
-	if (!current || !reference)
+	rowbytes = (width + 7) / 8;
+	answer = malloc(rowbytes * height);
+	reference = malloc((width + 3) * sizeof(int));
+	current = malloc((width + 3) * sizeof(int));
+	if (!answer || !reference || !current)
 		goto out_of_memory;
+	memset(answer, 0xFF, rowbytes * height);
+	faxbitsinit(&fb, in, count, lsbfirst);
 
-
-	if (eol)
-	{
-		int len;
-
-		while (getbit(bs) == 0)
-			continue;
-	}
 	for (i = 0; i < height; i++)
 	{
-		a0 = -1;
-		colour = 0;
-		while (a0 < width)
-		{
-			b1 = a0 +1;
-			while (b1 < width)
-			{
-				if (reference[b1] != colour && (b1 ==  0 || reference[b1] != reference[b1 - 1]) )
-					break;
-				b1++;
-			}
-			for (b2 = b1; b2 < width && reference[b2] == reference[b1]; b2++)
-				;
-
-			if (a0 == -1)
-				a0 = 0;
-			
-			mode = gethuffmansymbol(twodtree, bs);
-			a2 = -1;
-			switch (mode)
-			{
-			case CCITT_PASS:
-				a1 = b2;
-				break;
-			case CCITT_HORIZONTAL:
-				a1span = 0;
-				a2span = 0;
-				if (colour == 0)
-				{
-					do
-					{
-						seg = gethuffmansymbol(whitetree, bs);
-						a1span += seg;
-					} while (seg >= 64 && a0 + a1span <= width);
-
-					do
-					{
-						seg = gethuffmansymbol(blacktree, bs);
-						a2span += seg;
-					} while (seg >= 64 && a0 + a1span <= width);
-				}
-				else
-				{
-					do
-					{
-						seg = gethuffmansymbol(blacktree, bs);
-						a1span += seg;
-					} while (seg >= 64 && a0 + a1span  <= width);
-
-					do
-					{
-						seg = gethuffmansymbol(whitetree, bs);
-						a2span += seg;
-					} while (seg >= 64 && a0 + a1span + a2span <= width);
-				}
-				a1 = a0 + a1span;
-				a2 = a1 + a2span;
-				if (a1 > width)
-				{
-					//printf("Bad span1 %d span2 %d here\n", a1span, a2span);
-					goto parse_error;
-				}
-				break;
-			case CCITT_VERTICAL_0:
-				a1 = b1;
-				break;
-			case CCITT_VERTICAL_R1:
-				a1 = b1 + 1;
-				break;
-			case CCITT_VERTICAL_R2:
-				a1 = b1 + 2;
-				break;
-			case CCITT_VERTICAL_R3:
-				a1 = b1 + 3;
-				break;
-			case CCITT_VERTICAL_L1:
-				a1 = b1 - 1;
-				break;
-			case CCITT_VERTICAL_L2:
-				a1 = b1 - 2;
-				break;
-			case CCITT_VERTICAL_L3:
-				a1 = b1 - 3;
-				break;
-			case CCITT_ENDOFFAXBLOCK:
-				goto endofblock;
-				break;
-			default:
-				//printf("bad %d\n", mode);
-				//for (i = 0; i < 32; i++)
-					//printf("%d", getbit(bs));
-				//printf("\n");
-				//getchar();
-				goto parse_error;
-				break;
-			}
-			if (a1 <= a0 && a0 != 0 )
-			{
-				//printf("bad here a0 %d a1 %d\n", a0, a1);
-				//getchar();
-				goto parse_error;
-			}
-			//printf("a0 %d a1 %d a2 %d\n", a0, a1, a2);
-			if (a0 < 0 || a1 < 0)
-			{
-				goto parse_error;
-			}
-			while (a0 < a1 && a0 < width)
-			{
-				current[a0++] = colour;
-				writebit(bout, colour);
-			}
-			if (mode != CCITT_PASS)
-				colour ^= 1;
-			if(a1 >= 0)
-				a0 = a1;
-			if (a2 != -1)
-			{
-				while (a0 < a2 && a0 < width)
-				{
-					current[a0++] = colour;
-					writebit(bout, colour);
-				}
-				colour ^= 1;
-			}
-		}
-		//printf("here a0 %d\n", a0);
-		if (eol)
-		{
-			while (getbit(bs) == 0)
-				continue;
-			//printf("mode %d\n", getbit(bs));
-			//int endline = gethuffmansymbol(whitetree, bs);
-			//printf("end %d\n", endline);
-		}
+		reference[Nref] = width;
+		reference[Nref + 1] = width;
+		reference[Nref + 2] = width;
+		Ncur = faxrow2d(&fb, width, reference, Nref, current);
+		if (Ncur < 0)
+			break;
+		faxputrow(answer + i * rowbytes, width, current, Ncur);
 		temp = reference;
 		reference = current;
 		current = temp;
-		if (width % 8)
-		{
-			while (a0 % 8)
-			{
-				writebit(bout, 0);
-				a0++;
-			}
-		}
-
+		Nref = Ncur;
 	}
-endofblock:
-	*Nret = Nout;
-	killhuffmantree(twodtree);
-	killhuffmantree(whitetree);
-	killhuffmantree(blacktree);
+	*Nret = rowbytes * height;
 	free(reference);
 	free(current);
 	return answer;
-
-parse_error:
-	//printf("parse error\n");
-	//getchar();
-	*Nret = Nout;
-	return answer;
 out_of_memory:
+	free(answer);
+	free(reference);
+	free(current);
 	return 0;
 }
 
 /*
-load the raster data
-Params: out - return pointer for raster data, 0 for size run
-fp - pointer to an open file
-Nret - number of bytes read
-Returns: 0 on success, -1 on fail.
+  LZW decompressor
+  Params: out - output buffer
+          Nout - size of out, we stop when it is full
+          in - the compressed stream
+          count - number of bytes in the stream
+          Nret - return for number of bytes decoded
+  Returns: 0 on success, -1 on fail.
+  Every code's string has already been written to the output, so a
+  table entry is just its position and length there, and we copy 
+  strings rather than walking prefix chains. Codes come out of a bit 
+  buffer a byte refill at a time. Handles standard MSB-first codes with
+  early change, and the old LSB-first variant.
 */
-static int loadlzw(unsigned char *out, FILE *fp, unsigned long count, unsigned long *Nret)
+static int loadlzw(unsigned char *out, unsigned long Nout, const unsigned char *in, unsigned long count, unsigned long *Nret)
 {
-	int codesize;
-	//int block;
-	int clear;
-	int end;
-	int nextcode;
-	int codelen;
-	unsigned char *stream = 0;
-	int blen = 0;
-	BSTREAM *bs;
 	ENTRY *table;
-	int pos = 0;
-	int ii;
-	int len;
-	int second;
-	int first;
-	int tempcode;
-	int ch;
-
-	codesize = 8; 
-
-	clear = 1 << codesize;
-	end = clear + 1;
-	nextcode = end + 1;
-	codelen = codesize + 1;
+	unsigned long bitbuffer = 0;
+	int bitcount = 0;
+	unsigned long inpos = 0;
+	int msbfirst;
+	int codelen = 9;
+	int nextcode = 258;
+	int code;
+	unsigned long pos = 0;
+	unsigned long prevpos = 0;
+	unsigned long len;
+	unsigned long prevlen = 0;
+	unsigned long i;
+	const unsigned char *str;
 
-	stream = malloc(count);
-	if (!stream)
+	*Nret = 0;
+	if (count < 2)
+		return -1;
+	/* first code must be a clear, 256 */
+	if (in[0] == 0x80 && (in[1] & 0x80) == 0)
+		msbfirst = 1;
+	else if (in[0] == 0 && (in[1] & 0x01))
+		msbfirst = 0;
+	else
 		return -1;
-	fread(stream, count, 1, fp);
-
-	table = malloc(sizeof(ENTRY) * (1 << 12));
-
-	for (ii = 0; ii<nextcode; ii++)
-	{
-		table[ii].prefix = 0;
-		table[ii].len = 1;
-		table[ii].suffix = ii;
-	}
-	bs = bstream(stream, count, BIG_ENDIAN);
 
-	first = getbits(bs, codelen);
-	if (first != clear)
-	{
-		free(bs);
-		bs = bstream(stream, count, LITTLE_ENDIAN);
-		first = getbits(bs, codelen);
-		if (first != clear)
-			goto parse_error;
-	}
-	while (first == clear)
-	{
-		first = getbits(bs, codelen);
-	}
-	ch = first;
-	if (out)
-		out[0] = ch;
-	pos = 1;
+	table = malloc(sizeof(ENTRY) * 4096);
+	if (!table)
+		return -1;
 
-	while (1)
+	while (pos < Nout)
 	{
-		second = getbits(bs, codelen);
-		if (second < 0)
-			goto parse_error;
-		if (second == clear)
+		if (msbfirst)
 		{
-			nextcode = end + 1;
-			codelen = codesize + 1;
-			first = getbits(bs, codelen);
-
-			while (first == clear)
-				first = getbits(bs, codelen);
-			if (first == end)
+			while (bitcount <= 24 && inpos < count)
+			{
+				bitbuffer = (bitbuffer << 8) | in[inpos++];
+				bitcount += 8;
+			}
+			if (bitcount < codelen)
 				break;
-			ch = first;
-			if (out)
-				out[pos++] = first;
-			else
-				pos++;
-			continue;
+			bitcount -= codelen;
+			code = (int)(bitbuffer >> bitcount) & ((1 << codelen) - 1);
 		}
-		if (second == end)
+		else
 		{
-			break;
+			while (bitcount <= 24 && inpos < count)
+			{
+				bitbuffer |= (unsigned long) in[inpos++] << bitcount;
+				bitcount += 8;
+			}
+			if (bitcount < codelen)
+				break;
+			code = (int)bitbuffer & ((1 << codelen) - 1);
+			bitbuffer >>= codelen;
+			bitcount -= codelen;
 		}
 
-		if (second >= nextcode)
+		if (code == 256)
 		{
-			len = table[first].len;
-			//if (len + pos >= width * height)
-			//	break;
+			codelen = 9;
+			nextcode = 258;
+			prevlen = 0;
+			continue;
+		}
+		if (code == 257)
+			break;
 
-			tempcode = first;
-			for (ii = 0; ii<len; ii++)
-			{
-				if (out)
-					out[pos + len - ii - 1] = (unsigned char)table[tempcode].suffix;
-				tempcode = table[tempcode].prefix;
-			}
-			if (out)
-				out[pos + len] = (unsigned char)ch;
-			pos += len + 1;
+		if (code < 256)
+		{
+			out[pos] = (unsigned char) code;
+			len = 1;
 		}
-		else
+		else if (code < nextcode)
 		{
-			len = table[second].len;
-			//if (pos + len > width * height)
-				//break;
-			tempcode = second;
-
-			for (ii = 0; ii<len; ii++)
-			{
-				ch = table[tempcode].suffix;
-				if (out)
-					out[pos + len - ii - 1] = (unsigned char)table[tempcode].suffix;
-				tempcode = table[tempcode].prefix;
-			}
-			pos += len;
+			len = table[code].len;
+			if (len > Nout - pos)
+				len = Nout - pos;
+			str = out + table[code].offset;
+			if (len > 16)
+				memcpy(out + pos, str, len);
+			else
+				for (i = 0; i < len; i++)
+					out[pos + i] = str[i];
 		}
-
-		if (nextcode < 4096)
+		else if (code == nextcode && prevlen > 0)
 		{
-			table[nextcode].prefix = first;
-			table[nextcode].len = table[first].len + 1;
-			table[nextcode].suffix = ch;
+			/* previous string plus its first character. The source
+			   runs up to our start, so copy forwards byte by byte */
+			len = prevlen + 1;
+			if (len > Nout - pos)
+				len = Nout - pos;
+			for (i = 0; i < len; i++)
+				out[pos + i] = out[prevpos + i];
+		}
+		else
+			goto parse_error;
 
+		if (prevlen > 0 && nextcode < 4096)
+		{
+			table[nextcode].offset = prevpos;
+			table[nextcode].len = (int) prevlen + 1;
 			nextcode++;
-			if (nextcode == (1 << codelen) - ((bs->endianness == BIG_ENDIAN) ? 1 : 0))
-			{
+			if (nextcode + msbfirst >= (1 << codelen) && codelen < 12)
 				codelen++;
-
-				if (codelen == 13)
-					codelen = 12;
-			}
 		}
-
-		first = second;
+		prevpos = pos;
+		prevlen = len;
+		pos += len;
 	}
 
-
 	free(table);
-	free(stream);
-
 	*Nret = pos;
 
 	return 0;
 parse_error:
 	free(table);
-	free(stream);
+	*Nret = pos;
 	return -1;
 }
 
@@ -2908,7 +6188,7 @@ Params: data - the data buffer
 N - size of data buffer
 Returns: constructed object
 */
-static BSTREAM *bstream(unsigned char *data, int N, int endianness)
+static BSTREAM *bstream(const unsigned char *data, int N, int endianness)
 {
 	BSTREAM *answer = malloc(sizeof(BSTREAM));
 
@@ -2999,33 +6279,6 @@ static int getbits(BSTREAM *bs, int nbits)
 	return answer;
 }
 
-static int synchtobyte(BSTREAM *bs)
-{
-	if (bs->endianness == BIG_ENDIAN)
-	{
-		while (bs->bit != 0x80 && bs->pos < bs->N)
-			getbit(bs);
-	}
-	else
-	{
-		while (bs->bit != 0x01 && bs->pos < bs->N)
-			getbit(bs);
-	}
-	return 0;
-}
-
-static int writebit(BSTREAM *bs, int bit)
-{
-	if (bs->pos >= bs->N)
-		return -1;
-	if (bit)
-		bs->data[bs->pos] |= bs->bit;
-	else
-		bs->data[bs->pos] &= (unsigned char)~bs->bit;
-	getbit(bs);
-	return 0;
-}
-
 /*
   sizeof() for a TIFF data type
   we default to 1
@@ -3039,6 +6292,8 @@ static int tiffsizeof(int datatype)
 	case TAG_SHORT: return 2;
 	case TAG_LONG: return 4;
 	case TAG_RATIONAL: return 8;
+	case TAG_LONG8: return 8;
+	case TAG_IFD8: return 8;
 	default:
 		return 1;
 	}
@@ -3047,19 +6302,32 @@ static int tiffsizeof(int datatype)
 /*
   load tag header
   Params: type - big endian or litle endian
-          fp - file pointer
+          src - the source
+		  offset - position of the image file directory
 		  Ntags - return for number of tags
   Returns: the tags, 0 on error
 */
-static TAG *floadheader(int type, FILE *fp, int *Ntags)
+static TAG *loadheader(int type, TIFFSOURCE *src, TIFFOFFSET offset, int *Ntags)
 {
-	TAG *answer;
-	int N; 
+	TAG *answer = 0;
+	const unsigned char *ifd = 0;
+	unsigned long len;
+	int entrysize = src->bigtiff ? 20 : 12;
+	int N = 0;
 	int i;
 	int err;
 
-	N = fget16u(type, fp);
+	N = (int) readifdcount(src, type, offset);
+	if (N < 0)
+	{
+		N = 0;
+		goto out_of_memory;
+	}
 	//printf("%d tags\n", N);
+	len = N * entrysize;
+	ifd = fetchbytes(src, offset + (src->bigtiff ? 8 : 2), &len);
+	if (!ifd || len < (unsigned long) N * entrysize)
+		goto out_of_memory;
 	answer = malloc(N * sizeof(TAG));
 	if (!answer)
 		goto out_of_memory;
@@ -3071,7 +6339,7 @@ static TAG *floadheader(int type, FILE *fp, int *Ntags)
 
 	for (i = 0; i < N; i++)
 	{
-		err = floadtag(&answer[i], type, fp);
+		err = loadtag(&answer[i], type, src, ifd + i * entrysize);
 		if (err)
 			goto out_of_memory;
 		/*
@@ -3084,9 +6352,11 @@ static TAG *floadheader(int type, FILE *fp, int *Ntags)
 			*/
 
 	}
+	releasebytes(src, ifd);
 	*Ntags = N;
 	return answer;
 out_of_memory:
+	releasebytes(src, ifd);
 	killtags(answer, N);
 	return 0;
 }
@@ -3112,69 +6382,81 @@ static void killtags(TAG *tags, int N)
 }
 
 /*
-  Load a tag froma file
+  Load a tag from its directory entry
     tag - the tag
 	type - big endian or little endia
-	fp - pointer to file
+	src - the source, for data which doesn't fit in the entry
+	entry - the 12 byte directory entry (20 bytes for BigTIFF)
   Returns: 0 on success -1 on out of memory, -2 on parse error
 */
-static int floadtag(TAG *tag, int type, FILE *fp)
+static int loadtag(TAG *tag, int type, TIFFSOURCE *src, const unsigned char *entry)
 {
-	unsigned long offset;
-	unsigned long pos;
+	const unsigned char *data = 0;
+	const unsigned char *value;
 	unsigned long num, denom;
 	unsigned long datasize;
+	TIFFOFFSET count;
+	unsigned long N;
 	unsigned long i;
 
-	tag->tagid = fget16(type, fp);
-	tag->datatype = fget16(type, fp);
-	tag->datacount = fget32(type, fp);
+	tag->tagid = memread16(type, entry);
+	tag->datatype = memread16(type, entry + 2);
+	tag->scalar = 0;
 	tag->vector = 0;
 	tag->ascii = 0;
 	tag->bad = 0;
+	if (src->bigtiff)
+	{
+		count = memread64(type, entry + 4);
+		value = entry + 12;
+	}
+	else
+	{
+		count = memread32(type, entry + 4);
+		value = entry + 8;
+	}
+	tag->datacount = (unsigned long) count;
 
 	//printf("tag %d type %d N %ld ", tag->tagid, tag->datatype, tag->datacount);
+	if (count > ULONG_MAX / 8)
+		goto parse_error;
 	datasize = tag->datacount * tiffsizeof(tag->datatype);
+	if (datasize <= (unsigned long) (src->bigtiff ? 8 : 4))
+		data = value;
+	else
+	{
+		N = datasize;
+		data = fetchbytes(src, src->bigtiff ? memread64(type, value) : memread32(type, value), &N);
+		if (!data)
+			goto out_of_memory;
+		if (N < datasize)
+			goto parse_error;
+	}
 	if (tag->datacount == 1)
 	{
 		switch (tag->datatype)
 		{
 		case TAG_BYTE:
-			tag->scalar = (double)fgetc(fp);
-			fgetc(fp);
-			fgetc(fp);
-			fgetc(fp);
+			tag->scalar = (double)data[0];
 			break;
 		case TAG_ASCII:
-			if (datasize > 4)
-			{
-				offset = fget32(type, fp);
-				pos = ftell(fp);
-				fseek(fp, offset, SEEK_SET);
-			}
-			tag->ascii = freadasciiz(fp);
-			if (datasize > 4)
-			{
-				fseek(fp, pos, SEEK_SET);
-			}
+			tag->ascii = copyasciiz(data, datasize);
 			break;
 		case TAG_SHORT:
-			tag->scalar = (double) fget16u(type, fp);
-			fgetc(fp);
-			fgetc(fp);
+			tag->scalar = (double) memread16(type, data);
 			break;
 		case TAG_LONG:
-			tag->scalar = (double) fget32u(type, fp);
+			tag->scalar = (double) memread32(type, data);
+			break;
+		case TAG_LONG8:
+		case TAG_IFD8:
+			tag->scalar = (double) memread64(type, data);
 			break;
 		case TAG_RATIONAL:
-			offset = fget32u(type, fp);
-			pos = ftell(fp);
-			fseek(fp, offset, SEEK_SET);
-			num = fget32u(type, fp);
-			denom = fget32u(type, fp);
+			num = memread32(type, data);
+			denom = memread32(type, data + 4);
 			if (denom)
 				tag->scalar = ((double)num) / denom;
-			fseek(fp, pos, SEEK_SET);
 			break;
 		default:
 			tag->bad = -1;
@@ -3183,22 +6465,16 @@ static int floadtag(TAG *tag, int type, FILE *fp)
 	}
 	else
 	{
-		if (datasize > 4)
-		{
-			offset = fget32(type, fp);
-			pos = ftell(fp);
-			fseek(fp, offset, SEEK_SET);
-		}
 		switch (tag->datatype)
 		{
 		case TAG_BYTE:
 			tag->vector = malloc(datasize);
 			if (!tag->vector)
 				goto out_of_memory;
-			fread(tag->vector, 1, datasize, fp);
+			memcpy(tag->vector, data, datasize);
 			break;
 		case TAG_ASCII:
-			tag->ascii = freadasciiz(fp);
+			tag->ascii = copyasciiz(data, datasize);
 			if (!tag->ascii)
 				goto out_of_memory;
 			break;
@@ -3207,14 +6483,22 @@ static int floadtag(TAG *tag, int type, FILE *fp)
 			if (!tag->vector)
 				goto out_of_memory;
 			for (i = 0; i < tag->datacount; i++)
-				((unsigned short *)tag->vector)[i] = fget16u(type, fp);
+				((unsigned short *)tag->vector)[i] = memread16(type, data + i * 2);
 			break;
 		case TAG_LONG:
 			tag->vector = malloc(tag->datacount * sizeof(long));
 			if (!tag->vector)
 				goto out_of_memory;
 			for (i = 0; i < tag->datacount; i++)
-				((unsigned long *)tag->vector)[i] = fget32u(type, fp);
+				((unsigned long *)tag->vector)[i] = memread32(type, data + i * 4);
+			break;
+		case TAG_LONG8:
+		case TAG_IFD8:
+			tag->vector = malloc(tag->datacount * sizeof(TIFFOFFSET));
+			if (!tag->vector)
+				goto out_of_memory;
+			for (i = 0; i < tag->datacount; i++)
+				((TIFFOFFSET *)tag->vector)[i] = memread64(type, data + i * 8);
 			break;
 		case TAG_RATIONAL:
 			tag->vector = malloc(tag->datacount * sizeof(double));
@@ -3222,31 +6506,29 @@ static int floadtag(TAG *tag, int type, FILE *fp)
 				goto out_of_memory;
 			for (i = 0; i < tag->datacount; i++)
 			{
-				num = fget32u(type, fp);
-				denom = fget32u(type, fp);
-				if (denom)
-				((double *)tag->vector)[i] = ((double)num) / denom;
+				num = memread32(type, data + i * 8);
+				denom = memread32(type, data + i * 8 + 4);
+				((double *)tag->vector)[i] = denom ? ((double)num) / denom : 0.0;
 			}
 			break;
 		default:
-			fgetc(fp);
-			fgetc(fp);
-			fgetc(fp);
-			fgetc(fp);
 			tag->bad = -1;
 		}
-		if (datasize > 4)
-		{
-			fseek(fp, pos, SEEK_SET);
-		}
 	}
 
-	if (feof(fp))
-		return -2;
+	if (data != value)
+		releasebytes(src, data);
 	return 0;
 out_of_memory:
+	if (data != value)
+		releasebytes(src, data);
 	tag->bad = -1;
 	return -1;
+parse_error:
+	if (data != value)
+		releasebytes(src, data);
+	tag->bad = -1;
+	return -2;
 }
 
 /*
@@ -3268,11 +6550,14 @@ static double tag_getentry(TAG *tag, int index)
 	case TAG_BYTE:
 		return (double)((unsigned char *)tag->vector)[index];
 	case TAG_ASCII:
-		return (double)((char *)tag->vector)[index];
+		return tag->ascii ? (double)tag->ascii[index] : -1;
 	case TAG_SHORT:
 		return (double)((unsigned short *)tag->vector)[index];
 	case TAG_LONG:
 		return (double)((unsigned long *)tag->vector)[index];
+	case TAG_LONG8:
+	case TAG_IFD8:
+		return (double)((TIFFOFFSET *)tag->vector)[index];
 	case TAG_RATIONAL:
 		return (double)((double *)tag->vector)[index];
 	default:
@@ -3280,6 +6565,33 @@ static double tag_getentry(TAG *tag, int index)
 	}
 }
 
+/*
+  read a file offset or byte count from a tag. Unlike tag_getentry()
+  this keeps all 64 bits of a BigTIFF value.
+    Tag - the tag read in
+	index - index of data item in tag
+Returns: value, 0 if it isn't there
+*/
+static TIFFOFFSET tag_getoffset(TAG *tag, int index)
+{
+	if (index < 0 || (unsigned long) index >= tag->datacount || tag->bad)
+		return 0;
+	if (tag->datacount == 1)
+		return tag->scalar > 0 ? (TIFFOFFSET) tag->scalar : 0;
+	switch (tag->datatype)
+	{
+	case TAG_SHORT:
+		return ((unsigned short *)tag->vector)[index];
+	case TAG_LONG:
+		return ((unsigned long *)tag->vector)[index];
+	case TAG_LONG8:
+	case TAG_IFD8:
+		return ((TIFFOFFSET *)tag->vector)[index];
+	default:
+		return 0;
+	}
+}
+
 /*
   safe paste function
      rgba - destination buffer
@@ -3353,149 +6665,111 @@ static void greypaste(unsigned char *grey, int width, int height, unsigned char
     
 }
 
-static void pasteflexible(unsigned char *buff, int width, int height, int depth, unsigned char *tile, int twidth, int theight, int tdepth, int x, int y)
-{
-    int ix, iy;
-    int tx, ty;
-    int isample;
-    int mindepth;
-    
-    mindepth = depth < tdepth ? depth : tdepth;
-    for(ty =0;ty<theight;ty++)
-    {
-        iy = y + ty;
-        if(iy < 0 || iy >= height)
-            continue;
-        for (tx = 0; tx < twidth; tx++)
-        {
-            ix = x + tx;
-            if (ix < 0)
-                continue;
-            if (ix >= width)
-                break;
-            
-            for(isample=0;isample<mindepth;isample++)
-                buff[(iy*width + ix)*depth + isample] = tile[(ty*twidth + tx)*tdepth +isample];
-        }
-        
-    }
-}
 
 
-unsigned long fget32u(int type, FILE *fp)
+/*
+  get a span of bytes from the source
+    Params: src - the source
+	        offset - file position of the first byte
+			N - number of bytes wanted, return for number available
+  Returns: the bytes, 0 on out of memory. Release with releasebytes()
+  A memory source hands back a pointer into its buffer, otherwise we
+  have to read into a temporary.
+*/
+static const unsigned char *fetchbytes(TIFFSOURCE *src, TIFFOFFSET offset, unsigned long *N)
 {
-	int a, b, c, d;
-
-	a = fgetc(fp);
-	b = fgetc(fp);
-	c = fgetc(fp);
-	d = fgetc(fp);
+	unsigned char *answer;
+	STATS_TIMER(t0);
 
-	if (type == BIG_ENDIAN)
-		return (a << 24) | (b << 16) | (c << 8) | d;
-	else
-		return (d << 24) | (c << 16) | (b << 8) | a;
+	if (src->data)
+	{
+		if (offset > src->N)
+			offset = src->N;
+		if (*N > src->N - offset)
+			*N = src->N - offset;
+		return src->data + offset;
+	}
+	answer = malloc(*N ? *N : 1);
+	if (!answer)
+		return 0;
+	STATS_ADD(src->stats, allocations, 1);
+	STATS_START(t0);
+	*N = (unsigned long) (*src->io.read)(src->io.ptr, offset, *N, answer);
+	STATS_STOP(src->stats, io_ns, t0);
+	STATS_ADD(src->stats, reads, 1);
+	STATS_ADD(src->stats, bytesread, *N);
+	return answer;
 }
 
-unsigned int fget16u(int type, FILE *fp)
+/*
+  release the return from fetchbytes()
+*/
+static void releasebytes(TIFFSOURCE *src, const unsigned char *bytes)
 {
-	int a, b;
-	a = fgetc(fp);
-	b = fgetc(fp);
-	if (type == BIG_ENDIAN)
-		return (a << 8) | b;
-	else
-		return (b << 8) | a;
+	if (!src->data)
+		free((void *) bytes);
 }
 
-
-static int fget16(int type, FILE *fp)
+/*
+  TIFFIO reader for a stdio stream
+*/
+static size_t stdioread(void *ptr, TIFFOFFSET offset, size_t N, unsigned char *dest)
 {
-	if (type == BIG_ENDIAN)
-		return fget16be(fp);
-	else
-		return fget16le(fp);
+	FILE *fp = ptr;
+
+#if defined(_WIN32)
+	if (offset > _I64_MAX || _fseeki64(fp, (__int64) offset, SEEK_SET) != 0)
+		return 0;
+#elif defined(LOADTIFF_MMAP)
+	/* POSIX, so we have fseeko() */
+	if ((TIFFOFFSET)(off_t) offset != offset || (off_t) offset < 0 || fseeko(fp, (off_t) offset, SEEK_SET) != 0)
+		return 0;
+#else
+	if (offset > LONG_MAX || fseek(fp, (long) offset, SEEK_SET) != 0)
+		return 0;
+#endif
+	return fread(dest, 1, N, fp);
 }
 
-static long fget32(int type, FILE *fp)
+static unsigned long memread32(int type, const unsigned char *bytes)
 {
 	if (type == BIG_ENDIAN)
-		return fget32be(fp);
+		return ((unsigned long)bytes[0] << 24) | ((unsigned long)bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
 	else
-		return fget32le(fp);
-}
-
-static int fget16be(FILE *fp)
-{
-	int c1, c2;
-
-	c2 = fgetc(fp);
-	c1 = fgetc(fp);
-
-	return ((c2 ^ 128) - 128) * 256 + c1;
-}
-
-static long fget32be(FILE *fp)
-{
-	int c1, c2, c3, c4;
-
-	c4 = fgetc(fp);
-	c3 = fgetc(fp);
-	c2 = fgetc(fp);
-	c1 = fgetc(fp);
-	return ((c4 ^ 128) - 128) * 256 * 256 * 256 + c3 * 256 * 256 + c2 * 256 + c1;
+		return ((unsigned long)bytes[3] << 24) | ((unsigned long)bytes[2] << 16) | (bytes[1] << 8) | bytes[0];
 }
 
-static int fget16le(FILE *fp)
+static TIFFOFFSET memread64(int type, const unsigned char *bytes)
 {
-	int c1, c2;
-
-	c1 = fgetc(fp);
-	c2 = fgetc(fp);
+	TIFFOFFSET answer = 0;
+	int i;
 
-	return ((c2 ^ 128) - 128) * 256 + c1;
+	for (i = 0; i < 8; i++)
+		answer = (answer << 8) | bytes[type == BIG_ENDIAN ? i : 7 - i];
+	return answer;
 }
 
-static long fget32le(FILE *fp)
+static unsigned int memread16(int type, const unsigned char *bytes)
 {
-	int c1, c2, c3, c4;
-
-	c1 = fgetc(fp);
-	c2 = fgetc(fp);
-	c3 = fgetc(fp);
-	c4 = fgetc(fp);
-	return ((c4 ^ 128) - 128) * 256 * 256 * 256 + c3 * 256 * 256 + c2 * 256 + c1;
+	if (type == BIG_ENDIAN)
+		return (bytes[0] << 8) | bytes[1];
+	else
+		return (bytes[1] << 8) | bytes[0];
 }
 
-static char *freadasciiz(FILE *fp)
+/*
+  copy an ascii string out of a tag, making sure it is nul-terminated
+*/
+static char *copyasciiz(const unsigned char *bytes, unsigned long N)
 {
-	char *buff;
-	char *temp;
-	size_t bufflen = 64;
-	size_t N = 0;
-	int ch;
-
-	buff = malloc(bufflen);
-	while ((ch = fgetc(fp)) != EOF)
-	{
-		buff[N++] = ch;
-		if (N == bufflen)
-		{
-			if ((bufflen + bufflen / 2) < bufflen)
-				goto out_of_memory;
-			temp = realloc(buff, bufflen + bufflen / 2);
-			if (!temp)
-				goto out_of_memory;
-			buff = temp;
-			bufflen = bufflen + bufflen / 2;
-		}
-		if (ch == 0)
-			return realloc(buff, N);
-	}
+	char *answer;
 
-out_of_memory:
-	free(buff);
-	return 0;
+	answer = malloc(N + 1);
+	if (!answer)
+		return 0;
+	memcpy(answer, bytes, N);
+	answer[N] = 0;
+	return answer;
 }
 
 /*
@@ -3506,11 +6780,11 @@ out_of_memory:
 *              first
 *
 */
-static double memreadieee754(unsigned char *buff, int bigendian)
+static double memreadieee754(const unsigned char *mem, int bigendian)
 {
+	unsigned char buff[8];
 	int i;
 	double fnorm = 0.0;
-	unsigned char temp;
 	int sign;
 	int exponent;
 	double bitval;
@@ -3521,15 +6795,8 @@ static double memreadieee754(unsigned char *buff, int bigendian)
 	double answer;
 
 	/* just reverse if not big-endian*/
-	if (!bigendian)
-	{
-		for (i = 0; i < 4; i++)
-		{
-			temp = buff[i];
-			buff[i] = buff[8 - i - 1];
-			buff[8 - i - 1] = temp;
-		}
-	}
+	for (i = 0; i < 8; i++)
+		buff[i] = bigendian ? mem[i] : mem[8 - i - 1];
 	sign = buff[0] & 0x80 ? -1 : 1;
 	/* exponet in raw format*/
 	exponent = ((buff[0] & 0x7F) << 4) | ((buff[1] & 0xF0) >> 4);
@@ -3591,7 +6858,7 @@ static double memreadieee754(unsigned char *buff, int bigendian)
 }
 
 
-static float memreadieee754f(unsigned char*mem, int bigendian)
+static float memreadieee754f(const unsigned char*mem, int bigendian)
 {
 	unsigned long buff = 0;
 	unsigned long buff2 = 0;
@@ -3684,6 +6951,11 @@ version of his software, so please don't remove.
 The only change I've made is to separate out the fucntions and mark the
 public ones as static (Malcolm)
 
+Altered since: Huffman codes are decoded through lookup tables instead
+of a bit at a time walk of a 2D tree, bits come from a word-wide buffer
+rather than being read singly, and long matches are copied a word at
+a time. ERROR_BREAK no longer exits the program.
+
 LodePNG version 20120729
 
 Copyright (c) 2005-2012 Lode Vandevenne
@@ -3709,26 +6981,89 @@ distribution.
 */
 
 /// Stream
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+  bits are read lowest first. The buffer is topped up a word at a time,
+  and past the end of the data we feed in zeros, so the caller checks
+  the bits used against the data size.
+*/
+typedef struct BitReader
+{
+	const unsigned char* data;
+	size_t size; /*size of data in bytes*/
+	size_t pos; /*next byte to load into the buffer, may run past size*/
+	size_t buffer; /*bits not yet used, next bit lowest*/
+	unsigned nbits; /*number of valid bits in buffer*/
+} BitReader;
+
+#define WORDBITS (sizeof(size_t) * 8)
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+static void initBitReader(BitReader* reader, const unsigned char* data, size_t size)
 {
-	unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-	(*bitpointer)++;
-	return result;
+	reader->data = data;
+	reader->size = size;
+	reader->pos = 0;
+	reader->buffer = 0;
+	reader->nbits = 0;
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+/*fill the buffer to at least WORDBITS - 8 bits*/
+static void refillBits(BitReader* reader)
 {
-	unsigned result = 0, i;
-	for (i = 0; i < nbits; i++)
+	size_t word = 0;
+	unsigned i;
+
+	if (reader->pos + sizeof(size_t) <= reader->size)
+	{
+		for (i = 0; i < sizeof(size_t); i++)
+			word |= (size_t)reader->data[reader->pos + i] << (i * 8);
+		/*bits of a partly loaded byte get or-ed in again next time, harmless*/
+		reader->buffer |= word << reader->nbits;
+		reader->pos += (WORDBITS - 1 - reader->nbits) >> 3;
+		reader->nbits |= WORDBITS - 8;
+	}
+	else
 	{
-		result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-		(*bitpointer)++;
+		while (reader->nbits <= WORDBITS - 8)
+		{
+			if (reader->pos < reader->size)
+				reader->buffer |= (size_t)reader->data[reader->pos] << reader->nbits;
+			reader->pos++;
+			reader->nbits += 8;
+		}
 	}
+}
+
+/*make sure there are n bits in the buffer, n at most 24*/
+static void ensureBits(BitReader* reader, unsigned n)
+{
+	if (reader->nbits < n) refillBits(reader);
+}
+
+static unsigned peekBits(const BitReader* reader, unsigned n)
+{
+	return (unsigned)(reader->buffer & (((size_t)1 << n) - 1));
+}
+
+static void advanceBits(BitReader* reader, unsigned n)
+{
+	reader->buffer >>= n;
+	reader->nbits -= n;
+}
+
+static unsigned readBits(BitReader* reader, unsigned n)
+{
+	unsigned result;
+	ensureBits(reader, n);
+	result = peekBits(reader, n);
+	advanceBits(reader, n);
 	return result;
 }
 
+/*number of bits used so far, more than size * 8 if we ran off the end*/
+static size_t bitsUsed(const BitReader* reader)
+{
+	return reader->pos * 8 - reader->nbits;
+}
 
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / Adler32                                                                  */
@@ -3780,7 +7115,7 @@ typedef struct LodePNGDecompressSettings
 } LodePNGDecompressSettings;
 #endif
 
-#define ERROR_BREAK(c) exit(0)
+#define ERROR_BREAK(code) { error = (code); break; }
 
 #define mymalloc malloc
 #define myfree free
@@ -3827,26 +7162,36 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-	unsigned* tree2d;
 	unsigned* tree1d;
 	unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
 	unsigned maxbitlen; /*maximum number of bits a single code can get*/
 	unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+	/*
+	  decoding table, indexed by the next FIRSTBITS bits. An entry is a 
+	  code length and symbol, or for longer codes, the largest code 
+	  length and the offset of a subtable indexed by the following bits
+	*/
+	unsigned char* table_len;
+	unsigned short* table_value;
 } HuffmanTree;
 
+/*bits in the first level of the decoding table*/
+#define FIRSTBITS 10
+/*table_len value for bit patterns which aren't a code*/
+#define INVALIDBITS 16
+
 
 static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-	const unsigned char* in, size_t* bp, size_t inlength);
+	BitReader* reader, size_t inlength);
 static unsigned generateFixedLitLenTree(HuffmanTree* tree);
 static unsigned generateFixedDistanceTree(HuffmanTree* tree);
 static void HuffmanTree_init(HuffmanTree* tree);
 static void HuffmanTree_cleanup(HuffmanTree* tree);
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d);
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree);
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d);
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree);
 static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* bitlen,
 	size_t numcodes, unsigned maxbitlen);
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-	const HuffmanTree* codetree, size_t inbitlength);
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree);
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
@@ -3856,10 +7201,14 @@ typedef struct ucvector
   unsigned char* data;
   size_t size; /*used size*/
   size_t allocsize; /*allocated size*/
+  unsigned bounded; /*caller's buffer of allocsize bytes, never reallocated*/
 } ucvector;
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength);
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
+/*not an error, a bounded output buffer is full so decoding stopped*/
+#define OUTPUT_FULL 1000
+
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos, size_t inlength);
+static unsigned inflateHuffmanBlock(ucvector* out, BitReader* reader,
 	size_t* pos, size_t inlength, unsigned btype);
 
 static unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -3868,6 +7217,7 @@ static unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
 static unsigned lodepng_inflatev(ucvector* out,
 	const unsigned char* in, size_t insize,
 	const LodePNGDecompressSettings* settings);
+static unsigned lodepng_zlib_checkheader(const unsigned char* in, size_t insize);
 
 
 static void ucvector_cleanup(void* p)
@@ -3900,6 +7250,7 @@ static void ucvector_init(ucvector* p)
 {
 	p->data = NULL;
 	p->size = p->allocsize = 0;
+	p->bounded = 0;
 }
 
 /*you can both convert from vector to buffer&size and vica versa. If you use
@@ -3908,6 +7259,15 @@ static void ucvector_init_buffer(ucvector* p, unsigned char* buffer, size_t size
 {
 	p->data = buffer;
 	p->allocsize = p->size = size;
+	p->bounded = 0;
+}
+
+/*use the caller's buffer of fixed size. Inflate stops when it is full*/
+static void ucvector_init_bounded(ucvector* p, unsigned char* buffer, size_t size)
+{
+	p->data = buffer;
+	p->allocsize = p->size = size;
+	p->bounded = 1;
 }
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -3975,38 +7335,53 @@ static void uivector_init(uivector* p)
 
 
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos, size_t inlength)
 {
 	/*go to first boundary of byte*/
 	size_t p;
-	unsigned LEN, NLEN, n, error = 0;
-	while (((*bp) & 0x7) != 0) (*bp)++;
-	p = (*bp) / 8; /*byte position*/
+	unsigned LEN, NLEN, error = 0;
+	const unsigned char* in = reader->data;
+	advanceBits(reader, reader->nbits & 7);
+	p = reader->pos - reader->nbits / 8; /*byte position*/
 
 	/*read LEN (2 bytes) and NLEN (2 bytes)*/
-	if (p >= inlength - 4) return 52; /*error, bit pointer will jump past memory*/
+	if (p + 4 >= inlength) return 52; /*error, bit pointer will jump past memory*/
 	LEN = in[p] + 256 * in[p + 1]; p += 2;
 	NLEN = in[p] + 256 * in[p + 1]; p += 2;
 
 	/*check if 16-bit NLEN is really the one's complement of LEN*/
 	if (LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
 
-	if ((*pos) + LEN >= out->size)
+	/*read the literal data: LEN bytes are now stored in the out buffer*/
+	if (p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
+
+	if (out->bounded)
+	{
+		if (LEN > out->size - (*pos))
+		{
+			LEN = (unsigned)(out->size - (*pos));
+			error = OUTPUT_FULL;
+		}
+	}
+	else if ((*pos) + LEN >= out->size)
 	{
 		if (!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
 	}
 
-	/*read the literal data: LEN bytes are now stored in the out buffer*/
-	if (p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
-	for (n = 0; n < LEN; n++) out->data[(*pos)++] = in[p++];
+	memcpy(out->data + (*pos), in + p, LEN);
+	(*pos) += LEN;
+	p += LEN;
 
-	(*bp) = p * 8;
+	/*restart the bit buffer after the literal data*/
+	reader->pos = p;
+	reader->buffer = 0;
+	reader->nbits = 0;
 
 	return error;
 }
 
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
+static unsigned inflateHuffmanBlock(ucvector* out, BitReader* reader,
 	size_t* pos, size_t inlength, unsigned btype)
 {
 	unsigned error = 0;
@@ -4017,20 +7392,21 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 	HuffmanTree_init(&tree_ll);
 	HuffmanTree_init(&tree_d);
 
-	if (btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
+	if (btype == 1) error = getTreeInflateFixed(&tree_ll, &tree_d);
 	else if (btype == 2)
 	{
-		error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+		error = getTreeInflateDynamic(&tree_ll, &tree_d, reader, inlength);
 	}
 
 	while (!error) /*decode all symbols until end reached, breaks at end code*/
 	{
 		/*code_ll is literal, length or end code*/
-		unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+		unsigned code_ll = huffmanDecodeSymbol(reader, &tree_ll);
 		if (code_ll <= 255) /*literal symbol*/
 		{
 			if ((*pos) >= out->size)
 			{
+				if (out->bounded) ERROR_BREAK(OUTPUT_FULL);
 				/*reserve more room at once*/
 				if (!ucvector_resize(out, ((*pos) + 1) * 2)) ERROR_BREAK(83 /*alloc fail*/);
 			}
@@ -4042,24 +7418,26 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 			unsigned code_d, distance;
 			unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
 			size_t start, forward, backward, length;
+			unsigned char* dest;
+			const unsigned char* source;
+			unsigned full = 0;
 
 			/*part 1: get length base*/
 			length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
 
 			/*part 2: get extra bits and add the value of that to length*/
 			numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-			if (*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-			length += readBitsFromStream(bp, in, numextrabits_l);
+			length += readBits(reader, numextrabits_l);
 
 			/*part 3: get distance code*/
-			code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+			code_d = huffmanDecodeSymbol(reader, &tree_d);
 			if (code_d > 29)
 			{
-				if (code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+				if (code_d == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
 				{
 					/*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
 					(10=no endcode, 11=wrong jump outside of tree)*/
-					error = (*bp) > inlength * 8 ? 10 : 11;
+					error = bitsUsed(reader) > inbitlength ? 10 : 11;
 				}
 				else error = 18; /*error: invalid distance code (30-31 are never used)*/
 				break;
@@ -4068,27 +7446,45 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 
 			/*part 4: get extra bits from distance*/
 			numextrabits_d = DISTANCEEXTRA[code_d];
-			if (*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-
-			distance += readBitsFromStream(bp, in, numextrabits_d);
+			distance += readBits(reader, numextrabits_d);
+			if (bitsUsed(reader) > inbitlength) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
 			/*part 5: fill in all the out[n] values based on the length and dist*/
 			start = (*pos);
 			if (distance > start) ERROR_BREAK(52); /*too long backward distance*/
 			backward = start - distance;
-			if ((*pos) + length >= out->size)
+			if (out->bounded)
 			{
-				/*reserve more room at once*/
-				if (!ucvector_resize(out, ((*pos) + length) * 2)) ERROR_BREAK(83 /*alloc fail*/);
+				if (length > out->size - start)
+				{
+					length = out->size - start;
+					full = 1;
+				}
+			}
+			else if ((*pos) + length + 8 > out->size)
+			{
+				/*reserve more room at once, with 8 bytes slack as the word copy can overrun*/
+				if (!ucvector_resize(out, ((*pos) + length) * 2 + 8)) ERROR_BREAK(83 /*alloc fail*/);
 			}
 
-			for (forward = 0; forward < length; forward++)
+			dest = out->data + start;
+			source = out->data + backward;
+			if (distance >= 8 && start + length + 8 <= out->allocsize)
 			{
-				out->data[(*pos)] = out->data[backward];
-				(*pos)++;
-				backward++;
-				if (backward >= start) backward = start - distance;
+				/*source words are always already written*/
+				for (forward = 0; forward < length; forward += 8)
+					memcpy(dest + forward, source + forward, 8);
 			}
+			else if (distance == 1)
+				memset(dest, *source, length);
+			else
+			{
+				/*short repeating pattern*/
+				for (forward = 0; forward < length; forward++)
+					dest[forward] = source[forward];
+			}
+			(*pos) += length;
+			if (full) ERROR_BREAK(OUTPUT_FULL);
 		}
 		else if (code_ll == 256)
 		{
@@ -4098,9 +7494,10 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 		{
 			/*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
 			(10=no endcode, 11=wrong jump outside of tree)*/
-			error = (*bp) > inlength * 8 ? 10 : 11;
+			error = bitsUsed(reader) > inbitlength ? 10 : 11;
 			break;
 		}
+		if (bitsUsed(reader) > inbitlength) ERROR_BREAK(10); /*end of input memory reached without endcode*/
 	}
 
 	HuffmanTree_cleanup(&tree_ll);
@@ -4110,16 +7507,16 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
 }
 
 /*get the tree of a deflated block with fixed tree, as specified in the deflate specification*/
-static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
+static unsigned getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 {
-	/*TODO: check for out of memory errors*/
-	generateFixedLitLenTree(tree_ll);
-	generateFixedDistanceTree(tree_d);
+	unsigned error = generateFixedLitLenTree(tree_ll);
+	if (error) return error;
+	return generateFixedDistanceTree(tree_d);
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
 static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-	const unsigned char* in, size_t* bp, size_t inlength)
+	BitReader* reader, size_t inlength)
 {
 	/*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
 	unsigned error = 0;
@@ -4133,14 +7530,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 	unsigned* bitlen_cl = 0;
 	HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-	if ((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
+	if (bitsUsed(reader) / 8 + 2 >= inlength) return 49; /*error: the bit pointer is or will go past the memory*/
 
 	/*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-	HLIT = readBitsFromStream(bp, in, 5) + 257;
+	HLIT = readBits(reader, 5) + 257;
 	/*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-	HDIST = readBitsFromStream(bp, in, 5) + 1;
+	HDIST = readBits(reader, 5) + 1;
 	/*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-	HCLEN = readBitsFromStream(bp, in, 4) + 4;
+	HCLEN = readBits(reader, 4) + 4;
 
 	HuffmanTree_init(&tree_cl);
 
@@ -4153,7 +7550,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
 		for (i = 0; i < NUM_CODE_LENGTH_CODES; i++)
 		{
-			if (i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+			if (i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
 			else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
 		}
 
@@ -4171,7 +7568,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 		i = 0;
 		while (i < HLIT + HDIST)
 		{
-			unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+			unsigned code = huffmanDecodeSymbol(reader, &tree_cl);
 			if (code <= 15) /*a length code*/
 			{
 				if (i < HLIT) bitlen_ll[i] = code;
@@ -4183,10 +7580,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 				unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
 				unsigned value; /*set value to the previous code*/
 
-				if (*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+				if (bitsUsed(reader) >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 				if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-				replength += readBitsFromStream(bp, in, 2);
+				replength += readBits(reader, 2);
 
 				if (i < HLIT + 1) value = bitlen_ll[i - 1];
 				else value = bitlen_d[i - HLIT - 1];
@@ -4202,9 +7599,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 			else if (code == 17) /*repeat "0" 3-10 times*/
 			{
 				unsigned replength = 3; /*read in the bits that indicate repeat length*/
-				if (*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+				if (bitsUsed(reader) >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-				replength += readBitsFromStream(bp, in, 3);
+				replength += readBits(reader, 3);
 
 				/*repeat this value in the next lengths*/
 				for (n = 0; n < replength; n++)
@@ -4219,9 +7616,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 			else if (code == 18) /*repeat "0" 11-138 times*/
 			{
 				unsigned replength = 11; /*read in the bits that indicate repeat length*/
-				if (*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
+				if (bitsUsed(reader) >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-				replength += readBitsFromStream(bp, in, 7);
+				replength += readBits(reader, 7);
 
 				/*repeat this value in the next lengths*/
 				for (n = 0; n < replength; n++)
@@ -4239,7 +7636,7 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 				{
 					/*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
 					(10=no endcode, 11=wrong jump outside of tree)*/
-					error = (*bp) > inbitlength ? 10 : 11;
+					error = bitsUsed(reader) > inbitlength ? 10 : 11;
 				}
 				else error = 16; /*unexisting code, this can never happen*/
 				break;
@@ -4301,73 +7698,115 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-	tree->tree2d = 0;
 	tree->tree1d = 0;
 	tree->lengths = 0;
+	tree->table_len = 0;
+	tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-	myfree(tree->tree2d);
 	myfree(tree->tree1d);
 	myfree(tree->lengths);
+	myfree(tree->table_len);
+	myfree(tree->table_value);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+static unsigned reverseBits(unsigned bits, unsigned num)
 {
-	unsigned nodefilled = 0; /*up to which node it is filled*/
-	unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-	unsigned n, i;
+	unsigned i, result = 0;
+	for (i = 0; i < num; i++) result |= ((bits >> (num - i - 1)) & 1u) << i;
+	return result;
+}
 
-	tree->tree2d = (unsigned*)mymalloc(tree->numcodes * 2 * sizeof(unsigned));
-	if (!tree->tree2d) return 83; /*alloc fail*/
+/*
+make the decoding table from the codes in tree1d. Bits are read lowest
+first, so table indices are codes with their bits reversed. return 
+value is error
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+	const unsigned headsize = 1u << FIRSTBITS;
+	const unsigned mask = (1u << FIRSTBITS) - 1u;
+	unsigned char* maxlens;
+	unsigned long kraft = 0;
+	size_t size, pointer;
+	unsigned i, j;
+
+	/*an oversubscribed code would overlap itself, see comment in lodepng_error_text*/
+	for (i = 0; i < tree->numcodes; i++)
+	{
+		if (tree->lengths[i] > 15) return 55;
+		if (tree->lengths[i]) kraft += 1ul << (15 - tree->lengths[i]);
+	}
+	if (kraft > (1ul << 15)) return 55;
 
-	/*
-	convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-	uninited, a value >= numcodes is an address to another bit, a value < numcodes
-	is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-	many columns as codes - 1.
-	A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-	Here, the internal nodes are stored (what their 0 and 1 option point to).
-	There is only memory for such good tree currently, if there are more nodes
-	(due to too long length codes), error 55 will happen
-	*/
-	for (n = 0; n < tree->numcodes * 2; n++)
+	/*size of the subtable for each first level entry*/
+	maxlens = (unsigned char*)mymalloc(headsize);
+	if (!maxlens) return 83; /*alloc fail*/
+	memset(maxlens, 0, headsize);
+	for (i = 0; i < tree->numcodes; i++)
+	{
+		unsigned l = tree->lengths[i];
+		unsigned index;
+		if (l <= FIRSTBITS) continue;
+		index = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+		if (l > maxlens[index]) maxlens[index] = (unsigned char)l;
+	}
+	size = headsize;
+	for (i = 0; i < headsize; i++)
+	{
+		if (maxlens[i] > FIRSTBITS) size += (size_t)1 << (maxlens[i] - FIRSTBITS);
+	}
+
+	tree->table_len = (unsigned char*)mymalloc(size);
+	tree->table_value = (unsigned short*)mymalloc(size * sizeof(unsigned short));
+	if (!tree->table_len || !tree->table_value)
+	{
+		myfree(maxlens);
+		return 83; /*alloc fail*/
+	}
+	memset(tree->table_len, INVALIDBITS, size);
+	memset(tree->table_value, 0, size * sizeof(unsigned short));
+
+	pointer = headsize;
+	for (i = 0; i < headsize; i++)
 	{
-		tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+		if (maxlens[i] <= FIRSTBITS) continue;
+		tree->table_len[i] = maxlens[i];
+		tree->table_value[i] = (unsigned short)pointer;
+		pointer += (size_t)1 << (maxlens[i] - FIRSTBITS);
 	}
+	myfree(maxlens);
 
-	for (n = 0; n < tree->numcodes; n++) /*the codes*/
+	for (i = 0; i < tree->numcodes; i++)
 	{
-		for (i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+		unsigned l = tree->lengths[i];
+		unsigned reverse;
+		if (l == 0) continue;
+		reverse = reverseBits(tree->tree1d[i], l);
+		if (l <= FIRSTBITS)
 		{
-			unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-			if (treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-			if (tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+			/*every entry whose low l bits are the code*/
+			for (j = 0; j < (1u << (FIRSTBITS - l)); j++)
 			{
-				if (i + 1 == tree->lengths[n]) /*last bit*/
-				{
-					tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-					treepos = 0;
-				}
-				else
-				{
-					/*put address of the next step in here, first that address has to be found of course
-					(it's just nodefilled + 1)...*/
-					nodefilled++;
-					/*addresses encoded with numcodes added to it*/
-					tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-					treepos = nodefilled;
-				}
+				tree->table_len[reverse | (j << l)] = (unsigned char)l;
+				tree->table_value[reverse | (j << l)] = (unsigned short)i;
 			}
-			else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
 		}
-	}
+		else
+		{
+			unsigned index = reverse & mask;
+			unsigned sublen = tree->table_len[index] - FIRSTBITS;
+			unsigned start = tree->table_value[index];
+			unsigned rest = reverse >> FIRSTBITS;
 
-	for (n = 0; n < tree->numcodes * 2; n++)
-	{
-		if (tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
+			for (j = 0; j < (1u << (sublen - (l - FIRSTBITS))); j++)
+			{
+				tree->table_len[start + (rest | (j << (l - FIRSTBITS)))] = (unsigned char)l;
+				tree->table_value[start + (rest | (j << (l - FIRSTBITS)))] = (unsigned short)i;
+			}
+		}
 	}
 
 	return 0;
@@ -4413,7 +7852,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
 	uivector_cleanup(&blcount);
 	uivector_cleanup(&nextcode);
 
-	if (!error) return HuffmanTree_make2DTree(tree);
+	if (!error) return HuffmanTree_makeTable(tree);
 	else return error;
 }
 
@@ -4436,27 +7875,30 @@ static unsigned HuffmanTree_makeFromLengths(HuffmanTree* tree, const unsigned* b
 
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code, or (unsigned)(-1) if error happened. Running off the
+end of the data isn't detected here, the caller checks bitsUsed()
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-	const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-	unsigned treepos = 0, ct;
-	for (;;)
-	{
-		if (*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-		/*
-		decode the symbol from the tree. The "readBitFromStream" code is inlined in
-		the expression below because this is the biggest bottleneck while decoding
-		*/
-		ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-		(*bp)++;
-		if (ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-		else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
+	unsigned code, l, value;
 
-		if (treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+	ensureBits(reader, 15);
+	code = peekBits(reader, FIRSTBITS);
+	l = codetree->table_len[code];
+	value = codetree->table_value[code];
+	if (l <= FIRSTBITS)
+	{
+		advanceBits(reader, l);
+		return value;
 	}
+	if (l == INVALIDBITS) return (unsigned)(-1); /*error: not a code*/
+	/*long code, look up the rest in the subtable*/
+	advanceBits(reader, FIRSTBITS);
+	value += peekBits(reader, l - FIRSTBITS);
+	l = codetree->table_len[value];
+	if (l == INVALIDBITS) return (unsigned)(-1);
+	advanceBits(reader, l - FIRSTBITS);
+	return codetree->table_value[value];
 }
 
 
@@ -4484,8 +7926,64 @@ static unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, co
 	size_t insize, const LodePNGDecompressSettings* settings)
 {
 	unsigned error = 0;
-	unsigned CM, CINFO, FDICT;
 
+	error = lodepng_zlib_checkheader(in, insize);
+	if (error) return error;
+	error = lodepng_inflate(out, outsize, in + 2, insize - 2, settings);
+	if (error) return error;
+
+	if (!settings->ignore_adler32)
+	{
+		unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
+		unsigned checksum = adler32(*out, (unsigned)(*outsize));
+		if (checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+	}
+
+	return 0; /*no error*/
+}
+
+/*
+  (not Lode's) As lodepng_zlib_decompress(), but into a buffer the 
+  caller has allocated, with no reallocation. Decoding stops when the
+  buffer is full, which isn't an error.
+     out - buffer for output
+	       outsize - size of out
+		   decoded - return for number of bytes decoded
+		   in - the zlib stream
+		   insize - number of bytes in input stream
+		   settings - as lodepng_zlib_decompress()
+	returns: an error code, 0 on success
+*/
+static unsigned lodepng_zlib_decompress_into(unsigned char* out, size_t outsize, size_t* decoded,
+	const unsigned char* in, size_t insize, const LodePNGDecompressSettings* settings)
+{
+	unsigned error;
+	ucvector v;
+
+	*decoded = 0;
+	error = lodepng_zlib_checkheader(in, insize);
+	if (error) return error;
+	ucvector_init_bounded(&v, out, outsize);
+	error = lodepng_inflatev(&v, in + 2, insize - 2, settings);
+	*decoded = v.size;
+	/*if we stopped early there's no checksum to test against*/
+	if (error == OUTPUT_FULL) return 0;
+	if (error) return error;
+
+	if (!settings->ignore_adler32)
+	{
+		unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
+		unsigned checksum = adler32(out, (unsigned)(*decoded));
+		if (checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
+	}
+
+	return 0;
+}
+
+/*check the zlib header, return value is error*/
+static unsigned lodepng_zlib_checkheader(const unsigned char* in, size_t insize)
+{
+	unsigned CM, CINFO, FDICT;
 
 	if (insize < 2) return 53; /*error, size of zlib data too small*/
 							   /*read information from zlib header*/
@@ -4512,20 +8010,8 @@ static unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, co
 		"The additional flags shall not specify a preset dictionary."*/
 		return 26;
 	}
-	error = lodepng_inflate(out, outsize, in + 2, insize - 2, settings);
-	if (error) return error;
-
-	if (!settings->ignore_adler32)
-	{
-		unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
-		unsigned checksum = adler32(*out, (unsigned)(*outsize));
-		if (checksum != ADLER32) return 58; /*error, adler checksum not correct, data must be corrupted*/
-	}
 
-	return 0; /*no error*/
-#if LODEPNG_CUSTOM_ZLIB_DECODER == 1
-}
-#endif /*LODEPNG_CUSTOM_ZLIB_DECODER == 1*/
+	return 0;
 }
 
 static unsigned lodepng_inflate(unsigned char** out, size_t* outsize,
@@ -4558,8 +8044,7 @@ static unsigned lodepng_inflatev(ucvector* out,
 	const unsigned char* in, size_t insize,
 	const LodePNGDecompressSettings* settings)
 {
-	/*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-	size_t bp = 0;
+	BitReader reader;
 	unsigned BFINAL = 0;
 	size_t pos = 0; /*byte position in the out buffer*/
 
@@ -4567,23 +8052,25 @@ static unsigned lodepng_inflatev(ucvector* out,
 
 	(void)settings;
 
+	initBitReader(&reader, in, insize);
 	while (!BFINAL)
 	{
 		unsigned BTYPE;
-		if (bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-		BFINAL = readBitFromStream(&bp, in);
-		BTYPE = 1 * readBitFromStream(&bp, in);
-		BTYPE += 2 * readBitFromStream(&bp, in);
+		if (bitsUsed(&reader) + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
+		BFINAL = readBits(&reader, 1);
+		BTYPE = readBits(&reader, 2);
 
 		if (BTYPE == 3) return 20; /*error: invalid BTYPE*/
-		else if (BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-		else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+		else if (BTYPE == 0) error = inflateNoCompression(out, &reader, &pos, insize); /*no compression*/
+		else error = inflateHuffmanBlock(out, &reader, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
 
+		if (error == OUTPUT_FULL) out->size = pos;
 		if (error) return error;
 	}
 
 	/*Only now we know the true size of out, resize it to that*/
-	if (!ucvector_resize(out, pos)) error = 83; /*alloc fail*/
+	if (out->bounded) out->size = pos;
+	else if (!ucvector_resize(out, pos)) error = 83; /*alloc fail*/
 
 	return error;
 }
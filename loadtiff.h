@@ -27,6 +27,123 @@
      alpha is premultiplied = composted on black. To get
         the image composted on white, call floadtiffwhite() 
      width is image width, height is image height in pixels
+
+  If the file is already in memory, call
+     data = loadtiff_mem(buf, len, &width, &height, &format);
+  or to have the loader map it for you
+     data = loadtiff_mmap("tiffile.tiff", &width, &height, &format);
+  Strips and tiles are then decoded straight from the file bytes.
+
+  BigTIFF files (with 64 bit offsets, for images over 4GB) are read 
+  the same way as ordinary ones.
+
+  To read from somewhere else (a cache, a network store), fill in a
+  TIFFIO and call loadtiff_io(). read() is like pread(): it copies N
+  bytes from position offset of the file into dest and returns the
+  number of bytes copied, short at end of file. There is no shared
+  file position, so a read() which is itself thread-safe lets strips
+  be fetched concurrently. If the file is in memory anyway, set data
+  and len instead of read, and the bytes are used in place.
+
+  For more control, fill in a TIFFOPTIONS and call loadtiff_ex()
+     TIFFOPTIONS opt;
+     loadtiff_defaultoptions(&opt);
+     opt.nthreads = 8;
+     data = loadtiff_ex(&io, &opt, &width, &height, &format);
+  nthreads only has an effect if the loader was compiled with
+  LOADTIFF_THREADS defined (and linked with pthreads on Unix).
+  Strips and tiles are then shared out among the threads, and read()
+  is called from all of them, so it must be thread-safe.
+
+  To get just part of a big image, call
+     data = loadtiff_region(&io, x, y, w, h, &format);
+  or set x, y, width and height in the TIFFOPTIONS. The raster is then 
+  w by h, and only the strips or tiles it touches are decoded. The 
+  rectangle must lie inside the image.
+
+  Big images can be decoded without holding them in memory
+     int rows(void *ptr, const unsigned char *data, int y, int N, int width, int format)
+     {
+        write N rows, starting at row y, out from data
+        return 0;   (or non-zero to stop)
+     }
+     err = loadtiff_stream(&io, &opt, rows, ptr, &width, &height, &format);
+  Rows come top to bottom, a strip or a row of tiles at a time, in the
+  same layout loadtiff_ex() returns. Only one band is in memory at once.
+
+  For a thumbnail, set
+     opt.scale = 8;
+  (or 2 or 4) and the image comes back shrunk by that much, each pixel
+  the average of a block, with width and height rounded up. The full
+  size image is never held in memory, only a band of it. scale works
+  with regions, loadtiff_stream() and loadtiff_into() too.
+
+  To decode into memory you already have (a texture, part of an atlas)
+     TIFFINFO info;
+     loadtiff_probe(&io, &info);
+     err = loadtiff_into(&io, &opt, pixels, stride, FMT_RGBA);
+  stride is the bytes from one row to the next, and may include padding.
+  Any 8 bit image can be had as FMT_RGBA, FMT_RGB, FMT_GREYALPHA or 
+  FMT_GREY, and any image in the format loadtiff_ex() would give it in,
+  which is decoded straight into place.
+
+  For files with several pages (IFDs), open the file and ask for 
+  pages by number
+     TIFFFILE *tf = loadtiff_open(&io);
+     N = loadtiff_npages(tf);
+     data = loadtiff_page(tf, 2, 0, &width, &height, &format);
+     loadtiff_close(tf);
+  The positions of pages already seen are kept, so only the first visit
+  to a page walks the chain of IFDs, and each page's tags (the strip or
+  tile offsets and so on) are read once and kept until the file is 
+  closed. So for many regions out of the same file, open it once
+     data = loadtiff_page(tf, 0, &opt, &width, &height, &format);
+     err = loadtiff_pageinto(tf, 0, &opt, pixels, stride, FMT_RGBA);
+     err = loadtiff_pagestream(tf, 0, &opt, rows, ptr, &width, &height, &format);
+  with the region in opt. loadtiff_seekpage() tells you if a page 
+  exists without decoding it. io must stay valid until the file is 
+  closed. If the loader was compiled with LOADTIFF_THREADS, any number
+  of threads can decode from one TIFFFILE at once (read() must then be 
+  thread-safe). Otherwise it must not be used by two threads at once.
+
+  When regions overlap, as they do in a viewer, decoded strips and 
+  tiles can be kept so they aren't decoded again
+     TIFFCACHE *cache = loadtiff_createcache(256 * 1024 * 1024);
+     loadtiff_setcache(tf, cache);
+     ...
+     loadtiff_cachestats(cache, &stats);
+     loadtiff_close(tf);
+     loadtiff_killcache(cache);
+  One cache, with a limit on the bytes it holds, can serve any number 
+  of open files and threads. The least recently used strips and tiles
+  go first when it is full.
+
+  To find out what is in a file without decoding it, call
+     TIFFINFO info;
+     if (loadtiff_probe(&io, &info) == 0)
+        printf("%d x %d, %d pages\n", info.width, info.height, info.npages);
+  or loadtiff_pageinfo() for a page of an open file. It only succeeds 
+  if the image is one we can decode.
+
+  To see where the time goes, compile the loader with LOADTIFF_STATS
+  defined and set
+     TIFFSTATS stats = {0};
+     opt.stats = &stats;
+  Each decode then adds the nanoseconds it spent parsing, reading, 
+  decompressing (by codec), converting samples, undoing the predictor
+  and pasting into the raster to stats, and counts reads, bytes read,
+  allocations, and compressed and decompressed bytes. Without 
+  LOADTIFF_STATS none of this is compiled in and stats is left alone.
+  Threads of one decode are added up safely, but two decodes running
+  at once need a TIFFSTATS each.
+
+  16 bit and floating point images are normally cut down to 8 bits. Set
+     opt.highdepth = 1;
+  to keep their samples. 16 bit images then come back as unsigned 
+  shorts, and floating point images as floats, in the machine's byte 
+  order, and the format is one of the FMT_*16 or FMT_*F codes. Alpha
+  is 65535 or 1.0 if the file has none. Palette and YCbCr images, and
+  images with fewer bits, still come back as 8 bits, so check format.
   */
 
 #define FMT_ERROR 0
@@ -36,8 +153,134 @@
 #define FMT_GREYALPHA 4
 #define FMT_RGB 5
 #define FMT_GREY 6
+#define FMT_GREYALPHA16 7
+#define FMT_RGBA16 8
+#define FMT_CMYK16 9
+#define FMT_CMYKA16 10
+#define FMT_GREYALPHAF 11
+#define FMT_RGBAF 12
+#define FMT_CMYKF 13
+#define FMT_CMYKAF 14
+
+/* a position in a file, 64 bits for BigTIFF */
+typedef unsigned long long TIFFOFFSET;
+
+typedef struct
+{
+  void *ptr;
+  size_t (*read)(void *ptr, TIFFOFFSET offset, size_t N, unsigned char *dest);
+  const unsigned char *data;
+  size_t len;
+} TIFFIO;
+
+/* slots in TIFFSTATS.decompress_ns */
+#define TIFFSTATS_NONE 0
+#define TIFFSTATS_CCITTRLE 1
+#define TIFFSTATS_GROUP3 2
+#define TIFFSTATS_GROUP4 3
+#define TIFFSTATS_LZW 4
+#define TIFFSTATS_DEFLATE 5
+#define TIFFSTATS_PACKBITS 6
+#define TIFFSTATS_OTHER 7
+#define TIFFSTATS_CODECS 8
+
+/* where the time went, filled in only if compiled with LOADTIFF_STATS */
+typedef struct
+{
+  unsigned long long parse_ns;          /* file header, IFD and tags */
+  unsigned long long io_ns;             /* in TIFFIO read(), parsing included */
+  unsigned long long decompress_ns[TIFFSTATS_CODECS];
+  unsigned long long unpack_ns;         /* grey, RGB and CMYK samples */
+  unsigned long long palette_ns;
+  unsigned long long ycbcr_ns;
+  unsigned long long deep_ns;           /* 16 bit, float and other samples */
+  unsigned long long predictor_ns;
+  unsigned long long paste_ns;          /* copying into the raster */
+  unsigned long long bytesread;         /* by read(), tags as well as pixels */
+  unsigned long long reads;             /* read() calls, each a seek */
+  unsigned long long allocations;
+  unsigned long long units;             /* strips and tiles decompressed */
+  unsigned long long compressedbytes;
+  unsigned long long decompressedbytes;
+} TIFFSTATS;
+
+typedef struct
+{
+  int nthreads;
+  int x;
+  int y;
+  int width;
+  int height;
+  int highdepth;             /* keep 16 bit and float samples */
+  int scale;                 /* 1 for full size, 2, 4 or 8 to shrink by */
+  TIFFSTATS *stats;          /* added to, if compiled with LOADTIFF_STATS */
+} TIFFOPTIONS;
+
+typedef struct tifffile TIFFFILE;
+typedef struct tiffcache TIFFCACHE;
+
+typedef int (*TIFFROWFUNC)(void *ptr, const unsigned char *rows, int y, int Nrows, int width, int format);
+
+/* counters of a TIFFCACHE */
+typedef struct
+{
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long entries;     /* strips and tiles held */
+  size_t bytes;              /* memory their pixels take */
+} TIFFCACHESTATS;
+
+/* what a TIFF holds, values as in the TIFF tags */
+typedef struct
+{
+  int width;
+  int height;
+  int samplesperpixel;
+  int bitspersample[16];
+  int sampleformat[16];      /* 1 unsigned, 2 signed, 3 IEEE float */
+  int extrasamples;
+  int photometric;           /* 0 WhiteIsZero, 1 BlackIsZero, 2 RGB, 3 palette, 5 CMYK, 6 YCbCr */
+  int compression;           /* 1 none, 2 CCITT RLE, 3 Group 3, 4 Group 4, 5 LZW, 8 Deflate, 32773 PackBits */
+  int predictor;
+  int planarconfig;          /* 1 interleaved, 2 separate planes */
+  int tiled;
+  int tilewidth;
+  int tileheight;
+  int rowsperstrip;
+  int subsampling_h;         /* YCbCr chroma subsampling, else 1 */
+  int subsampling_v;
+  double xresolution;
+  double yresolution;
+  int resolutionunit;
+  int npages;
+  int bigtiff;               /* set for a BigTIFF file */
+} TIFFINFO;
 
 unsigned char *floadtiffwhite(FILE *fp, int *width, int *height, int *format);
 unsigned char *floadtiff(FILE *fp, int *width, int *height, int *format);
+unsigned char *loadtiff_mem(const unsigned char *buf, size_t len, int *width, int *height, int *format);
+unsigned char *loadtiff_mmap(const char *fname, int *width, int *height, int *format);
+unsigned char *loadtiff_io(const TIFFIO *io, int *width, int *height, int *format);
+void loadtiff_defaultoptions(TIFFOPTIONS *opt);
+unsigned char *loadtiff_region(const TIFFIO *io, int x, int y, int width, int height, int *format);
+unsigned char *loadtiff_ex(const TIFFIO *io, const TIFFOPTIONS *opt, int *width, int *height, int *format);
+int loadtiff_stream(const TIFFIO *io, const TIFFOPTIONS *opt, TIFFROWFUNC fn, void *ptr, int *width, int *height, int *format);
+int loadtiff_into(const TIFFIO *io, const TIFFOPTIONS *opt, unsigned char *buff, size_t stride, int format);
+
+TIFFFILE *loadtiff_open(const TIFFIO *io);
+void loadtiff_close(TIFFFILE *tf);
+int loadtiff_npages(TIFFFILE *tf);
+int loadtiff_seekpage(TIFFFILE *tf, int page);
+unsigned char *loadtiff_page(TIFFFILE *tf, int page, const TIFFOPTIONS *opt, int *width, int *height, int *format);
+int loadtiff_pagestream(TIFFFILE *tf, int page, const TIFFOPTIONS *opt, TIFFROWFUNC fn, void *ptr, int *width, int *height, int *format);
+int loadtiff_pageinto(TIFFFILE *tf, int page, const TIFFOPTIONS *opt, unsigned char *buff, size_t stride, int format);
+int loadtiff_pageinfo(TIFFFILE *tf, int page, TIFFINFO *info);
+int loadtiff_probe(const TIFFIO *io, TIFFINFO *info);
+
+TIFFCACHE *loadtiff_createcache(size_t maxbytes);
+void loadtiff_killcache(TIFFCACHE *cache);
+void loadtiff_setcache(TIFFFILE *tf, TIFFCACHE *cache);
+void loadtiff_cachestats(TIFFCACHE *cache, TIFFCACHESTATS *stats);
 
 #endif